@@ -0,0 +1,627 @@
+/*
+ *  nfqueue-bench - throughput and latency benchmark for nfqueue-mnl.h
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+#include "nfqueue-mnl-group.h"  //must be first, defines _GNU_SOURCE
+
+#include <arpa/inet.h>          //htons, inet_addr
+#include <fcntl.h>              //open
+#include <getopt.h>             //getopt
+#include <linux/if_ether.h>     //ethhdr, ETH_P_IP
+#include <linux/if_packet.h>    //sockaddr_ll
+#include <net/if.h>             //if_nametoindex
+#include <netinet/ip.h>         //iphdr
+#include <netinet/udp.h>        //udphdr
+#include <stdarg.h>             //va_list
+
+
+/*
+Benchmark setup
+
+Packets are generated by a sender thread in network namespace BENCH_NETNS, which writes raw Ethernet frames
+(AF_PACKET, sendmmsg) to one end of a veth pair. The other end (BENCH_DEV) is in the initial namespace, where an
+iptables rule queues UDP packets arriving on it. Source ports are cycled through flows values, so that
+--queue-balance spreads packets over queues in fanout mode. Verdicts are accepts; accepted packets are dropped by
+the stack, since nothing listens on the destination port.
+
+Every mode opens its queue(s) anew, so kernel drop counters start from zero. Reported values:
+pps        packets that got a verdict, per second
+sys/pkt    receive and verdict syscalls per packet, counted by the benchmark
+cpu(ns)    CPU time (user and system) of receiving threads per packet; softirq time of the sender is not included
+p50..p999  time from packet->mono_time (taken after the datagram is received) to the verdict send that covers it
+drops      packets dropped by kernel since the queue was bound (queue full or socket buffer overrun)
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+
+#define BENCH_NETNS    "nfqbench"
+#define BENCH_DEV      "nfqb0"
+#define BENCH_PEER     "nfqb1"
+#define BENCH_ADDR     "10.203.0.1"
+#define BENCH_PEER_ADDR "10.203.0.2"
+#define BENCH_PORT     9
+#define BENCH_BURST    64
+#define BENCH_MAX_PKTS 8192  //max packets per nfqueue_receive() whose timestamps are kept until the flush
+#define BENCH_DRAIN_MS 200   //sender stops this long before the receiver, so that queued packets are drained
+
+enum
+{
+    MODE_COPY,      //payload copied, one verdict per packet
+    MODE_ZEROCOPY,  //payload view, one verdict per packet
+    MODE_BATCH,     //payload view, batch verdict per receive
+    MODE_VQ,        //payload view, verdict queue flushed per receive
+    MODE_FANOUT,    //queue group, one worker per queue
+    MODE_COUNT,
+};
+
+static const char* mode_names[MODE_COUNT] = { "copy", "zerocopy", "batch", "vq", "fanout" };
+
+struct bench_config
+{
+    int                queue_num;
+    int                workers;    //queues in fanout mode
+    int                mode;       //MODE_*, or MODE_COUNT for all
+    uint32_t           size;       //UDP payload bytes
+    uint32_t           flows;
+    int                duration;   //seconds per mode
+    uint64_t           rate;       //packets per second; zero means as fast as possible
+    uint32_t           queue_len;
+    bool               setup;      //create namespace, rules and sender
+};
+
+struct bench_result
+{
+    uint64_t           packets;
+    uint64_t           syscalls;
+    uint64_t           cpu_ns;
+    double             seconds;
+    struct nf_queue_stats stats;
+    uint64_t           drops;
+};
+
+static struct bench_config config =
+{
+    .queue_num = 0,
+    .workers = 4,
+    .mode = MODE_COUNT,
+    .size = 64,
+    .flows = 1024,
+    .duration = 5,
+    .rate = 0,
+    .queue_len = 4096,
+    .setup = true,
+};
+
+static atomic_bool sender_stop;
+static int64_t sender_deadline;
+static _Atomic(uint64_t) sender_packets;
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t thread_cpu_ns(pthread_t thread)
+{
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &ts) < 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static bool run(const char* fmt, ...)
+{
+    char cmd[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, args);
+    va_end(args);
+    int ret = system(cmd);
+    if (ret != 0)
+    {
+        LOG(LOG_ERR, "Command failed (%d): %s", ret, cmd);
+        return false;
+    }
+    return true;
+}
+
+
+static void merge_stats(struct nf_queue_stats* sum, const struct nf_queue_stats* s)
+{
+    sum->packets += s->packets;
+    sum->bytes += s->bytes;
+    sum->batches += s->batches;
+    sum->parse_errors += s->parse_errors;
+    sum->enobufs += s->enobufs;
+    sum->verdict_errors += s->verdict_errors;
+    sum->latency_count += s->latency_count;
+    sum->latency_sum += s->latency_sum;
+    for (int i = 0; i < NF_HIST_BUCKETS; i++)
+        sum->latency[i] += s->latency[i];
+}
+
+
+static uint64_t kernel_drops(int first_queue, int count)
+{
+    uint64_t drops = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct nf_kernel_stats ks;
+        if (nfqueue_kernel_stats(first_queue + i, &ks))
+            drops += ks.queue_dropped + ks.user_dropped;
+    }
+    return drops;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Network setup
+
+
+static void teardown(void)
+{
+    int ret = system("ip netns del " BENCH_NETNS " 2>/dev/null");  //may not exist
+    (void)ret;
+}
+
+
+static bool setup(void)
+{
+    teardown();
+    return run("ip netns add " BENCH_NETNS)
+        && run("ip link add " BENCH_DEV " type veth peer name " BENCH_PEER " netns " BENCH_NETNS)
+        && run("ip addr add " BENCH_ADDR "/24 dev " BENCH_DEV)
+        && run("ip link set " BENCH_DEV " up")
+        && run("ip -n " BENCH_NETNS " addr add " BENCH_PEER_ADDR "/24 dev " BENCH_PEER)
+        && run("ip -n " BENCH_NETNS " link set " BENCH_PEER " up");
+}
+
+
+//Add (op is 'I') or delete (op is 'D') the queueing rule for count queues
+static bool queue_rule(char op, int first_queue, int count)
+{
+    char target[64];
+    if (count == 1)
+        snprintf(target, sizeof(target), "--queue-num %d", first_queue);
+    else
+        snprintf(target, sizeof(target), "--queue-balance %d:%d", first_queue, first_queue + count - 1);
+    return run("iptables -%c INPUT -i " BENCH_DEV " -p udp --dport %d -j NFQUEUE %s", op, BENCH_PORT, target);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sender
+
+
+static bool read_mac(const char* dev, uint8_t mac[ETH_ALEN])
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/address", dev);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        LOG_SYSERR("fopen(%s)", path);
+        return false;
+    }
+    int n = fscanf(f, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+    fclose(f);
+    return n == ETH_ALEN;
+}
+
+
+//Frame: Ethernet + IPv4 + UDP + size bytes of payload, with valid checksums
+static size_t build_frame(uint8_t* frame, const uint8_t dst_mac[ETH_ALEN], uint32_t size)
+{
+    size_t len = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + size;
+    memset(frame, 0, len);
+    struct ethhdr* eth = (struct ethhdr*)frame;
+    memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, (uint8_t[ETH_ALEN]){ 0x02, 0, 0, 0, 0, 0x02 }, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+
+    struct iphdr* ip = (struct iphdr*)(eth + 1);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(len - sizeof(struct ethhdr));
+    ip->saddr = inet_addr(BENCH_PEER_ADDR);
+    ip->daddr = inet_addr(BENCH_ADDR);
+
+    struct udphdr* udp = (struct udphdr*)(ip + 1);
+    udp->source = htons(1024);
+    udp->dest = htons(BENCH_PORT);
+    udp->len = htons(sizeof(struct udphdr) + size);
+    for (uint32_t i = 0; i < size; i++)
+        ((uint8_t*)(udp + 1))[i] = (uint8_t)i;
+
+    nfqueue_csum_ipv4(ip, len - sizeof(struct ethhdr));
+    nfqueue_csum_l4(ip, len - sizeof(struct ethhdr));
+    return len;
+}
+
+
+static void* sender_thread(void* arg)
+{
+    const uint8_t* dst_mac = arg;
+
+    //Only this thread moves to the namespace
+    int ns = open("/var/run/netns/" BENCH_NETNS, O_RDONLY | O_CLOEXEC);
+    if (ns < 0 || setns(ns, CLONE_NEWNET) < 0)
+    {
+        LOG_SYSERR("setns(" BENCH_NETNS ")");
+        return NULL;
+    }
+    close(ns);
+
+    int fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0)
+    {
+        LOG_SYSERR("socket(AF_PACKET)");
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    struct sockaddr_ll addr =
+    {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = if_nametoindex(BENCH_PEER),
+        .sll_halen = ETH_ALEN,
+    };
+    memcpy(addr.sll_addr, dst_mac, ETH_ALEN);
+
+    size_t frame_size = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + config.size;
+    uint8_t* frames = malloc(frame_size * BENCH_BURST);
+    ASSERT(frames != NULL);
+    struct iovec iov[BENCH_BURST];
+    struct mmsghdr msgs[BENCH_BURST];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BENCH_BURST; i++)
+    {
+        build_frame(frames + i * frame_size, dst_mac, config.size);
+        iov[i].iov_base = frames + i * frame_size;
+        iov[i].iov_len = frame_size;
+        msgs[i].msg_hdr.msg_name = &addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t sent = 0;
+    uint32_t flow = 0;
+    int64_t start = now_ns();
+    while (!atomic_load_explicit(&sender_stop, memory_order_relaxed) && now_ns() < sender_deadline)
+    {
+        int burst = BENCH_BURST;
+        if (config.rate > 0)
+        {
+            uint64_t due = (uint64_t)(now_ns() - start) * config.rate / 1000000000;
+            if (due <= sent)
+            {
+                struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000 };
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            if (due - sent < (uint64_t)burst)
+                burst = due - sent;
+        }
+
+        //Cycle source port through flows, updating UDP checksum incrementally
+        for (int i = 0; i < burst; i++)
+        {
+            struct udphdr* udp = (struct udphdr*)(frames + i * frame_size + sizeof(struct ethhdr) + sizeof(struct iphdr));
+            uint16_t port = htons(1024 + flow);
+            udp->check = nfqueue_csum_replace16(udp->check, udp->source, port);
+            udp->source = port;
+            flow = (flow + 1) % config.flows;
+        }
+        int n = sendmmsg(fd, msgs, burst, 0);
+        if (n < 0)
+        {
+            if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+                continue;
+            LOG_SYSERR("sendmmsg");
+            break;
+        }
+        sent += n;
+    }
+    atomic_store(&sender_packets, sent);
+    free(frames);
+    close(fd);
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Receivers
+
+
+//Run one single-queue mode until deadline
+static bool bench_queue(int mode, int64_t deadline, struct bench_result* r)
+{
+    struct nf_queue_options opt;
+    nfqueue_default_options(&opt);
+    opt.queue_len = config.queue_len;
+    opt.rcvbuf = 8 << 20;
+    opt.flags = 0;  //conntrack info is not needed
+    struct nf_queue q[1];
+    if (!nfqueue_open2(q, config.queue_num, &opt))
+        return false;
+
+    struct nf_buffer buf[1];
+    memset(buf, 0, sizeof(*buf));
+    buf->zero_copy = mode != MODE_COPY;
+    struct nf_verdict_batch batch[1];
+    nfqueue_batch_init(batch, q, 0);
+    struct nf_verdict_queue vq[1];
+    if (!nfqueue_vq_init(vq, q, 0, 0, 0))
+    {
+        nfqueue_close(q);
+        return false;
+    }
+
+    static struct timespec pending[BENCH_MAX_PKTS];  //mono_time of packets waiting for the flush
+    struct nf_packet stamp;
+    memset(&stamp, 0, sizeof(stamp));
+    uint64_t cpu0 = thread_cpu_ns(pthread_self());
+    int64_t start = now_ns();
+    int64_t last = start;
+
+    while (now_ns() < deadline)
+    {
+        int ret = nfqueue_receive(q, buf, 100);
+        r->syscalls++;  //select
+        if (ret == IO_ERROR)
+            break;
+        if (ret != IO_READY)
+            continue;
+        r->syscalls++;  //recvfrom
+
+        int count = 0;
+        struct nf_packet packet[1];
+        while (nfqueue_next(buf, packet) == IO_READY)
+        {
+            switch (mode)
+            {
+                case MODE_COPY:
+                case MODE_ZEROCOPY:
+                    nfqueue_verdict(q, packet->packet_id, NF_ACCEPT, -1);
+                    nfqueue_stats_latency(q, packet, buf->timestamps);
+                    r->syscalls++;
+                    break;
+                case MODE_BATCH:
+                    nfqueue_batch_verdict(batch, packet->packet_id, NF_ACCEPT, -1);
+                    break;
+                case MODE_VQ:
+                    nfqueue_vq_push(vq, packet->packet_id, NF_ACCEPT, -1);
+                    break;
+            }
+            if (mode == MODE_BATCH || mode == MODE_VQ)
+            {
+                if (count < BENCH_MAX_PKTS)
+                    pending[count] = packet->mono_time;
+                count++;
+            }
+            nfqueue_packet_free(packet);
+            r->packets++;
+        }
+
+        if (count > 0)
+        {
+            if (mode == MODE_BATCH)
+                nfqueue_batch_flush(batch);
+            else
+                nfqueue_vq_flush(vq);
+            r->syscalls++;
+            for (int i = 0; i < count && i < BENCH_MAX_PKTS; i++)
+            {
+                stamp.mono_time = pending[i];
+                nfqueue_stats_latency(q, &stamp, buf->timestamps);
+            }
+        }
+        last = now_ns();
+    }
+
+    r->cpu_ns = thread_cpu_ns(pthread_self()) - cpu0;
+    r->seconds = (last - start) / 1e9;
+    nfqueue_stats(q, &r->stats);
+    r->drops = kernel_drops(config.queue_num, 1);
+    nfqueue_vq_free(vq);
+    free(buf->data);
+    nfqueue_close(q);
+    return true;
+}
+
+
+static int fanout_callback(struct nf_packet* packet, int64_t* connmark, void* ctx)
+{
+    return NF_ACCEPT;
+}
+
+
+static bool bench_fanout(int64_t deadline, struct bench_result* r)
+{
+    struct nf_group_options opt;
+    nfqueue_group_default_options(&opt);
+    opt.queue.queue_len = config.queue_len;
+    opt.queue.rcvbuf = 8 << 20;
+    opt.queue.flags = 0;
+    struct nf_queue_group group[1];
+    if (!nfqueue_group_open(group, config.queue_num, config.workers, &opt))
+        return false;
+    if (!nfqueue_group_start(group, fanout_callback, NULL))
+    {
+        nfqueue_group_close(group);
+        return false;
+    }
+
+    int64_t start = now_ns();
+    struct timespec ts = { .tv_sec = (deadline - start) / 1000000000, .tv_nsec = (deadline - start) % 1000000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    for (int i = 0; i < group->count; i++)
+        r->cpu_ns += thread_cpu_ns(group->workers[i].thread);
+    nfqueue_group_stop(group);
+    r->seconds = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < group->count; i++)
+    {
+        struct nf_queue_stats s;
+        nfqueue_stats(&group->workers[i].q, &s);
+        merge_stats(&r->stats, &s);
+        r->packets += group->workers[i].packets;
+    }
+    r->syscalls = 3 * r->stats.batches;  //select, recvfrom and verdict queue flush per datagram
+    r->drops = kernel_drops(config.queue_num, config.workers);
+    nfqueue_group_close(group);
+    return true;
+}
+
+
+//Return false on failure
+static bool bench_mode(int mode, const uint8_t dst_mac[ETH_ALEN])
+{
+    int queues = mode == MODE_FANOUT? config.workers : 1;
+    if (config.setup && !queue_rule('I', config.queue_num, queues))
+        return false;
+
+    int64_t deadline = now_ns() + (int64_t)config.duration * 1000000000;
+    sender_deadline = deadline - BENCH_DRAIN_MS * 1000000;
+    pthread_t sender;
+    bool sending = false;
+    if (config.setup)
+    {
+        atomic_store(&sender_stop, false);
+        if (pthread_create(&sender, NULL, sender_thread, (void*)dst_mac) != 0)
+            LOG(LOG_ERR, "Can't start sender");
+        else
+            sending = true;
+    }
+
+    struct bench_result r;
+    memset(&r, 0, sizeof(r));
+    bool ok = mode == MODE_FANOUT? bench_fanout(deadline, &r) : bench_queue(mode, deadline, &r);
+
+    if (sending)
+    {
+        atomic_store(&sender_stop, true);
+        pthread_join(sender, NULL);
+    }
+    if (config.setup)
+        queue_rule('D', config.queue_num, queues);
+    if (!ok)
+        return false;
+
+    double n = r.packets > 0? r.packets : 1;  //zeros rather than per-packet values of nothing
+    if (r.packets == 0)
+        r.syscalls = r.cpu_ns = 0;
+    printf("%-9s %10lu %10.0f %8.2f %8.0f %8.1f %8.1f %8.1f %10lu %10lu\n",
+        mode_names[mode], (unsigned long)r.packets, r.seconds > 0? r.packets / r.seconds : 0,
+        r.syscalls / n, r.cpu_ns / n,
+        nfqueue_stats_percentile(&r.stats, 0.5) / 1e3, nfqueue_stats_percentile(&r.stats, 0.99) / 1e3,
+        nfqueue_stats_percentile(&r.stats, 0.999) / 1e3, (unsigned long)r.drops,
+        (unsigned long)atomic_load(&sender_packets));
+    fflush(stdout);
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -m MODE   copy, zerocopy, batch, vq, fanout or all (default)\n"
+        "  -q NUM    first queue number (default 0)\n"
+        "  -w NUM    queues and workers in fanout mode (default 4)\n"
+        "  -s BYTES  UDP payload size (default 64)\n"
+        "  -f NUM    number of flows, i.e. source ports (default 1024)\n"
+        "  -r PPS    sender rate, 0 means as fast as possible (default 0)\n"
+        "  -d SEC    duration of every mode (default 5)\n"
+        "  -l NUM    queue length (default 4096)\n"
+        "  -n        no setup: do not create namespace, rules and sender; measure existing traffic\n",
+        prog);
+    DIE();
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "m:q:w:s:f:r:d:l:nh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                config.mode = -1;
+                for (int i = 0; i < MODE_COUNT; i++)
+                    if (strcmp(optarg, mode_names[i]) == 0)
+                        config.mode = i;
+                if (strcmp(optarg, "all") == 0)
+                    config.mode = MODE_COUNT;
+                if (config.mode < 0)
+                    usage(argv[0]);
+                break;
+            case 'q': config.queue_num = atoi(optarg); break;
+            case 'w': config.workers = atoi(optarg); break;
+            case 's': config.size = strtoul(optarg, NULL, 0); break;
+            case 'f': config.flows = strtoul(optarg, NULL, 0); break;
+            case 'r': config.rate = strtoull(optarg, NULL, 0); break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'l': config.queue_len = strtoul(optarg, NULL, 0); break;
+            case 'n': config.setup = false; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.workers < 1 || config.flows < 1 || config.duration < 1 || config.size > 1472)
+        usage(argv[0]);
+
+    uint8_t dst_mac[ETH_ALEN];
+    if (config.setup && (!setup() || !read_mac(BENCH_DEV, dst_mac)))
+    {
+        LOG(LOG_CRIT, "Can't set up benchmark namespace");
+        teardown();
+        DIE();
+    }
+
+    printf("%-9s %10s %10s %8s %8s %8s %8s %8s %10s %10s\n",
+        "mode", "packets", "pps", "sys/pkt", "cpu(ns)", "p50(us)", "p99(us)", "p999(us)", "drops", "sent");
+    bool ok = true;
+    for (int mode = 0; mode < MODE_COUNT && ok; mode++)
+        if (config.mode == MODE_COUNT || config.mode == mode)
+            ok = bench_mode(mode, dst_mac);
+
+    if (config.setup)
+        teardown();
+    return ok? EXIT_SUCCESS : EXIT_FAILURE;
+}
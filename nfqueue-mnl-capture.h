@@ -0,0 +1,306 @@
+/*
+ *  nfqueue-mnl-capture.h - Recording and replay of netlink datagrams
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_CAPTURE_H
+#define NFQUEUE_MNL_CAPTURE_H
+
+
+#include "nfqueue-mnl.h"  //must be first, defines _GNU_SOURCE
+
+#include <fcntl.h>        //open
+#include <limits.h>       //INT_MAX
+#include <sys/stat.h>     //fstat
+#include <sys/utsname.h>  //uname
+
+
+/*
+Capture files
+
+A capture file holds raw netlink datagrams, as received from a queue socket, so that parsing can be replayed and
+benchmarked offline, without root privileges or a live kernel. The file starts with nf_capture_header, which
+records the kernel release, queue flags and copy range of the queue the datagrams were received from, followed by
+records: nf_capture_record (datagram length) and the datagram, padded to NF_CAPTURE_ALIGN bytes. Values are in
+host byte order, like netlink itself; byte_order tells whether a file comes from a machine of different
+endianness (such files are rejected).
+
+Nothing is recorded unless the application calls nfqueue_capture_write(), after nfqueue_receive() and before
+nfqueue_next() (which consumes the buffer):
+
+    if (nfqueue_receive(q, buf, TIMEOUT) == IO_READY)
+    {
+        nfqueue_capture_write(writer, buf);
+        while (nfqueue_next(buf, packet) == IO_READY)
+            ...
+    }
+
+For replay, the file is mapped as a whole (copy-on-write, so that zero-copy payloads may be modified) and every
+nfqueue_capture_next() points nf_buffer at the next datagram, to be iterated with nfqueue_next() as usual.
+Payload views remain valid until the capture is unmapped.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_CAPTURE_MAGIC       "NFQMNLCP"
+#define NF_CAPTURE_VERSION     1
+#define NF_CAPTURE_BYTE_ORDER  0x01020304
+#define NF_CAPTURE_ALIGN       8
+
+struct nf_capture_header
+{
+    char               magic[8];     //NF_CAPTURE_MAGIC, not terminated
+    uint32_t           version;      //NF_CAPTURE_VERSION
+    uint32_t           byte_order;   //NF_CAPTURE_BYTE_ORDER in byte order of the writer
+    uint32_t           flags;        //NFQA_CFG_F_* flags of the queue
+    uint32_t           copy_mode;    //NFQNL_COPY_*
+    uint32_t           copy_range;
+    uint32_t           reserved0;
+    uint64_t           created;      //time of creation (seconds since the epoch)
+    char               kernel[64];   //kernel release (uname -r) of the writer, terminated
+    char               reserved[24];
+};
+
+struct nf_capture_record
+{
+    uint32_t           len;          //datagram length, not including padding
+    uint32_t           reserved;
+};
+
+//Capture file being written
+struct nf_capture_writer
+{
+    FILE*              file;
+    uint64_t           datagrams;
+    uint64_t           bytes;
+};
+
+//Capture file mapped for replay
+struct nf_capture
+{
+    void*              map;
+    size_t             size;
+    size_t             pos;          //offset of the next record
+    const struct nf_capture_header* header;
+    uint64_t           datagrams;    //number of records in the file
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static inline size_t nfqueue_capture_align(size_t len)
+{
+    return (len + NF_CAPTURE_ALIGN - 1) & ~(size_t)(NF_CAPTURE_ALIGN - 1);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure
+//Create capture file (truncating an existing one); opt describes the queue, NULL means default options
+bool nfqueue_capture_create(struct nf_capture_writer* w, const char* path, const struct nf_queue_options* opt)
+{
+    ASSERT(w);
+    ASSERT(path);
+    struct nf_queue_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_default_options(&defaults);
+        opt = &defaults;
+    }
+    memset(w, 0, sizeof(*w));
+    if ((w->file = fopen(path, "wb")) == NULL)
+    {
+        LOG_SYSERR("fopen(%s)", path);
+        return false;
+    }
+
+    struct nf_capture_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, NF_CAPTURE_MAGIC, sizeof(h.magic));
+    h.version = NF_CAPTURE_VERSION;
+    h.byte_order = NF_CAPTURE_BYTE_ORDER;
+    h.flags = opt->flags;
+    h.copy_mode = opt->copy_mode;
+    h.copy_range = opt->copy_range;
+    h.created = time(NULL);
+    struct utsname u;
+    if (uname(&u) == 0)
+        memcpy(h.kernel, u.release, strnlen(u.release, sizeof(h.kernel) - 1));  //truncated if needed
+    if (fwrite(&h, sizeof(h), 1, w->file) != 1)
+    {
+        LOG_SYSERR("fwrite(%s)", path);
+        fclose(w->file);
+        w->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+//Return false on failure
+//Append datagram held by buf; must be called after nfqueue_receive() and before nfqueue_next()
+bool nfqueue_capture_write(struct nf_capture_writer* w, const struct nf_buffer* buf)
+{
+    ASSERT(w);
+    ASSERT(w->file);
+    ASSERT(buf);
+    ASSERT(buf->nlh);
+    static const char padding[NF_CAPTURE_ALIGN];
+    struct nf_capture_record r =
+    {
+        .len = buf->len,
+    };
+    size_t pad = nfqueue_capture_align(r.len) - r.len;
+    if (fwrite(&r, sizeof(r), 1, w->file) != 1 || fwrite(buf->nlh, 1, r.len, w->file) != r.len ||
+        fwrite(padding, 1, pad, w->file) != pad)
+    {
+        LOG_SYSERR("fwrite");
+        return false;
+    }
+    w->datagrams++;
+    w->bytes += r.len;
+    return true;
+}
+
+
+//Return false on failure (data not written completely)
+bool nfqueue_capture_close(struct nf_capture_writer* w)
+{
+    ASSERT(w);
+    if (w->file == NULL)
+        return true;
+    bool ok = fclose(w->file) == 0;
+    if (!ok)
+        LOG_SYSERR("fclose");
+    w->file = NULL;
+    return ok;
+}
+
+
+//Return false on failure, or if file is not a valid capture
+//Map capture file for replay
+bool nfqueue_capture_map(struct nf_capture* c, const char* path)
+{
+    ASSERT(c);
+    ASSERT(path);
+    memset(c, 0, sizeof(*c));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_SYSERR("open(%s)", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        LOG_SYSERR("fstat(%s)", path);
+        close(fd);
+        return false;
+    }
+    if ((size_t)st.st_size < sizeof(struct nf_capture_header))
+    {
+        LOG(LOG_ERR, "Not a capture file: %s", path);
+        close(fd);
+        return false;
+    }
+    c->size = st.st_size;
+    c->map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (c->map == MAP_FAILED)
+    {
+        LOG_SYSERR("mmap(%s)", path);
+        c->map = NULL;
+        return false;
+    }
+
+    c->header = c->map;
+    if (memcmp(c->header->magic, NF_CAPTURE_MAGIC, sizeof(c->header->magic)) != 0 ||
+        c->header->byte_order != NF_CAPTURE_BYTE_ORDER || c->header->version != NF_CAPTURE_VERSION)
+    {
+        LOG(LOG_ERR, "Not a capture file, or unsupported version or byte order: %s", path);
+        munmap(c->map, c->size);
+        c->map = NULL;
+        return false;
+    }
+
+    //Validate all records once, so that replay does not need to
+    size_t pos = sizeof(struct nf_capture_header);
+    while (pos < c->size)
+    {
+        const struct nf_capture_record* r = (const struct nf_capture_record*)((char*)c->map + pos);
+        if (c->size - pos < sizeof(*r) || c->size - pos - sizeof(*r) < r->len || r->len > INT_MAX)
+        {
+            LOG(LOG_ERR, "Truncated capture file: %s (record %lu)", path, (unsigned long)c->datagrams);
+            munmap(c->map, c->size);
+            c->map = NULL;
+            return false;
+        }
+        pos += sizeof(*r) + nfqueue_capture_align(r->len);
+        c->datagrams++;
+    }
+    c->pos = sizeof(struct nf_capture_header);
+    return true;
+}
+
+
+//Return 1 on success (datagram in buf), 0 at the end of capture
+//Point buf at the next datagram, to be iterated with nfqueue_next(); buf->data is not used
+int nfqueue_capture_next(struct nf_capture* c, struct nf_buffer* buf)
+{
+    ASSERT(c);
+    ASSERT(c->map);
+    ASSERT(buf);
+    if (c->pos >= c->size)
+        return IO_NOTREADY;
+    const struct nf_capture_record* r = (const struct nf_capture_record*)((char*)c->map + c->pos);
+    buf->generation++;
+    buf->nlh = (struct nlmsghdr*)(r + 1);
+    buf->len = r->len;
+    c->pos += sizeof(*r) + nfqueue_capture_align(r->len);
+    return IO_READY;
+}
+
+
+//Start replay from the first datagram
+void nfqueue_capture_rewind(struct nf_capture* c)
+{
+    ASSERT(c);
+    c->pos = sizeof(struct nf_capture_header);
+}
+
+
+//Payload views into the capture become invalid
+void nfqueue_capture_unmap(struct nf_capture* c)
+{
+    ASSERT(c);
+    if (c->map)
+        munmap(c->map, c->size);
+    c->map = NULL;
+    c->header = NULL;
+}
+
+
+#endif //NFQUEUE_MNL_CAPTURE_H
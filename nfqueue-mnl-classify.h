@@ -0,0 +1,846 @@
+/*
+ *  nfqueue-mnl-classify.h - IP prefix and port set classifier
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_CLASSIFY_H
+#define NFQUEUE_MNL_CLASSIFY_H
+
+
+#include "nfqueue-mnl.h"  //must be first, defines _GNU_SOURCE
+#include "nfqueue-mnl-decode.h"
+
+#include <arpa/inet.h>    //inet_pton
+#include <endian.h>       //be64toh
+
+
+/*
+Classifier
+
+A ruleset gives verdicts based on source and destination prefixes, protocol and destination port. Prefixes are
+added to classes (small nonzero numbers, e.g. 1 for "blocked networks", with any number of prefixes), separately
+for source and destination addresses, and port ranges to port sets. Rules are checked in the order they were added,
+and the first one whose source class, destination class, protocol and port set all match gives the verdict and
+connmark; zero class, zero protocol and port set -1 match anything. If no rule matches, the default verdict applies.
+An address belongs to the class of its longest matching prefix, so classes should not overlap with different
+prefix lengths unless that is intended.
+
+    struct nf_ruleset* rs = nfqueue_ruleset_create(NF_ACCEPT, -1);
+    nfqueue_ruleset_add_prefix_str(rs, NF_CLASSIFY_SRC, "192.0.2.0/24", BLOCKED);  //for every prefix
+    int web = nfqueue_ruleset_port_set(rs);
+    nfqueue_ruleset_add_ports(rs, web, 80, 80);
+    nfqueue_ruleset_add_rule(rs, &(struct nf_rule){ .src_class = BLOCKED, .port_set = -1, .verdict = NF_DROP, .connmark = -1 });
+    nfqueue_ruleset_build(rs);
+
+Lookups use a DIR-24-8 table for IPv4 (a 2^24 entry first level, 32 MiB per direction, and 256-entry second level
+groups for prefixes longer than 24; at most two memory accesses) and a Poptrie for IPv6 (64-ary trie nodes
+compressed with bitmaps, so that children and leaves are found with popcount). A built ruleset is immutable.
+
+A classifier publishes a ruleset to packet threads and replaces it on reload without stopping them (read-copy-
+update): readers announce the epoch they entered in, and nfqueue_classifier_swap() waits until no reader may still
+use the old ruleset before freeing it. Readers never wait. Each packet thread registers once and brackets uses of
+the ruleset (e.g. one received batch) with nfqueue_classifier_enter() and nfqueue_classifier_exit():
+
+    const struct nf_ruleset* rs = nfqueue_classifier_enter(c, reader);
+    nfqueue_classify_vq(rs, vq, batch);  //batch decoded by nfqueue_decode_batch()
+    nfqueue_classifier_exit(reader);
+    nfqueue_vq_flush(vq);
+
+Batch lookups first compute table indices of a group of NF_CLASSIFY_BATCH packets and prefetch them, then resolve
+classes and rules, so that memory latency of the large tables overlaps.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_CLASSIFY_MAX_CLASS   0x7FFF
+#define NF_CLASSIFY_READERS     64      //max registered reader threads per classifier
+#define NF_CLASSIFY_BATCH       16      //lookups prefetched together
+#define NF_CLASSIFY_PORT_WORDS  (65536 / 64)
+#define NF_DIR24_SIZE           (1 << 24)
+#define NF_DIR8_FLAG            0x8000  //tbl24 entry points to a tbl8 group
+#define NF_DIR8_MAX_GROUPS      0x8000
+#define NF_POPTRIE_STRIDE       6
+
+//Address direction
+enum
+{
+    NF_CLASSIFY_SRC = 0,
+    NF_CLASSIFY_DST = 1,
+};
+
+struct nf_rule
+{
+    uint16_t           src_class;    //0 matches any source
+    uint16_t           dst_class;    //0 matches any destination
+    uint8_t            protocol;     //0 matches any protocol
+    int                port_set;     //matched against destination port; -1 matches any
+    int                verdict;
+    int64_t            connmark;     //-1 means don't set connmark
+};
+
+//Prefix added to a ruleset that is not built yet
+struct nf_prefix_entry
+{
+    __uint128_t        key;          //host byte order, left aligned (IPv4 in the top 32 bits)
+    uint32_t           seq;          //order of addition (later wins among equal prefixes)
+    uint8_t            len;
+    uint8_t            ip_version;
+    uint16_t           class;
+};
+
+//Uncompressed trie node used while building a Poptrie
+struct nf_trie_node
+{
+    uint32_t           child[64];    //index + 1, zero if none
+    uint16_t           value[64];
+};
+
+struct nf_poptrie_node
+{
+    uint64_t           vector;       //positions that have a child node
+    uint64_t           leafvec;      //positions that start a run of equal leaves
+    uint32_t           base0;        //first leaf
+    uint32_t           base1;        //first child
+};
+
+//Longest prefix match table of one direction
+struct nf_lpm
+{
+    uint16_t*          tbl24;        //NULL if there are no IPv4 prefixes
+    uint16_t*          tbl8;
+    uint32_t           tbl8_groups;
+    struct nf_poptrie_node* nodes;   //NULL if there are no IPv6 prefixes
+    uint16_t*          leaves;
+    uint32_t           node_count;
+    uint32_t           leaf_count;
+};
+
+struct nf_ruleset
+{
+    struct nf_lpm      lpm[2];       //NF_CLASSIFY_SRC, NF_CLASSIFY_DST
+    uint64_t*          port_sets;    //NF_CLASSIFY_PORT_WORDS words per set
+    int                port_set_count;
+    struct nf_rule*    rules;
+    int                rule_count;
+    int                rule_capacity;
+    int                default_verdict;
+    int64_t            default_connmark;
+    bool               built;
+    struct nf_prefix_entry* prefixes[2];  //until built
+    size_t             prefix_count[2];
+    size_t             prefix_capacity[2];
+};
+
+struct nf_classifier_reader
+{
+    _Atomic(uint64_t)  epoch;        //epoch at nfqueue_classifier_enter(), zero outside
+    atomic_bool        used;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct nf_classifier
+{
+    _Atomic(struct nf_ruleset*) current;
+    _Atomic(uint64_t)  epoch;
+    struct nf_classifier_reader readers[NF_CLASSIFY_READERS];
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+//Return address as a left aligned host byte order key
+static inline __uint128_t nfqueue_classify_key(int ip_version, const ip_address_t* addr)
+{
+    if (ip_version == IPV4)
+        return (__uint128_t)ntohl(addr->ip4) << 96;
+    return (__uint128_t)be64toh(addr->hi) << 64 | be64toh(addr->lo);
+}
+
+
+//helper
+//Return 6 bits of key at bit offset off (counted from the top); bits past the end are zero
+static inline unsigned nfqueue_poptrie_bits(__uint128_t key, unsigned off)
+{
+    if (off <= 128 - NF_POPTRIE_STRIDE)
+        return (unsigned)(key >> (128 - NF_POPTRIE_STRIDE - off)) & 63;
+    return (unsigned)(key << (off - (128 - NF_POPTRIE_STRIDE))) & 63;
+}
+
+
+//helper
+static inline uint16_t nfqueue_lpm_lookup4(const struct nf_lpm* t, uint32_t addr)
+{
+    if (t->tbl24 == NULL)
+        return 0;
+    uint16_t e = t->tbl24[addr >> 8];
+    if (e & NF_DIR8_FLAG)
+        e = t->tbl8[(uint32_t)(e & ~NF_DIR8_FLAG) << 8 | (addr & 0xFF)];
+    return e;
+}
+
+
+//helper
+static inline uint16_t nfqueue_lpm_lookup6(const struct nf_lpm* t, __uint128_t key)
+{
+    if (t->nodes == NULL)
+        return 0;
+    const struct nf_poptrie_node* node = t->nodes;
+    for (unsigned off = 0;; off += NF_POPTRIE_STRIDE)
+    {
+        unsigned v = nfqueue_poptrie_bits(key, off);
+        uint64_t mask = ~(uint64_t)0 >> (63 - v);  //positions 0..v
+        if (node->vector & ((uint64_t)1 << v))
+            node = &t->nodes[node->base1 + __builtin_popcountll(node->vector & mask) - 1];
+        else
+            return t->leaves[node->base0 + __builtin_popcountll(node->leafvec & mask) - 1];
+    }
+}
+
+
+//helper
+static inline uint16_t nfqueue_lpm_lookup(const struct nf_lpm* t, int ip_version, const ip_address_t* addr)
+{
+    if (ip_version == IPV4)
+        return nfqueue_lpm_lookup4(t, ntohl(addr->ip4));
+    if (ip_version == IPV6)
+        return nfqueue_lpm_lookup6(t, nfqueue_classify_key(IPV6, addr));
+    return 0;
+}
+
+
+//helper
+static inline void nfqueue_lpm_prefetch(const struct nf_lpm* t, int ip_version, const ip_address_t* addr)
+{
+    if (ip_version == IPV4 && t->tbl24)
+        __builtin_prefetch(&t->tbl24[ntohl(addr->ip4) >> 8]);
+}
+
+
+//helper
+static inline int nfqueue_classify_rules(const struct nf_ruleset* rs, uint16_t src_class, uint16_t dst_class,
+                                         uint8_t protocol, uint16_t dst_port, int64_t* connmark)
+{
+    for (int i = 0; i < rs->rule_count; i++)
+    {
+        const struct nf_rule* r = &rs->rules[i];
+        if ((r->src_class == 0 || r->src_class == src_class) &&
+            (r->dst_class == 0 || r->dst_class == dst_class) &&
+            (r->protocol == 0 || r->protocol == protocol) &&
+            (r->port_set < 0 ||
+             (rs->port_sets[(size_t)r->port_set * NF_CLASSIFY_PORT_WORDS + dst_port / 64] >> (dst_port % 64) & 1)))
+        {
+            *connmark = r->connmark;
+            return r->verdict;
+        }
+    }
+    *connmark = rs->default_connmark;
+    return rs->default_verdict;
+}
+
+
+//helper
+static int nfqueue_prefix_compare(const void* a, const void* b)
+{
+    const struct nf_prefix_entry* x = a;
+    const struct nf_prefix_entry* y = b;
+    if (x->len != y->len)
+        return x->len < y->len? -1 : 1;
+    return x->seq < y->seq? -1 : x->seq > y->seq;
+}
+
+
+//helper
+//Return false on failure; prefixes must be IPv4 and sorted by length
+static bool nfqueue_dir24_build(struct nf_lpm* t, const struct nf_prefix_entry* p, size_t count)
+{
+    t->tbl24 = calloc(NF_DIR24_SIZE, sizeof(uint16_t));
+    if (t->tbl24 == NULL)
+    {
+        LOG_SYSERR("calloc");
+        return false;
+    }
+    uint32_t tbl8_capacity = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t addr = (uint32_t)(p[i].key >> 96);
+        if (p[i].len <= 24)
+        {
+            //Shorter prefixes come first, so no tbl8 group exists yet in this range
+            uint32_t first = addr >> 8;
+            for (uint32_t j = 0; j < (uint32_t)1 << (24 - p[i].len); j++)
+                t->tbl24[first + j] = p[i].class;
+            continue;
+        }
+        uint16_t* e = &t->tbl24[addr >> 8];
+        if (!(*e & NF_DIR8_FLAG))
+        {
+            if (t->tbl8_groups == NF_DIR8_MAX_GROUPS)
+            {
+                LOG(LOG_ERR, "Too many IPv4 prefixes longer than /24");
+                return false;
+            }
+            if (t->tbl8_groups == tbl8_capacity)
+            {
+                tbl8_capacity = tbl8_capacity? tbl8_capacity * 2 : 64;
+                uint16_t* tbl8 = realloc(t->tbl8, (size_t)tbl8_capacity * 256 * sizeof(uint16_t));
+                if (tbl8 == NULL)
+                {
+                    LOG_SYSERR("realloc");
+                    return false;
+                }
+                t->tbl8 = tbl8;
+            }
+            for (int j = 0; j < 256; j++)
+                t->tbl8[(size_t)t->tbl8_groups * 256 + j] = *e;
+            *e = NF_DIR8_FLAG | t->tbl8_groups++;
+        }
+        uint16_t* group = &t->tbl8[(size_t)(*e & ~NF_DIR8_FLAG) * 256];
+        uint32_t first = addr & 0xFF;
+        for (uint32_t j = 0; j < (uint32_t)1 << (32 - p[i].len); j++)
+            group[first + j] = p[i].class;
+    }
+    return true;
+}
+
+
+//helper
+//Return false on failure; prefixes must be IPv6 and sorted by length
+static bool nfqueue_poptrie_build(struct nf_lpm* t, const struct nf_prefix_entry* p, size_t count)
+{
+    size_t trie_count = 1, trie_capacity = 64;
+    struct nf_trie_node* trie = calloc(trie_capacity, sizeof(*trie));
+    if (trie == NULL)
+    {
+        LOG_SYSERR("calloc");
+        return false;
+    }
+
+    //Controlled prefix expansion; shorter prefixes come first and are overwritten by longer ones
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t n = 0;
+        unsigned off = 0;
+        for (; p[i].len >= off + NF_POPTRIE_STRIDE; off += NF_POPTRIE_STRIDE)
+        {
+            unsigned v = nfqueue_poptrie_bits(p[i].key, off);
+            if (trie[n].child[v] == 0)
+            {
+                if (trie_count == trie_capacity)
+                {
+                    struct nf_trie_node* tmp = realloc(trie, trie_capacity * 2 * sizeof(*trie));
+                    if (tmp == NULL)
+                    {
+                        LOG_SYSERR("realloc");
+                        free(trie);
+                        return false;
+                    }
+                    trie = tmp;
+                    trie_capacity *= 2;
+                }
+                struct nf_trie_node* c = &trie[trie_count];
+                memset(c->child, 0, sizeof(c->child));
+                for (int j = 0; j < 64; j++)
+                    c->value[j] = trie[n].value[v];
+                trie[n].child[v] = ++trie_count;
+            }
+            n = trie[n].child[v] - 1;
+        }
+        unsigned span = (unsigned)1 << (off + NF_POPTRIE_STRIDE - p[i].len);
+        unsigned first = nfqueue_poptrie_bits(p[i].key, off) & ~(span - 1);
+        for (unsigned j = first; j < first + span; j++)
+            trie[n].value[j] = p[i].class;
+    }
+
+    //Compress breadth first, so that children of every node are contiguous
+    t->nodes = malloc(trie_count * sizeof(struct nf_poptrie_node));
+    t->leaves = malloc(trie_count * 64 * sizeof(uint16_t));
+    uint32_t* order = malloc(trie_count * sizeof(uint32_t));
+    if (t->nodes == NULL || t->leaves == NULL || order == NULL)
+    {
+        LOG_SYSERR("malloc");
+        free(order);
+        free(trie);
+        return false;
+    }
+    order[0] = 0;
+    t->node_count = 1;
+    for (uint32_t k = 0; k < t->node_count; k++)
+    {
+        const struct nf_trie_node* b = &trie[order[k]];
+        struct nf_poptrie_node* node = &t->nodes[k];
+        node->vector = 0;
+        node->leafvec = 0;
+        node->base1 = t->node_count;
+        node->base0 = t->leaf_count;
+        bool first = true;
+        uint16_t prev = 0;
+        for (unsigned v = 0; v < 64; v++)
+        {
+            if (b->child[v])
+            {
+                node->vector |= (uint64_t)1 << v;
+                order[t->node_count++] = b->child[v] - 1;
+            }
+            else if (first || b->value[v] != prev)
+            {
+                node->leafvec |= (uint64_t)1 << v;
+                t->leaves[t->leaf_count++] = prev = b->value[v];
+                first = false;
+            }
+        }
+    }
+    free(order);
+    free(trie);
+    uint16_t* leaves = realloc(t->leaves, (t->leaf_count? t->leaf_count : 1) * sizeof(uint16_t));
+    if (leaves)
+        t->leaves = leaves;
+    DEBUG("Poptrie: %u nodes, %u leaves", t->node_count, t->leaf_count);
+    return true;
+}
+
+
+//helper
+static void nfqueue_lpm_free(struct nf_lpm* t)
+{
+    free(t->tbl24);
+    free(t->tbl8);
+    free(t->nodes);
+    free(t->leaves);
+    memset(t, 0, sizeof(*t));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface: rulesets
+
+
+//Return NULL on failure
+//Create an empty ruleset; packets matching no rule get default_verdict and default_connmark (-1: don't set)
+struct nf_ruleset* nfqueue_ruleset_create(int default_verdict, int64_t default_connmark)
+{
+    struct nf_ruleset* rs = calloc(1, sizeof(struct nf_ruleset));
+    if (rs == NULL)
+    {
+        LOG_SYSERR("calloc");
+        return NULL;
+    }
+    rs->default_verdict = default_verdict;
+    rs->default_connmark = default_connmark;
+    return rs;
+}
+
+
+void nfqueue_ruleset_free(struct nf_ruleset* rs)
+{
+    if (rs == NULL)
+        return;
+    for (int d = 0; d < 2; d++)
+    {
+        nfqueue_lpm_free(&rs->lpm[d]);
+        free(rs->prefixes[d]);
+    }
+    free(rs->port_sets);
+    free(rs->rules);
+    free(rs);
+}
+
+
+//Return false on failure
+//Add prefix (network byte order, as in ip_tuple) of given direction to class (1..NF_CLASSIFY_MAX_CLASS)
+//Host bits past len are ignored
+bool nfqueue_ruleset_add_prefix(struct nf_ruleset* rs, int direction, int ip_version, const ip_address_t* prefix, int len, uint16_t class)
+{
+    ASSERT(rs);
+    ASSERT(!rs->built);
+    ASSERT(direction == NF_CLASSIFY_SRC || direction == NF_CLASSIFY_DST);
+    ASSERT(prefix);
+    if ((ip_version != IPV4 && ip_version != IPV6) || len < 0 || len > (ip_version == IPV4? 32 : 128) ||
+        class == 0 || class > NF_CLASSIFY_MAX_CLASS)
+    {
+        LOG(LOG_ERR, "Invalid prefix or class");
+        return false;
+    }
+    if (rs->prefix_count[direction] == rs->prefix_capacity[direction])
+    {
+        size_t capacity = rs->prefix_capacity[direction]? rs->prefix_capacity[direction] * 2 : 1024;
+        struct nf_prefix_entry* tmp = realloc(rs->prefixes[direction], capacity * sizeof(struct nf_prefix_entry));
+        if (tmp == NULL)
+        {
+            LOG_SYSERR("realloc");
+            return false;
+        }
+        rs->prefixes[direction] = tmp;
+        rs->prefix_capacity[direction] = capacity;
+    }
+    struct nf_prefix_entry* e = &rs->prefixes[direction][rs->prefix_count[direction]];
+    e->key = nfqueue_classify_key(ip_version, prefix);
+    if (len < 128)
+        e->key &= ~(~(__uint128_t)0 >> len);
+    e->seq = rs->prefix_count[direction]++;
+    e->len = len;
+    e->ip_version = ip_version;
+    e->class = class;
+    return true;
+}
+
+
+//Return false on failure (including invalid prefix)
+//Like nfqueue_ruleset_add_prefix(), with prefix given as text, e.g. "192.0.2.0/24", "2001:db8::/32" or an address
+bool nfqueue_ruleset_add_prefix_str(struct nf_ruleset* rs, int direction, const char* prefix, uint16_t class)
+{
+    ASSERT(prefix);
+    char addr[INET6_ADDRSTRLEN];
+    const char* slash = strchr(prefix, '/');
+    size_t addr_len = slash? (size_t)(slash - prefix) : strlen(prefix);
+    if (addr_len >= sizeof(addr))
+    {
+        LOG(LOG_ERR, "Invalid prefix: %s", prefix);
+        return false;
+    }
+    memcpy(addr, prefix, addr_len);
+    addr[addr_len] = '\0';
+
+    ip_address_t ip;
+    memset(&ip, 0, sizeof(ip));
+    int ip_version;
+    if (inet_pton(AF_INET, addr, &ip.in4) == 1)
+        ip_version = IPV4;
+    else if (inet_pton(AF_INET6, addr, &ip.in6) == 1)
+        ip_version = IPV6;
+    else
+    {
+        LOG(LOG_ERR, "Invalid prefix: %s", prefix);
+        return false;
+    }
+    int len = ip_version == IPV4? 32 : 128;
+    if (slash)
+    {
+        char* end;
+        long l = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || end == slash + 1 || l < 0 || l > len)
+        {
+            LOG(LOG_ERR, "Invalid prefix: %s", prefix);
+            return false;
+        }
+        len = l;
+    }
+    return nfqueue_ruleset_add_prefix(rs, direction, ip_version, &ip, len, class);
+}
+
+
+//Return index of new empty port set, -1 on failure
+int nfqueue_ruleset_port_set(struct nf_ruleset* rs)
+{
+    ASSERT(rs);
+    ASSERT(!rs->built);
+    size_t words = (size_t)(rs->port_set_count + 1) * NF_CLASSIFY_PORT_WORDS;
+    uint64_t* tmp = realloc(rs->port_sets, words * sizeof(uint64_t));
+    if (tmp == NULL)
+    {
+        LOG_SYSERR("realloc");
+        return -1;
+    }
+    rs->port_sets = tmp;
+    memset(&tmp[words - NF_CLASSIFY_PORT_WORDS], 0, NF_CLASSIFY_PORT_WORDS * sizeof(uint64_t));
+    return rs->port_set_count++;
+}
+
+
+//Return false on failure
+//Add ports first..last (host byte order, inclusive) to port set
+bool nfqueue_ruleset_add_ports(struct nf_ruleset* rs, int set, uint16_t first, uint16_t last)
+{
+    ASSERT(rs);
+    ASSERT(!rs->built);
+    if (set < 0 || set >= rs->port_set_count || first > last)
+    {
+        LOG(LOG_ERR, "Invalid port set or range");
+        return false;
+    }
+    uint64_t* bits = &rs->port_sets[(size_t)set * NF_CLASSIFY_PORT_WORDS];
+    for (uint32_t port = first; port <= last; port++)
+        bits[port / 64] |= (uint64_t)1 << (port % 64);
+    return true;
+}
+
+
+//Return false on failure
+//Append rule; rules are checked in order of addition
+bool nfqueue_ruleset_add_rule(struct nf_ruleset* rs, const struct nf_rule* rule)
+{
+    ASSERT(rs);
+    ASSERT(!rs->built);
+    ASSERT(rule);
+    if (rule->port_set >= rs->port_set_count || rule->port_set < -1 ||
+        rule->src_class > NF_CLASSIFY_MAX_CLASS || rule->dst_class > NF_CLASSIFY_MAX_CLASS)
+    {
+        LOG(LOG_ERR, "Invalid rule");
+        return false;
+    }
+    if (rs->rule_count == rs->rule_capacity)
+    {
+        int capacity = rs->rule_capacity? rs->rule_capacity * 2 : 16;
+        struct nf_rule* tmp = realloc(rs->rules, capacity * sizeof(struct nf_rule));
+        if (tmp == NULL)
+        {
+            LOG_SYSERR("realloc");
+            return false;
+        }
+        rs->rules = tmp;
+        rs->rule_capacity = capacity;
+    }
+    rs->rules[rs->rule_count++] = *rule;
+    return true;
+}
+
+
+//Return false on failure (ruleset must then be freed)
+//Build lookup tables; the ruleset cannot be modified afterwards
+bool nfqueue_ruleset_build(struct nf_ruleset* rs)
+{
+    ASSERT(rs);
+    ASSERT(!rs->built);
+    for (int d = 0; d < 2; d++)
+    {
+        struct nf_prefix_entry* p = rs->prefixes[d];
+        size_t count = rs->prefix_count[d];
+        if (count == 0)
+            continue;
+
+        //IPv4 first, then every family by increasing length
+        size_t count4 = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (p[i].ip_version == IPV4)
+            {
+                struct nf_prefix_entry tmp = p[i];
+                p[i] = p[count4];
+                p[count4++] = tmp;
+            }
+        }
+        qsort(p, count4, sizeof(*p), nfqueue_prefix_compare);
+        qsort(p + count4, count - count4, sizeof(*p), nfqueue_prefix_compare);
+        if ((count4 > 0 && !nfqueue_dir24_build(&rs->lpm[d], p, count4)) ||
+            (count > count4 && !nfqueue_poptrie_build(&rs->lpm[d], p + count4, count - count4)))
+            return false;
+        DEBUG("Ruleset %s: %zu IPv4 and %zu IPv6 prefixes", d == NF_CLASSIFY_SRC? "source" : "destination",
+            count4, count - count4);
+        free(p);
+        rs->prefixes[d] = NULL;
+        rs->prefix_count[d] = rs->prefix_capacity[d] = 0;
+    }
+    rs->built = true;
+    return true;
+}
+
+
+//Return verdict for tuple (connmark is set as well)
+int nfqueue_classify(const struct nf_ruleset* rs, const struct ip_tuple* tuple, int64_t* connmark)
+{
+    ASSERT(rs);
+    ASSERT(rs->built);
+    ASSERT(tuple);
+    ASSERT(connmark);
+    uint16_t src_class = nfqueue_lpm_lookup(&rs->lpm[NF_CLASSIFY_SRC], tuple->ip_version, &tuple->src);
+    uint16_t dst_class = nfqueue_lpm_lookup(&rs->lpm[NF_CLASSIFY_DST], tuple->ip_version, &tuple->dst);
+    return nfqueue_classify_rules(rs, src_class, dst_class, tuple->protocol, tuple->dst_port, connmark);
+}
+
+
+//Classify tuples[0..count-1] into verdicts[] and connmarks[]
+void nfqueue_classify_batch(const struct nf_ruleset* rs, const struct ip_tuple* tuples, size_t count,
+                            int* verdicts, int64_t* connmarks)
+{
+    ASSERT(rs);
+    ASSERT(rs->built);
+    const struct nf_lpm* src = &rs->lpm[NF_CLASSIFY_SRC];
+    const struct nf_lpm* dst = &rs->lpm[NF_CLASSIFY_DST];
+    for (size_t i = 0; i < count; i += NF_CLASSIFY_BATCH)
+    {
+        size_t n = count - i < NF_CLASSIFY_BATCH? count - i : NF_CLASSIFY_BATCH;
+        const struct ip_tuple* t = &tuples[i];
+        for (size_t j = 0; j < n; j++)
+        {
+            nfqueue_lpm_prefetch(src, t[j].ip_version, &t[j].src);
+            nfqueue_lpm_prefetch(dst, t[j].ip_version, &t[j].dst);
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            uint16_t src_class = nfqueue_lpm_lookup(src, t[j].ip_version, &t[j].src);
+            uint16_t dst_class = nfqueue_lpm_lookup(dst, t[j].ip_version, &t[j].dst);
+            verdicts[i + j] = nfqueue_classify_rules(rs, src_class, dst_class, t[j].protocol, t[j].dst_port, &connmarks[i + j]);
+        }
+    }
+}
+
+
+//helper
+//Return false on failure
+//Classify decoded packets and pass their verdicts to vq, or to batch if vq is NULL
+static bool nfqueue_classify_decoded(const struct nf_ruleset* rs, struct nf_verdict_queue* vq,
+                                     struct nf_verdict_batch* batch, const struct nf_decode_batch* b)
+{
+    ASSERT(rs);
+    ASSERT(rs->built);
+    ASSERT(b);
+    const struct nf_lpm* src = &rs->lpm[NF_CLASSIFY_SRC];
+    const struct nf_lpm* dst = &rs->lpm[NF_CLASSIFY_DST];
+    bool ok = true;
+    for (size_t i = 0; i < b->count; i += NF_CLASSIFY_BATCH)
+    {
+        size_t n = b->count - i < NF_CLASSIFY_BATCH? b->count - i : NF_CLASSIFY_BATCH;
+        for (size_t j = i; j < i + n; j++)
+        {
+            nfqueue_lpm_prefetch(src, b->ip_version[j], &b->src[j]);
+            nfqueue_lpm_prefetch(dst, b->ip_version[j], &b->dst[j]);
+        }
+        for (size_t j = i; j < i + n; j++)
+        {
+            uint16_t src_class = nfqueue_lpm_lookup(src, b->ip_version[j], &b->src[j]);
+            uint16_t dst_class = nfqueue_lpm_lookup(dst, b->ip_version[j], &b->dst[j]);
+            int64_t connmark;
+            int verdict = nfqueue_classify_rules(rs, src_class, dst_class, b->protocol[j], b->dst_port[j], &connmark);
+            //Every packet needs a verdict, so keep going after a failure
+            if (vq)
+                ok = nfqueue_vq_push(vq, b->packet_id[j], verdict, connmark) && ok;
+            else
+                ok = nfqueue_batch_verdict(batch, b->packet_id[j], verdict, connmark) && ok;
+        }
+    }
+    return ok;
+}
+
+
+//Return false on failure
+//Classify packets decoded by nfqueue_decode_batch() and add their verdicts to vq
+//Packets that are not IP have no classes, protocol zero and port zero: they match rules with zero classes and
+//protocol whose port set is -1 or contains port 0, and otherwise get the default verdict
+bool nfqueue_classify_vq(const struct nf_ruleset* rs, struct nf_verdict_queue* vq, const struct nf_decode_batch* b)
+{
+    ASSERT(vq);
+    return nfqueue_classify_decoded(rs, vq, NULL, b);
+}
+
+
+//Return false on failure
+//Same as nfqueue_classify_vq(), but verdicts go through the batch verdict accumulator, so that plain ACCEPT
+//verdicts are sent as one NFQNL_MSG_VERDICT_BATCH by nfqueue_batch_flush()
+bool nfqueue_classify_batch_verdict(const struct nf_ruleset* rs, struct nf_verdict_batch* batch, const struct nf_decode_batch* b)
+{
+    ASSERT(batch);
+    return nfqueue_classify_decoded(rs, NULL, batch, b);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface: classifier
+
+
+//Publish built ruleset rs (may be NULL until the first nfqueue_classifier_swap()); the classifier takes ownership
+void nfqueue_classifier_init(struct nf_classifier* c, struct nf_ruleset* rs)
+{
+    ASSERT(c);
+    ASSERT(rs == NULL || rs->built);
+    memset(c, 0, sizeof(*c));
+    atomic_init(&c->current, rs);
+    atomic_init(&c->epoch, 1);
+}
+
+
+//Return NULL if all NF_CLASSIFY_READERS slots are used
+//Register the calling thread as a reader; thread-safe
+struct nf_classifier_reader* nfqueue_classifier_register(struct nf_classifier* c)
+{
+    ASSERT(c);
+    for (int i = 0; i < NF_CLASSIFY_READERS; i++)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&c->readers[i].used, &expected, true))
+        {
+            atomic_store(&c->readers[i].epoch, 0);
+            return &c->readers[i];
+        }
+    }
+    LOG(LOG_ERR, "Too many classifier readers");
+    return NULL;
+}
+
+
+void nfqueue_classifier_unregister(struct nf_classifier_reader* r)
+{
+    ASSERT(r);
+    atomic_store(&r->epoch, 0);
+    atomic_store(&r->used, false);
+}
+
+
+//Return current ruleset (NULL if none); valid until nfqueue_classifier_exit()
+//Wait-free; calls must not be nested
+const struct nf_ruleset* nfqueue_classifier_enter(struct nf_classifier* c, struct nf_classifier_reader* r)
+{
+    ASSERT(c);
+    ASSERT(r);
+    atomic_store(&r->epoch, atomic_load(&c->epoch));  //sequentially consistent: before the load of current
+    return atomic_load(&c->current);
+}
+
+
+void nfqueue_classifier_exit(struct nf_classifier_reader* r)
+{
+    ASSERT(r);
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+
+//Replace ruleset with rs (built, owned by the classifier from now on) and free the old one
+//Waits until readers that entered before the swap have exited; must not be called from a reader
+//Swaps must not run concurrently with each other
+void nfqueue_classifier_swap(struct nf_classifier* c, struct nf_ruleset* rs)
+{
+    ASSERT(c);
+    ASSERT(rs == NULL || rs->built);
+    struct nf_ruleset* old = atomic_exchange(&c->current, rs);
+    uint64_t epoch = atomic_fetch_add(&c->epoch, 1) + 1;
+    for (int i = 0; i < NF_CLASSIFY_READERS; i++)
+    {
+        for (;;)
+        {
+            uint64_t e = atomic_load(&c->readers[i].epoch);
+            if (e == 0 || e >= epoch)
+                break;
+            struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    nfqueue_ruleset_free(old);
+}
+
+
+//No readers may be active
+void nfqueue_classifier_free(struct nf_classifier* c)
+{
+    ASSERT(c);
+    nfqueue_ruleset_free(atomic_exchange(&c->current, NULL));
+}
+
+
+#endif //NFQUEUE_MNL_CLASSIFY_H
@@ -0,0 +1,511 @@
+/*
+ *  nfqueue-mnl-conntrack.h - Conntrack events and table dump using libmnl
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_CONNTRACK_H
+#define NFQUEUE_MNL_CONNTRACK_H
+
+
+#include "nfqueue-mnl.h"  //must be first, defines _GNU_SOURCE
+
+#include <linux/netfilter/nfnetlink.h>  //NFNLGRP_CONNTRACK_*
+
+
+/*
+Conntrack events and dump
+
+nf_conntrack is a ctnetlink socket, separate from queue sockets. It can subscribe to conntrack events (new,
+updated and destroyed connections), and request a dump of the conntrack table, e.g. to warm up per-flow state after
+a restart, or to keep it bounded by removing destroyed connections (see nfqueue_flow_remove()):
+
+    struct nf_conntrack ct[1];
+    nfqueue_ct_open(ct, NF_CT_EVENT_DESTROY, 0);
+    struct nf_buffer buf[1];
+    memset(buf, 0, sizeof(struct nf_buffer));
+    while (running)
+    {
+        if (nfqueue_ct_receive(ct, buf, TIMEOUT) != IO_READY)
+            continue;
+        struct nf_ct_event ev[1];
+        while (nfqueue_ct_next(buf, ev) == IO_READY)
+            if (ev->type == NF_CT_DESTROY)
+                nfqueue_flow_remove(cache, ev->conn_id, &ev->orig);
+    }
+    free(buf->data);
+    nfqueue_ct_close(ct);
+
+Messages are received into nf_buffer and parsed in place, as with queues: the buffer is allocated once, and
+events do not allocate memory. Dump replies are received the same way, and end with an NF_CT_DUMP_DONE event;
+events and dump may share a socket, but then events arriving during the dump are interleaved with its replies.
+If the kernel drops events because the socket buffer is full, nfqueue_ct_receive() counts an overrun: state
+derived from events is then incomplete, and may be resynchronized with a dump.
+Opening the socket requires CAP_NET_ADMIN; events require conntrack event delivery to be enabled (the default,
+see net.netfilter.nf_conntrack_events sysctl).
+
+Connmark updates
+
+nfqueue_send_verdict_connmark() sets connmark only while a packet of the connection is queued. nf_ct_batch
+changes marks of any number of existing connections directly, e.g. after a policy reload: every update is an
+IPCTNL_MSG_CT_NEW message (without NLM_F_CREATE, so connections are never created), and messages are packed into
+a buffer sent in one syscall when full or flushed. Kernel finds connections by tuple (it ignores CTA_ID when
+changing a connection), thus updates are keyed by orig tuple, as passed in nf_packet or nf_ct_event; only protocols
+with ports (TCP, UDP, SCTP, ...) are supported. With a mask, only masked bits of connmark are replaced
+(CTA_MARK_MASK, kernel 4.1+; kernel XORs the mark into the kept bits, so bits of mark outside the mask are cleared
+before sending). Messages are not acknowledged; failures (e.g. ENOENT for connections that are gone)
+are reported by kernel as NLMSG_ERROR messages, which can be read with nfqueue_ct_receive() or ignored.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+//Event subscription (nfqueue_ct_open)
+enum
+{
+    NF_CT_EVENT_NEW     = 1 << 0,
+    NF_CT_EVENT_UPDATE  = 1 << 1,
+    NF_CT_EVENT_DESTROY = 1 << 2,
+};
+
+//Event type (nf_ct_event.type)
+enum
+{
+    NF_CT_NEW       = 1,  //new connection (event)
+    NF_CT_UPDATE    = 2,  //connection changed, e.g. its state or mark (event)
+    NF_CT_DESTROY   = 3,  //connection destroyed (event)
+    NF_CT_DUMP      = 4,  //existing connection (dump reply)
+    NF_CT_DUMP_DONE = 5,  //end of dump; other fields are zero
+};
+
+struct nf_conntrack
+{
+    struct mnl_socket* nl_socket;
+    uint32_t           seq;       //sequence number of the last request
+    uint64_t           overruns;  //number of ENOBUFS errors (events lost)
+};
+
+#define NF_CT_BATCH_SIZE 65536
+
+//Batch of connmark updates
+struct nf_ct_batch
+{
+    struct nf_conntrack* ct;
+    void*              data;      //allocated once by nfqueue_ct_batch_init()
+    size_t             size;
+    size_t             len;       //used part of data
+    uint32_t           count;     //number of pending messages
+    uint64_t           sent;      //messages sent
+};
+
+struct nf_ct_event
+{
+    int                type;          //NF_CT_*
+    uint32_t           conn_id;       //CTA_ID
+    uint32_t           conn_status;   //CTA_STATUS (IPS_*)
+    bool               has_connmark;
+    uint32_t           conn_mark;     //CTA_MARK
+    uint32_t           timeout;       //CTA_TIMEOUT (seconds), zero if not passed
+    struct ip_tuple    orig;          //CTA_TUPLE_ORIG
+    struct ip_tuple    reply;         //CTA_TUPLE_REPLY
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+//Return false on failure
+static bool nfqueue_ct_parse(const struct nlmsghdr* nlh, struct nf_ct_event* ev)
+{
+    struct nlattr* attr[CTA_MAX+1] = {0};
+    if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), parse_cta_attr_cb, attr) < 0)
+    {
+        LOG_SYSERR("mnl_attr_parse");
+        return false;
+    }
+    if (attr[CTA_ID])
+        ev->conn_id = ntohl(mnl_attr_get_u32(attr[CTA_ID]));
+    if (attr[CTA_STATUS])
+        ev->conn_status = ntohl(mnl_attr_get_u32(attr[CTA_STATUS]));
+    if (attr[CTA_MARK])
+    {
+        ev->has_connmark = true;
+        ev->conn_mark = ntohl(mnl_attr_get_u32(attr[CTA_MARK]));
+    }
+    if (attr[CTA_TIMEOUT])
+        ev->timeout = ntohl(mnl_attr_get_u32(attr[CTA_TIMEOUT]));
+    if (attr[CTA_TUPLE_ORIG] && !read_addr_tuple(attr[CTA_TUPLE_ORIG], &ev->orig))
+    {
+        LOG_SYSERR("read_addr_tuple(orig)");
+        return false;
+    }
+    if (attr[CTA_TUPLE_REPLY] && !read_addr_tuple(attr[CTA_TUPLE_REPLY], &ev->reply))
+    {
+        LOG_SYSERR("read_addr_tuple(reply)");
+        return false;
+    }
+    return true;
+}
+
+
+//helper
+//Return false if buffer is too short
+static bool nfqueue_ct_put_tuple(struct nlmsghdr* nlh, size_t buf_len, int type, const struct ip_tuple* tuple)
+{
+    struct nlattr* nest = mnl_attr_nest_start_check(nlh, buf_len, type);
+    if (nest == NULL)
+        return false;
+    struct nlattr* ip = mnl_attr_nest_start_check(nlh, buf_len, CTA_TUPLE_IP);
+    if (ip == NULL)
+        return false;
+    if (tuple->ip_version == IPV4)
+    {
+        if (!mnl_attr_put_u32_check(nlh, buf_len, CTA_IP_V4_SRC, tuple->src.ip4) ||
+            !mnl_attr_put_u32_check(nlh, buf_len, CTA_IP_V4_DST, tuple->dst.ip4))
+            return false;
+    }
+    else
+    {
+        if (!mnl_attr_put_check(nlh, buf_len, CTA_IP_V6_SRC, sizeof(struct in6_addr), &tuple->src.in6) ||
+            !mnl_attr_put_check(nlh, buf_len, CTA_IP_V6_DST, sizeof(struct in6_addr), &tuple->dst.in6))
+            return false;
+    }
+    mnl_attr_nest_end(nlh, ip);
+    struct nlattr* proto = mnl_attr_nest_start_check(nlh, buf_len, CTA_TUPLE_PROTO);
+    if (proto == NULL)
+        return false;
+    if (!mnl_attr_put_u8_check(nlh, buf_len, CTA_PROTO_NUM, tuple->protocol) ||
+        !mnl_attr_put_u16_check(nlh, buf_len, CTA_PROTO_SRC_PORT, htons(tuple->src_port)) ||
+        !mnl_attr_put_u16_check(nlh, buf_len, CTA_PROTO_DST_PORT, htons(tuple->dst_port)))
+        return false;
+    mnl_attr_nest_end(nlh, proto);
+    mnl_attr_nest_end(nlh, nest);
+    return true;
+}
+
+
+//helper
+//Return NULL if buffer is too short
+//Build connmark update message in buf (of buf_len bytes)
+static struct nlmsghdr* nfqueue_ct_put_mark(void* buf, size_t buf_len, uint32_t seq, const struct ip_tuple* orig, uint32_t mark, uint32_t mask)
+{
+    if (MNL_ALIGN(sizeof(struct nlmsghdr)) + MNL_ALIGN(sizeof(struct nfgenmsg)) > buf_len)
+        return NULL;
+    struct nlmsghdr* nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = seq;
+    struct nfgenmsg* nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = orig->ip_version == IPV4? AF_INET : AF_INET6;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = 0;
+
+    if (!nfqueue_ct_put_tuple(nlh, buf_len, CTA_TUPLE_ORIG, orig))
+        return NULL;
+    if (!mnl_attr_put_u32_check(nlh, buf_len, CTA_MARK, htonl(mark & mask)))  //kernel sets (connmark & ~mask) ^ mark
+        return NULL;
+    if (mask != 0xFFFFFFFF && !mnl_attr_put_u32_check(nlh, buf_len, CTA_MARK_MASK, htonl(mask)))
+        return NULL;
+    return nlh;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure
+//events is a combination of NF_CT_EVENT_* flags (zero if the socket is used only for dumps)
+//rcvbuf is socket receive buffer size (see nf_queue_options.rcvbuf); zero means system default
+bool nfqueue_ct_open(struct nf_conntrack* ct, uint32_t events, int rcvbuf)
+{
+    ASSERT(ct);
+    memset(ct, 0, sizeof(*ct));
+
+    if ((ct->nl_socket = mnl_socket_open2(NETLINK_NETFILTER, SOCK_NONBLOCK)) == NULL)
+    {
+        LOG_SYSERR("mnl_socket_open");
+        return false;
+    }
+    if (mnl_socket_bind(ct->nl_socket, 0, MNL_SOCKET_AUTOPID) < 0)
+    {
+        LOG_SYSERR("mnl_socket_bind");
+        goto fail;
+    }
+
+    struct nf_queue_options opt;
+    nfqueue_default_options(&opt);
+    opt.rcvbuf = rcvbuf;
+    if (!nfqueue_set_socket_options(ct->nl_socket, &opt))
+        goto fail;
+
+    static const struct
+    {
+        uint32_t event;
+        int group;
+    } groups[] =
+    {
+        { NF_CT_EVENT_NEW,     NFNLGRP_CONNTRACK_NEW },
+        { NF_CT_EVENT_UPDATE,  NFNLGRP_CONNTRACK_UPDATE },
+        { NF_CT_EVENT_DESTROY, NFNLGRP_CONNTRACK_DESTROY },
+    };
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++)
+    {
+        if (!(events & groups[i].event))
+            continue;
+        int group = groups[i].group;
+        if (mnl_socket_setsockopt(ct->nl_socket, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0)
+        {
+            LOG_SYSERR("mnl_socket_setsockopt(NETLINK_ADD_MEMBERSHIP)");
+            goto fail;
+        }
+    }
+    DEBUG("Conntrack socket opened (events=%x)", events);
+    return true;
+
+fail:
+    mnl_socket_close(ct->nl_socket);
+    ct->nl_socket = NULL;
+    return false;
+}
+
+
+void nfqueue_ct_close(struct nf_conntrack* ct)
+{
+    ASSERT(ct);
+    ASSERT(ct->nl_socket);
+    DEBUG("Closing conntrack socket");
+    mnl_socket_close(ct->nl_socket);
+    ct->nl_socket = NULL;
+}
+
+
+//Return file descriptor of the socket, for integration with external event loops (see nfqueue_fd())
+int nfqueue_ct_fd(const struct nf_conntrack* ct)
+{
+    ASSERT(ct);
+    ASSERT(ct->nl_socket);
+    return mnl_socket_get_fd(ct->nl_socket);
+}
+
+
+//Return false on failure
+//Request dump of conntrack table; family is AF_INET, AF_INET6 or AF_UNSPEC (both)
+//Replies are read with nfqueue_ct_receive() and nfqueue_ct_next()
+bool nfqueue_ct_dump(struct nf_conntrack* ct, int family)
+{
+    ASSERT(ct);
+    ASSERT(ct->nl_socket);
+    CMD_BUF(buf);
+    struct nlmsghdr* nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = ++ct->seq;
+    struct nfgenmsg* nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = 0;
+    if (mnl_socket_sendto(ct->nl_socket, nlh, nlh->nlmsg_len) < 0)
+    {
+        LOG_SYSERR("mnl_socket_sendto");
+        return false;
+    }
+    DEBUG("Conntrack dump requested (family=%d)", family);
+    return true;
+}
+
+
+//Return 1 on success, -1 on failure, 0 on timeout (if timeout_ms > 0) or data not ready
+//Receive events or dump replies into buf; timeout_ms as in nfqueue_receive()
+int nfqueue_ct_receive(struct nf_conntrack* ct, struct nf_buffer* buf, int64_t timeout_ms)
+{
+    ASSERT(ct);
+    ASSERT(ct->nl_socket);
+    ASSERT(buf);
+
+    if (buf->data == NULL)
+    {
+        buf->data = malloc(RECV_BUF_LEN);
+        ASSERT(buf->data != NULL);
+    }
+    buf->generation++;
+
+    int fd = mnl_socket_get_fd(ct->nl_socket);
+    if (timeout_ms >= 0)
+    {
+        int retval = recv_timeout(fd, timeout_ms);
+        if (retval == 0)  //timeout
+            return IO_NOTREADY;
+        else if (retval < 0)
+        {
+            if (errno == EINTR)
+                return IO_NOTREADY;
+            LOG_SYSERR("recv_timeout");
+            return IO_ERROR;
+        }
+    }
+
+    int len = mnl_socket_recvfrom(ct->nl_socket, buf->data, RECV_BUF_LEN);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return IO_NOTREADY;
+        if (errno == ENOBUFS)
+        {
+            if (ct->overruns++ == 0)
+                LOG(LOG_WARNING, "Conntrack socket buffer overrun, events lost");
+            return IO_NOTREADY;
+        }
+        LOG_SYSERR("mnl_socket_recvfrom");
+        return IO_ERROR;
+    }
+    buf->nlh = (struct nlmsghdr*)buf->data;
+    buf->len = len;
+    return IO_READY;
+}
+
+
+//Return 1 on success (result in ev), -1 on failure, 0 on no more data
+//Iterate messages received by nfqueue_ct_receive()
+int nfqueue_ct_next(struct nf_buffer* buf, struct nf_ct_event* ev)
+{
+    ASSERT(buf);
+    ASSERT(buf->nlh);
+    ASSERT(ev);
+
+    while (mnl_nlmsg_ok(buf->nlh, buf->len))
+    {
+        const struct nlmsghdr* nlh = buf->nlh;
+        buf->nlh = mnl_nlmsg_next(buf->nlh, &buf->len);
+        memset(ev, 0, sizeof(*ev));
+
+        if (nlh->nlmsg_type == NLMSG_DONE)
+        {
+            ev->type = NF_CT_DUMP_DONE;
+            return IO_READY;
+        }
+        if (nlh->nlmsg_type == NLMSG_ERROR)
+        {
+            nfqueue_control_msg(nlh);
+            continue;
+        }
+        if ((nlh->nlmsg_type >> 8) != NFNL_SUBSYS_CTNETLINK)
+            continue;
+
+        int type = nlh->nlmsg_type & 0xFF;
+        if (type == IPCTNL_MSG_CT_DELETE)
+            ev->type = NF_CT_DESTROY;
+        else if (type == IPCTNL_MSG_CT_NEW && (nlh->nlmsg_flags & NLM_F_MULTI))
+            ev->type = NF_CT_DUMP;
+        else if (type == IPCTNL_MSG_CT_NEW)
+            ev->type = (nlh->nlmsg_flags & (NLM_F_CREATE | NLM_F_EXCL))? NF_CT_NEW : NF_CT_UPDATE;
+        else
+            continue;
+
+        if (!nfqueue_ct_parse(nlh, ev))
+            return IO_ERROR;
+        return IO_READY;
+    }
+    return IO_NOTREADY;
+}
+
+
+//Return false on failure
+//size is the buffer size, i.e. the maximum length of one send; zero means NF_CT_BATCH_SIZE
+bool nfqueue_ct_batch_init(struct nf_ct_batch* b, struct nf_conntrack* ct, size_t size)
+{
+    ASSERT(b);
+    ASSERT(ct);
+    memset(b, 0, sizeof(*b));
+    b->ct = ct;
+    b->size = size > 0? size : NF_CT_BATCH_SIZE;
+    b->data = malloc(b->size);
+    if (b->data == NULL)
+    {
+        LOG_SYSERR("malloc");
+        return false;
+    }
+    return true;
+}
+
+
+//Pending updates are discarded; call nfqueue_ct_batch_flush() first
+void nfqueue_ct_batch_free(struct nf_ct_batch* b)
+{
+    ASSERT(b);
+    free(b->data);
+    b->data = NULL;
+}
+
+
+//Return false on failure
+//Send pending updates
+bool nfqueue_ct_batch_flush(struct nf_ct_batch* b)
+{
+    ASSERT(b);
+    ASSERT(b->data);
+    if (b->len == 0)
+        return true;
+
+    DEBUG("Sending %u connmark updates (length=%zu)", b->count, b->len);
+
+    ssize_t ret = mnl_socket_sendto(b->ct->nl_socket, b->data, b->len);
+    b->sent += b->count;
+    b->len = 0;
+    b->count = 0;
+    if (ret < 0)
+    {
+        LOG_SYSERR("mnl_socket_sendto");
+        return false;
+    }
+    return true;
+}
+
+
+//Return false on failure
+//Set connmark of connection with given orig tuple to (connmark & ~mask) | (mark & mask); mask 0xFFFFFFFF replaces it
+//The update is sent when the buffer becomes full, or by nfqueue_ct_batch_flush()
+bool nfqueue_ct_batch_mark(struct nf_ct_batch* b, const struct ip_tuple* orig, uint32_t mark, uint32_t mask)
+{
+    ASSERT(b);
+    ASSERT(b->data);
+    ASSERT(orig);
+    if (orig->ip_version != IPV4 && orig->ip_version != IPV6)
+    {
+        LOG(LOG_ERR, "Connmark update without IP addresses");
+        return false;
+    }
+
+    uint32_t seq = ++b->ct->seq;
+    struct nlmsghdr* nlh = nfqueue_ct_put_mark((char*)b->data + b->len, b->size - b->len, seq, orig, mark, mask);
+    if (nlh == NULL)  //buffer full
+    {
+        if (!nfqueue_ct_batch_flush(b))
+            return false;
+        nlh = nfqueue_ct_put_mark(b->data, b->size, seq, orig, mark, mask);
+        ASSERT(nlh != NULL);
+    }
+    b->len += nlh->nlmsg_len;
+    b->count++;
+    return true;
+}
+
+
+#endif //NFQUEUE_MNL_CONNTRACK_H
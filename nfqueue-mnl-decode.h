@@ -0,0 +1,371 @@
+/*
+ *  nfqueue-mnl-decode.h - IPv4/IPv6 and TCP/UDP/ICMP header decoder
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_DECODE_H
+#define NFQUEUE_MNL_DECODE_H
+
+
+#include "nfqueue-mnl.h"
+
+
+/*
+Header decoder
+
+nfqueue_decode() fills ip_tuple (addresses, ports, protocol) and L4 offsets straight from the packet payload, so
+that 5-tuples are available without conntrack info; with NFQA_CFG_F_CONNTRACK cleared and copy_range of e.g.
+128 bytes, only headers cross to user space. IPv6 extension headers (hop-by-hop, routing, destination options,
+fragment, AH) are skipped, up to NF_DECODE_MAX_EXT of them. Every read is checked against the payload length and
+the IP total length; a payload cut short by copy_range yields what is present, with NF_HDR_TRUNCATED set.
+Ports are set for TCP, UDP, UDP-Lite and SCTP, and ICMP type, code and echo id for ICMP and ICMPv6, as long as
+the payload contains them; NF_HDR_L4 tells that the whole L4 header is present. Non-first fragments have no L4
+header. Addresses are stored as in the conntrack tuple (network byte order), ports in host byte order.
+
+nfqueue_decode_batch() decodes an array of packets (e.g. all packets of one nfqueue_receive()) into arrays of
+fields (structure of arrays), allocated once by nfqueue_decode_batch_init(). Validation is branchy and done per
+packet, with the payload of a later packet prefetched; conversion of ports to host byte order is a separate
+straight-line loop over the arrays, which the compiler vectorizes.
+
+    struct nf_headers h;
+    if (nfqueue_decode_packet(packet, &h) && (h.flags & NF_HDR_L4))
+        lookup(&h.tuple);
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_DECODE_MAX_EXT       8   //max IPv6 extension headers walked
+#define NF_DECODE_PREFETCH      4   //distance of payload prefetch in batch decoding
+
+//nf_headers.flags
+enum
+{
+    NF_HDR_L4             = 1 << 0,  //L4 header is complete (data_offset is set)
+    NF_HDR_FRAGMENT       = 1 << 1,  //non-first fragment, no L4 header
+    NF_HDR_MORE_FRAGMENTS = 1 << 2,  //MF flag set, i.e. first or middle fragment
+    NF_HDR_TRUNCATED      = 1 << 3,  //payload ends before the headers do
+    NF_HDR_EXTENSIONS     = 1 << 4,  //IPv6 extension headers present
+};
+
+struct nf_headers
+{
+    struct ip_tuple   tuple;          //ip_version, src, dst, src_port, dst_port, protocol (L4, after extension headers)
+    uint16_t          flags;          //NF_HDR_*
+    uint16_t          l3_len;         //IP total length (may be more than payload length)
+    uint16_t          l4_offset;      //offset of L4 header in payload
+    uint16_t          data_offset;    //offset of L4 data (if NF_HDR_L4)
+    uint8_t           ttl;            //TTL or hop limit
+    uint8_t           tcp_flags;      //TH_FIN, TH_SYN, ...
+    uint8_t           icmp_type;
+    uint8_t           icmp_code;
+    uint16_t          icmp_id;        //echo request and reply only
+};
+
+//Decoded headers of many packets, as arrays of fields
+//Packets that are not valid IPv4/IPv6 have ip_version zero.
+struct nf_decode_batch
+{
+    size_t            count;          //number of packets decoded by the last nfqueue_decode_batch()
+    size_t            capacity;
+    void*             data;           //one allocation for all arrays
+    uint32_t*         packet_id;
+    uint8_t*          ip_version;
+    uint8_t*          protocol;
+    uint8_t*          tcp_flags;
+    uint16_t*         flags;
+    uint16_t*         l4_offset;
+    uint16_t*         src_port;
+    uint16_t*         dst_port;
+    ip_address_t*     src;
+    ip_address_t*     dst;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static inline uint16_t nfqueue_decode_be16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+//helper
+//Return false if payload is not an IPv4 or IPv6 packet; ports are left in network byte order
+static inline bool nfqueue_decode_raw(const uint8_t* ip, size_t len, struct nf_headers* h)
+{
+    memset(h, 0, sizeof(*h));
+    if (len < 1)
+        return false;
+
+    size_t off;
+    size_t end = len;  //end of data that belongs to the packet
+    uint8_t protocol;
+    if ((ip[0] >> 4) == IPV4)
+    {
+        size_t ihl = (ip[0] & 0x0F) * 4;
+        if (len < 20 || ihl < 20 || ihl > len)
+            return false;
+        size_t total = nfqueue_decode_be16(ip + 2);
+        if (total < ihl)
+            return false;
+        if (total < end)
+            end = total;
+        h->l3_len = total;
+        h->tuple.ip_version = IPV4;
+        memcpy(&h->tuple.src.ip4, ip + 12, sizeof(uint32_t));
+        memcpy(&h->tuple.dst.ip4, ip + 16, sizeof(uint32_t));
+        h->ttl = ip[8];
+        protocol = ip[9];
+        uint16_t frag = nfqueue_decode_be16(ip + 6);
+        if (frag & 0x2000)
+            h->flags |= NF_HDR_MORE_FRAGMENTS;
+        if (frag & 0x1FFF)
+            h->flags |= NF_HDR_FRAGMENT;
+        off = ihl;
+    }
+    else if ((ip[0] >> 4) == IPV6)
+    {
+        if (len < 40)
+            return false;
+        size_t payload_len = nfqueue_decode_be16(ip + 4);
+        if (payload_len > 0 && 40 + payload_len < end)  //zero means jumbogram
+            end = 40 + payload_len;
+        h->l3_len = 40 + payload_len;
+        h->tuple.ip_version = IPV6;
+        memcpy(&h->tuple.src, ip + 8, sizeof(ip_address_t));
+        memcpy(&h->tuple.dst, ip + 24, sizeof(ip_address_t));
+        h->ttl = ip[7];
+        protocol = ip[6];
+        off = 40;
+
+        for (int i = 0; i <= NF_DECODE_MAX_EXT; i++)
+        {
+            size_t ext_len;
+            if (protocol == IPPROTO_HOPOPTS || protocol == IPPROTO_ROUTING || protocol == IPPROTO_DSTOPTS ||
+                protocol == IPPROTO_FRAGMENT || protocol == IPPROTO_AH)
+            {
+                if (i == NF_DECODE_MAX_EXT || off + 8 > end)
+                {
+                    h->flags |= NF_HDR_TRUNCATED | NF_HDR_EXTENSIONS;
+                    h->tuple.protocol = protocol;
+                    return true;
+                }
+            }
+            else
+                break;
+
+            if (protocol == IPPROTO_FRAGMENT)
+            {
+                ext_len = 8;
+                uint16_t frag = nfqueue_decode_be16(ip + off + 2);
+                if (frag & 0x0001)
+                    h->flags |= NF_HDR_MORE_FRAGMENTS;
+                if (frag & 0xFFF8)
+                    h->flags |= NF_HDR_FRAGMENT;
+            }
+            else if (protocol == IPPROTO_AH)
+                ext_len = ((size_t)ip[off + 1] + 2) * 4;
+            else
+                ext_len = ((size_t)ip[off + 1] + 1) * 8;
+            h->flags |= NF_HDR_EXTENSIONS;
+            protocol = ip[off];
+            off += ext_len;
+        }
+    }
+    else
+        return false;
+
+    h->tuple.protocol = protocol;
+    h->l4_offset = off;
+    if (h->flags & NF_HDR_FRAGMENT)
+        return true;
+
+    const uint8_t* l4 = ip + off;
+    size_t avail = end > off? end - off : 0;
+    size_t l4_len;
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            l4_len = avail >= 13? (size_t)(l4[12] >> 4) * 4 : 20;
+            if (l4_len < 20)  //malformed data offset
+                return true;
+            if (avail >= 14)
+                h->tcp_flags = l4[13];
+            break;
+        case IPPROTO_UDP:
+        case IPPROTO_UDPLITE:
+            l4_len = 8;
+            break;
+        case IPPROTO_SCTP:
+            l4_len = 12;
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            l4_len = 8;
+            if (avail >= 2)
+            {
+                h->icmp_type = l4[0];
+                h->icmp_code = l4[1];
+            }
+            if (avail >= 6 && (protocol == IPPROTO_ICMP? (l4[0] == 8 || l4[0] == 0) : (l4[0] == 128 || l4[0] == 129)))
+                h->icmp_id = nfqueue_decode_be16(l4 + 4);  //echo request or reply
+            break;
+        default:  //no known L4 header
+            return true;
+    }
+    if (protocol != IPPROTO_ICMP && protocol != IPPROTO_ICMPV6 && avail >= 4)
+    {
+        memcpy(&h->tuple.src_port, l4, sizeof(uint16_t));
+        memcpy(&h->tuple.dst_port, l4 + 2, sizeof(uint16_t));
+    }
+    if (avail < l4_len)
+    {
+        h->flags |= NF_HDR_TRUNCATED;
+        return true;
+    }
+    h->flags |= NF_HDR_L4;
+    h->data_offset = off + l4_len;
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false if payload is not an IPv4 or IPv6 packet
+//Decode IP and L4 headers of len bytes of payload; see note above
+static inline bool nfqueue_decode(const void* payload, size_t len, struct nf_headers* h)
+{
+    ASSERT(h);
+    if (!nfqueue_decode_raw(payload, len, h))
+        return false;
+    h->tuple.src_port = ntohs(h->tuple.src_port);
+    h->tuple.dst_port = ntohs(h->tuple.dst_port);
+    return true;
+}
+
+
+//Return false if packet has no payload (e.g. NFQNL_COPY_META or NF_SKIP_PAYLOAD) or is not an IP packet
+static inline bool nfqueue_decode_packet(const struct nf_packet* packet, struct nf_headers* h)
+{
+    ASSERT(packet);
+    if (packet->payload == NULL)
+    {
+        memset(h, 0, sizeof(*h));
+        return false;
+    }
+    return nfqueue_decode(packet->payload, packet->payload_len, h);
+}
+
+
+//Return false on failure
+//Allocate arrays for up to capacity packets
+bool nfqueue_decode_batch_init(struct nf_decode_batch* b, size_t capacity)
+{
+    ASSERT(b);
+    ASSERT(capacity > 0);
+    memset(b, 0, sizeof(*b));
+
+    //Every array starts at a cache line boundary
+    size_t sizes[] = { sizeof(uint32_t), sizeof(uint8_t), sizeof(uint8_t), sizeof(uint8_t), sizeof(uint16_t),
+                       sizeof(uint16_t), sizeof(uint16_t), sizeof(uint16_t), sizeof(ip_address_t), sizeof(ip_address_t) };
+    size_t offsets[sizeof(sizes) / sizeof(sizes[0])];
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        offsets[i] = total;
+        total += (capacity * sizes[i] + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1);
+    }
+    b->data = aligned_alloc(CACHELINE_SIZE, total);
+    if (b->data == NULL)
+    {
+        LOG_SYSERR("aligned_alloc");
+        return false;
+    }
+    b->capacity = capacity;
+    char* base = b->data;
+    b->packet_id  = (uint32_t*)(base + offsets[0]);
+    b->ip_version = (uint8_t*)(base + offsets[1]);
+    b->protocol   = (uint8_t*)(base + offsets[2]);
+    b->tcp_flags  = (uint8_t*)(base + offsets[3]);
+    b->flags      = (uint16_t*)(base + offsets[4]);
+    b->l4_offset  = (uint16_t*)(base + offsets[5]);
+    b->src_port   = (uint16_t*)(base + offsets[6]);
+    b->dst_port   = (uint16_t*)(base + offsets[7]);
+    b->src        = (ip_address_t*)(base + offsets[8]);
+    b->dst        = (ip_address_t*)(base + offsets[9]);
+    return true;
+}
+
+
+void nfqueue_decode_batch_free(struct nf_decode_batch* b)
+{
+    ASSERT(b);
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+
+//Return number of packets decoded, i.e. min(count, capacity)
+//Decode packets[0..count-1] into arrays of b; packets without payload or not IP get ip_version zero
+size_t nfqueue_decode_batch(struct nf_decode_batch* b, const struct nf_packet* packets, size_t count)
+{
+    ASSERT(b);
+    ASSERT(b->data);
+    ASSERT(packets || count == 0);
+    if (count > b->capacity)
+        count = b->capacity;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i + NF_DECODE_PREFETCH < count && packets[i + NF_DECODE_PREFETCH].payload)
+            __builtin_prefetch(packets[i + NF_DECODE_PREFETCH].payload);
+        struct nf_headers h;
+        const struct nf_packet* p = &packets[i];
+        if (p->payload == NULL || !nfqueue_decode_raw(p->payload, p->payload_len, &h))
+            memset(&h, 0, sizeof(h));
+        b->packet_id[i] = p->packet_id;
+        b->ip_version[i] = h.tuple.ip_version;
+        b->protocol[i] = h.tuple.protocol;
+        b->tcp_flags[i] = h.tcp_flags;
+        b->flags[i] = h.flags;
+        b->l4_offset[i] = h.l4_offset;
+        b->src_port[i] = h.tuple.src_port;
+        b->dst_port[i] = h.tuple.dst_port;
+        b->src[i] = h.tuple.src;
+        b->dst[i] = h.tuple.dst;
+    }
+
+    //Straight-line, vectorized by the compiler
+    for (size_t i = 0; i < count; i++)
+    {
+        b->src_port[i] = ntohs(b->src_port[i]);
+        b->dst_port[i] = ntohs(b->dst_port[i]);
+    }
+    b->count = count;
+    return count;
+}
+
+
+#endif //NFQUEUE_MNL_DECODE_H
@@ -0,0 +1,358 @@
+/*
+ *  nfqueue-mnl-defer.h - Deferred verdicts with out-of-order completion
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_DEFER_H
+#define NFQUEUE_MNL_DEFER_H
+
+
+#include "nfqueue-mnl.h"
+
+
+/*
+Deferred verdicts
+
+Packets whose verdict needs an external lookup are added to a deferred verdict table when received, and completed
+later, in any order. A packet not completed within timeout_ms gets the default verdict. nfqueue_defer_flush(),
+called after every receive loop and when nfqueue_defer_next_timeout() expires, sends completed verdicts:
+
+- the completed packets with the lowest ids, up to the first pending one, are answered with a single
+  NFQNL_MSG_VERDICT_BATCH (those with a connmark, or a verdict different from the first, are sent individually
+  just before it in the same datagram, so that the batch does not apply to them),
+- packets completed out of order, after a pending one, are sent individually (all in one datagram).
+
+Packet ids are assigned by the kernel sequentially per queue, so the table is a ring of window slots indexed by
+packet_id modulo window; ids skipped by the kernel (packets dropped on a full queue) are treated as answered.
+Because a batch verdict covers every queued packet with a lower id, all packets received from the queue must be
+added to the table, in the order returned by nfqueue_next(); packets decided immediately are added and completed
+right away. The table is not thread-safe: completions made by other threads should come back through a return
+ring (see nfqueue-mnl-ring.h) and be passed to nfqueue_defer_complete() by the thread owning the table.
+
+    while (nfqueue_next(buf, packet) == IO_READY)
+    {
+        if (!nfqueue_defer_add(table, packet->packet_id))
+            nfqueue_verdict(q, packet->packet_id, NF_ACCEPT, -1);  //window full
+        else
+            start_lookup(packet);  //later: nfqueue_defer_complete(table, packet_id, verdict, connmark)
+    }
+    nfqueue_defer_flush(table);
+
+nfqueue_defer_outstanding() tells how many packets are held in the kernel queue on behalf of the table; keeping it
+below queue_len (see nf_queue_options) avoids drops by the kernel (or fail-open accepts). Deadlines use
+CLOCK_MONOTONIC_COARSE, so timeouts have a resolution of a jiffy.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+//nf_deferred.state
+enum
+{
+    NF_DEFER_FREE     = 0,  //not added, or already answered
+    NF_DEFER_PENDING  = 1,
+    NF_DEFER_DONE     = 2,  //completed, verdict not sent yet
+};
+
+struct nf_defer_options
+{
+    uint32_t           window;            //max span of outstanding packet ids (rounded up to a power of 2)
+    uint32_t           timeout_ms;        //pending packets older than that get the default verdict
+    int                default_verdict;
+    int64_t            default_connmark;  //-1 means don't set
+};
+
+struct nf_deferred
+{
+    int64_t            connmark;
+    int32_t            verdict;
+    uint32_t           deadline;          //CLOCK_MONOTONIC_COARSE in ms (wraps around)
+    uint8_t            state;             //NF_DEFER_*
+};
+
+struct nf_defer_stats
+{
+    uint64_t           added;
+    uint64_t           completed;         //by nfqueue_defer_complete()
+    uint64_t           timeouts;          //answered with default verdict
+    uint64_t           rejected;          //not added because window was full
+    uint64_t           batches;           //NFQNL_MSG_VERDICT_BATCH messages sent
+    uint64_t           batched;           //packets answered by them
+    uint64_t           singles;           //packets answered individually
+};
+
+struct nf_defer_table
+{
+    struct nf_queue*   q;
+    struct nf_deferred* slots;
+    uint32_t           mask;              //window - 1
+    uint32_t           low;               //lowest id that may be outstanding
+    uint32_t           high;              //highest id added + 1
+    uint32_t           pending;
+    uint32_t           done;              //completed, not sent
+    uint32_t           timeout_ms;
+    int                default_verdict;
+    int64_t            default_connmark;
+    struct nf_verdict_queue vq;           //individual verdicts
+    struct nf_defer_stats stats;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static uint32_t nfqueue_defer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);  //vDSO, no syscall
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+//helper
+static inline struct nf_deferred* nfqueue_defer_slot(const struct nf_defer_table* t, uint32_t packet_id)
+{
+    return &t->slots[packet_id & t->mask];
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+void nfqueue_defer_default_options(struct nf_defer_options* opt)
+{
+    ASSERT(opt);
+    memset(opt, 0, sizeof(*opt));
+    opt->window = 1024;  //kernel's default queue_len
+    opt->timeout_ms = 100;
+    opt->default_verdict = NF_ACCEPT;
+    opt->default_connmark = -1;
+}
+
+
+//Return false on failure
+//If opt is NULL, use defaults
+bool nfqueue_defer_init(struct nf_defer_table* t, struct nf_queue* q, const struct nf_defer_options* opt)
+{
+    ASSERT(t);
+    ASSERT(q);
+    struct nf_defer_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_defer_default_options(&defaults);
+        opt = &defaults;
+    }
+    ASSERT(opt->window > 0 && opt->window <= 0x40000000);
+    ASSERT(opt->timeout_ms < 0x80000000);  //timestamps wrap around
+
+    memset(t, 0, sizeof(*t));
+    uint32_t size = 2;
+    while (size < opt->window)
+        size <<= 1;
+    t->slots = calloc(size, sizeof(struct nf_deferred));
+    if (t->slots == NULL)
+    {
+        LOG_SYSERR("calloc");
+        return false;
+    }
+    if (!nfqueue_vq_init(&t->vq, q, 0, 0, 0))
+    {
+        free(t->slots);
+        t->slots = NULL;
+        return false;
+    }
+    t->q = q;
+    t->mask = size - 1;
+    t->timeout_ms = opt->timeout_ms;
+    t->default_verdict = opt->default_verdict;
+    t->default_connmark = opt->default_connmark;
+    DEBUG("Deferred verdict table: window %u, timeout %u ms", size, t->timeout_ms);
+    return true;
+}
+
+
+//Pending packets are not answered; call nfqueue_defer_flush() first if needed
+void nfqueue_defer_free(struct nf_defer_table* t)
+{
+    ASSERT(t);
+    nfqueue_vq_free(&t->vq);
+    free(t->slots);
+    t->slots = NULL;
+}
+
+
+//Return false if packet cannot be deferred (the caller must then give its verdict directly):
+//window is full (packet_id is window or more ahead of the oldest outstanding packet) or ids are out of order
+bool nfqueue_defer_add(struct nf_defer_table* t, uint32_t packet_id)
+{
+    ASSERT(t);
+    ASSERT(t->slots);
+    if (t->low == t->high)  //nothing outstanding
+        t->low = t->high = packet_id;
+    if ((int32_t)(packet_id - t->high) < 0)
+    {
+        LOG(LOG_ERR, "Deferred packet %u added out of order", packet_id);
+        return false;
+    }
+    if (packet_id - t->low > t->mask)
+    {
+        t->stats.rejected++;
+        return false;
+    }
+    struct nf_deferred* e = nfqueue_defer_slot(t, packet_id);
+    e->state = NF_DEFER_PENDING;
+    e->deadline = nfqueue_defer_now() + t->timeout_ms;
+    t->high = packet_id + 1;
+    t->pending++;
+    t->stats.added++;
+    return true;
+}
+
+
+//Return false if packet is not pending (unknown, already completed or timed out)
+//The verdict is sent by a later nfqueue_defer_flush()
+bool nfqueue_defer_complete(struct nf_defer_table* t, uint32_t packet_id, int verdict, int64_t connmark)
+{
+    ASSERT(t);
+    ASSERT(t->slots);
+    if (packet_id - t->low >= t->high - t->low)
+        return false;
+    struct nf_deferred* e = nfqueue_defer_slot(t, packet_id);
+    if (e->state != NF_DEFER_PENDING)
+        return false;
+    e->state = NF_DEFER_DONE;
+    e->verdict = verdict;
+    e->connmark = connmark;
+    t->pending--;
+    t->done++;
+    t->stats.completed++;
+    return true;
+}
+
+
+//Return false on failure to send verdicts
+//Apply default verdict to timed out packets, and send verdicts of completed packets (see note above)
+bool nfqueue_defer_flush(struct nf_defer_table* t)
+{
+    ASSERT(t);
+    ASSERT(t->slots);
+    uint32_t now = nfqueue_defer_now();
+    bool ok = true;
+    bool batch = false;
+    int batch_verdict = 0;
+    uint32_t batch_max = 0;
+
+    //Leading run of answered packets; deadlines grow with ids, so timeouts are found here too
+    uint32_t id = t->low;
+    for (; id != t->high; id++)
+    {
+        struct nf_deferred* e = nfqueue_defer_slot(t, id);
+        if (e->state == NF_DEFER_PENDING)
+        {
+            if ((int32_t)(now - e->deadline) < 0)
+                break;
+            e->state = NF_DEFER_DONE;
+            e->verdict = t->default_verdict;
+            e->connmark = t->default_connmark;
+            t->pending--;
+            t->done++;
+            t->stats.timeouts++;
+        }
+        if (e->state == NF_DEFER_DONE)
+        {
+            if (e->connmark < 0 && (!batch || e->verdict == batch_verdict))
+            {
+                batch = true;
+                batch_verdict = e->verdict;
+                batch_max = id;
+                t->stats.batched++;
+            }
+            else
+            {
+                ok = nfqueue_vq_push(&t->vq, id, e->verdict, e->connmark) && ok;
+                t->stats.singles++;
+            }
+            e->state = NF_DEFER_FREE;
+            t->done--;
+        }
+    }
+    t->low = id;
+
+    //Packets completed out of order
+    for (; t->done > 0 && id != t->high; id++)
+    {
+        struct nf_deferred* e = nfqueue_defer_slot(t, id);
+        if (e->state != NF_DEFER_DONE)
+            continue;
+        ok = nfqueue_vq_push(&t->vq, id, e->verdict, e->connmark) && ok;
+        t->stats.singles++;
+        e->state = NF_DEFER_FREE;
+        t->done--;
+    }
+
+    //Individual verdicts go first, so that the batch does not cover them; all leave in one datagram
+    if (batch)
+    {
+        ok = nfqueue_vq_push_batch(&t->vq, batch_max, batch_verdict) && ok;
+        t->stats.batches++;
+    }
+    ok = nfqueue_vq_flush(&t->vq) && ok;
+    return ok;
+}
+
+
+//Return milliseconds until the oldest pending packet times out (zero if it already has), -1 if none is pending
+int64_t nfqueue_defer_next_timeout(const struct nf_defer_table* t)
+{
+    ASSERT(t);
+    if (t->pending == 0)
+        return -1;
+    for (uint32_t id = t->low; id != t->high; id++)
+    {
+        const struct nf_deferred* e = nfqueue_defer_slot(t, id);
+        if (e->state == NF_DEFER_PENDING)
+        {
+            int32_t left = (int32_t)(e->deadline - nfqueue_defer_now());
+            return left > 0? left : 0;
+        }
+    }
+    return -1;
+}
+
+
+//Return number of packets held in the kernel queue by the table (pending, or completed but not sent)
+uint32_t nfqueue_defer_outstanding(const struct nf_defer_table* t)
+{
+    ASSERT(t);
+    return t->pending + t->done;
+}
+
+
+void nfqueue_defer_stats(const struct nf_defer_table* t, struct nf_defer_stats* stats)
+{
+    ASSERT(t);
+    ASSERT(stats);
+    *stats = t->stats;
+}
+
+
+#endif //NFQUEUE_MNL_DEFER_H
@@ -0,0 +1,567 @@
+/*
+ *  nfqueue-mnl-flow.h - Per-connection verdict cache
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_FLOW_H
+#define NFQUEUE_MNL_FLOW_H
+
+
+#include "nfqueue-mnl.h"
+
+
+/*
+Flow cache
+
+Applications making per-connection decisions classify the first packet(s) of a connection and give the same
+verdict and connmark to the rest. The flow cache remembers such decisions, so that later packets of the connection
+are answered without running the classifier:
+
+    int verdict;
+    int64_t connmark;
+    while (nfqueue_next(buf, packet) == IO_READY)
+    {
+        if (!nfqueue_flow_lookup(cache, packet, &verdict, &connmark))
+        {
+            verdict = classify(packet, &connmark);
+            if (decided)
+                nfqueue_flow_insert(cache, packet, verdict, connmark);
+        }
+        nfqueue_vq_push(vq, packet->packet_id, verdict, connmark);
+        nfqueue_packet_free(packet);
+    }
+    nfqueue_vq_flush(vq);
+
+Connections are identified by conntrack info, so packets without it (see NFQA_CFG_F_CONNTRACK) are never cached.
+The key is conn_id (default), or the original direction tuple if key_by_tuple option is set. Conntrack ids are
+reused after connections are destroyed, and tuples are reused when new connections reuse ports, so stale entries
+must be removed: by nfqueue_flow_remove() on conntrack destroy events, and by the TTL policy, which drops entries
+idle for longer than ttl_ms. When the table is full, the least recently used entry among a few neighbors is evicted.
+
+The table uses open addressing with linear probing, in a single array of 64-byte entries (one cache line each),
+so a lookup typically touches one cache line. Deletion shifts following entries back, so there are no tombstones.
+A flow cache is not thread-safe; with a queue group, use one cache per worker (with --queue-balance, packets of
+a connection always go to the same queue).
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_FLOW_EVICT_SCAN 8  //number of entries examined for eviction when table is full
+
+struct nf_flow_options
+{
+    uint32_t            capacity;      //maximum number of flows (rounded up so that table is at most 3/4 full)
+    uint32_t            ttl_ms;        //entries not used for that long are dropped; zero means no expiration
+    bool                key_by_tuple;  //key by orig tuple instead of conn_id
+};
+
+struct nf_flow_entry
+{
+    uint32_t            hash;          //zero for empty slots
+    uint32_t            conn_id;
+    ip_address_t        src;           //orig tuple (key_by_tuple only)
+    ip_address_t        dst;
+    uint16_t            src_port;
+    uint16_t            dst_port;
+    uint32_t            verdict;
+    uint32_t            connmark;
+    uint8_t             ip_version;
+    bool                has_connmark;
+    uint16_t            packets;       //packets counted by nfqueue_offload_packet()
+    uint32_t            last_used;     //CLOCK_MONOTONIC_COARSE in ms (wraps around)
+    uint8_t             protocol;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct nf_flow_stats
+{
+    uint64_t            hits;
+    uint64_t            misses;
+    uint64_t            inserts;
+    uint64_t            evictions;     //entries dropped because table was full
+    uint64_t            expirations;   //entries dropped because of TTL
+    uint64_t            removals;      //entries dropped by nfqueue_flow_remove()
+};
+
+struct nf_flow_cache
+{
+    struct nf_flow_entry*  table;
+    uint32_t               mask;       //table size - 1
+    uint32_t               count;
+    uint32_t               capacity;
+    uint32_t               ttl_ms;
+    bool                   key_by_tuple;
+    struct nf_flow_stats   stats;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static uint32_t nfqueue_flow_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);  //vDSO, no syscall
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+//helper
+//Return true if entry has been idle for longer than TTL
+static inline bool nfqueue_flow_expired(const struct nf_flow_cache* c, const struct nf_flow_entry* e, uint32_t now)
+{
+    return c->ttl_ms > 0 && now - e->last_used > c->ttl_ms;
+}
+
+
+//helper
+static inline uint64_t nfqueue_flow_mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+
+//helper
+//Fill key fields of e; return false if packet cannot be cached
+static bool nfqueue_flow_key(const struct nf_flow_cache* c, const struct nf_packet* packet, struct nf_flow_entry* e)
+{
+    if (!packet->has_conntrack || (packet->skipped & NF_SKIP_CONNTRACK))
+        return false;
+    memset(e, 0, sizeof(*e));
+    uint64_t h;
+    if (c->key_by_tuple)
+    {
+        const struct ip_tuple* t = &packet->orig;
+        if (t->ip_version == 0)
+            return false;
+        e->src.ip = t->src.ip;
+        e->dst.ip = t->dst.ip;
+        e->src_port = t->src_port;
+        e->dst_port = t->dst_port;
+        e->ip_version = t->ip_version;
+        e->protocol = t->protocol;
+        h = nfqueue_flow_mix(0, t->src.hi);
+        h = nfqueue_flow_mix(h, t->src.lo);
+        h = nfqueue_flow_mix(h, t->dst.hi);
+        h = nfqueue_flow_mix(h, t->dst.lo);
+        h = nfqueue_flow_mix(h, ((uint64_t)t->protocol << 40) | ((uint64_t)t->src_port << 24) | ((uint64_t)t->dst_port << 8) | t->ip_version);
+    }
+    else
+    {
+        e->conn_id = packet->conn_id;
+        h = nfqueue_flow_mix(0, packet->conn_id);
+    }
+    e->hash = (uint32_t)(h >> 32) | 0x80000000;  //never zero; top bit is above table index bits (see capacity)
+    return true;
+}
+
+
+//helper
+static inline bool nfqueue_flow_match(const struct nf_flow_cache* c, const struct nf_flow_entry* a, const struct nf_flow_entry* b)
+{
+    if (a->hash != b->hash)
+        return false;
+    if (!c->key_by_tuple)
+        return a->conn_id == b->conn_id;
+    return a->src.ip == b->src.ip && a->dst.ip == b->dst.ip && a->src_port == b->src_port &&
+           a->dst_port == b->dst_port && a->ip_version == b->ip_version && a->protocol == b->protocol;
+}
+
+
+//helper
+//Return index of the entry matching key, or of the empty slot ending its probe sequence
+static uint32_t nfqueue_flow_find(const struct nf_flow_cache* c, const struct nf_flow_entry* key)
+{
+    uint32_t i = key->hash & c->mask;
+    while (c->table[i].hash != 0 && !nfqueue_flow_match(c, &c->table[i], key))
+        i = (i + 1) & c->mask;
+    return i;
+}
+
+
+//helper
+//Delete entry at index i, moving back the following entries of the cluster that may take its place
+static void nfqueue_flow_delete(struct nf_flow_cache* c, uint32_t i)
+{
+    uint32_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & c->mask;
+        if (c->table[j].hash == 0)
+            break;
+        uint32_t home = c->table[j].hash & c->mask;
+        //Move entry j to i if its home position is not in (i, j] (cyclically)
+        if (((j - home) & c->mask) >= ((j - i) & c->mask))
+        {
+            c->table[i] = c->table[j];
+            i = j;
+        }
+    }
+    c->table[i].hash = 0;
+    c->count--;
+}
+
+
+//helper
+//Return entry for key, inserted (with key fields only) if not present; a full table makes room by eviction
+static struct nf_flow_entry* nfqueue_flow_upsert(struct nf_flow_cache* c, const struct nf_flow_entry* key, uint32_t now)
+{
+    uint32_t i = nfqueue_flow_find(c, key);
+    if (c->table[i].hash != 0)
+    {
+        c->table[i].last_used = now;
+        return &c->table[i];
+    }
+
+    if (c->count >= c->capacity)
+    {
+        //Evict the least recently used entry among those following the home position
+        uint32_t victim = key->hash & c->mask;
+        uint32_t j = victim;
+        for (int n = 0; n < NF_FLOW_EVICT_SCAN; n++, j = (j + 1) & c->mask)
+        {
+            if (c->table[j].hash == 0)
+                continue;
+            if (c->table[victim].hash == 0 || (int32_t)(c->table[j].last_used - c->table[victim].last_used) < 0)
+                victim = j;
+        }
+        while (c->table[victim].hash == 0)  //nothing nearby, which is unlikely with load factor 3/4
+            victim = (victim + 1) & c->mask;
+        bool expired = nfqueue_flow_expired(c, &c->table[victim], now);
+        nfqueue_flow_delete(c, victim);
+        if (expired)
+            c->stats.expirations++;
+        else
+            c->stats.evictions++;
+        i = nfqueue_flow_find(c, key);
+    }
+
+    struct nf_flow_entry* e = &c->table[i];
+    *e = *key;
+    e->last_used = now;
+    c->count++;
+    return e;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+void nfqueue_flow_default_options(struct nf_flow_options* opt)
+{
+    ASSERT(opt);
+    memset(opt, 0, sizeof(*opt));
+    opt->capacity = 65536;
+    opt->ttl_ms = 60000;
+    opt->key_by_tuple = false;
+}
+
+
+//Return false on failure
+//If opt is NULL, use defaults
+bool nfqueue_flow_init(struct nf_flow_cache* c, const struct nf_flow_options* opt)
+{
+    ASSERT(c);
+    struct nf_flow_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_flow_default_options(&defaults);
+        opt = &defaults;
+    }
+    ASSERT(opt->capacity > 0);
+    ASSERT(opt->capacity <= 0x60000000);  //table index stays below bit 31, used as non-zero marker of hash
+    ASSERT(opt->ttl_ms < 0x80000000);  //timestamps wrap around
+
+    memset(c, 0, sizeof(*c));
+    uint32_t size = 8;
+    while (size < opt->capacity + opt->capacity / 3)  //load factor at most 3/4
+        size <<= 1;
+    c->table = aligned_alloc(CACHELINE_SIZE, (size_t)size * sizeof(struct nf_flow_entry));
+    if (c->table == NULL)
+    {
+        LOG_SYSERR("aligned_alloc");
+        return false;
+    }
+    memset(c->table, 0, (size_t)size * sizeof(struct nf_flow_entry));
+    c->mask = size - 1;
+    c->capacity = opt->capacity;
+    c->ttl_ms = opt->ttl_ms;
+    c->key_by_tuple = opt->key_by_tuple;
+    DEBUG("Flow cache: %u flows, %u slots", c->capacity, size);
+    return true;
+}
+
+
+void nfqueue_flow_free(struct nf_flow_cache* c)
+{
+    ASSERT(c);
+    free(c->table);
+    c->table = NULL;
+    c->count = 0;
+}
+
+
+//Return true if packet's connection is in the cache (verdict and connmark are then set)
+bool nfqueue_flow_lookup(struct nf_flow_cache* c, const struct nf_packet* packet, int* verdict, int64_t* connmark)
+{
+    ASSERT(c);
+    ASSERT(c->table);
+    ASSERT(packet);
+    struct nf_flow_entry key;
+    if (!nfqueue_flow_key(c, packet, &key))
+        return false;
+
+    uint32_t i = nfqueue_flow_find(c, &key);
+    struct nf_flow_entry* e = &c->table[i];
+    if (e->hash == 0)
+    {
+        c->stats.misses++;
+        return false;
+    }
+    uint32_t now = nfqueue_flow_now();
+    if (nfqueue_flow_expired(c, e, now))
+    {
+        nfqueue_flow_delete(c, i);
+        c->stats.expirations++;
+        c->stats.misses++;
+        return false;
+    }
+    e->last_used = now;
+    *verdict = e->verdict;
+    *connmark = e->has_connmark? (int64_t)e->connmark : -1;
+    c->stats.hits++;
+    return true;
+}
+
+
+//Return false if packet cannot be cached (no conntrack info)
+//Store (or replace) the decision for packet's connection; connmark of -1 means don't set connmark
+bool nfqueue_flow_insert(struct nf_flow_cache* c, const struct nf_packet* packet, int verdict, int64_t connmark)
+{
+    ASSERT(c);
+    ASSERT(c->table);
+    ASSERT(packet);
+    struct nf_flow_entry key;
+    if (!nfqueue_flow_key(c, packet, &key))
+        return false;
+
+    struct nf_flow_entry* e = nfqueue_flow_upsert(c, &key, nfqueue_flow_now());
+    e->verdict = verdict;
+    e->connmark = connmark >= 0? (uint32_t)connmark : 0;
+    e->has_connmark = connmark >= 0;
+    c->stats.inserts++;
+    return true;
+}
+
+
+//Return true if an entry was removed
+//Remove connection, e.g. on conntrack destroy event; only the key configured for the cache is used
+bool nfqueue_flow_remove(struct nf_flow_cache* c, uint32_t conn_id, const struct ip_tuple* orig)
+{
+    ASSERT(c);
+    ASSERT(c->table);
+    struct nf_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.has_conntrack = true;
+    packet.conn_id = conn_id;
+    if (orig)
+        packet.orig = *orig;
+    struct nf_flow_entry key;
+    if (!nfqueue_flow_key(c, &packet, &key))
+        return false;
+
+    uint32_t i = nfqueue_flow_find(c, &key);
+    if (c->table[i].hash == 0)
+        return false;
+    nfqueue_flow_delete(c, i);
+    c->stats.removals++;
+    return true;
+}
+
+
+//Return number of entries removed
+//Drop expired entries; lookups skip expired entries anyway, but calling this periodically frees their slots
+uint32_t nfqueue_flow_expire(struct nf_flow_cache* c)
+{
+    ASSERT(c);
+    ASSERT(c->table);
+    if (c->ttl_ms == 0)
+        return 0;
+    uint32_t now = nfqueue_flow_now();
+    uint32_t removed = 0;
+    uint32_t i = 0;
+    while (i <= c->mask)
+    {
+        struct nf_flow_entry* e = &c->table[i];
+        if (e->hash != 0 && nfqueue_flow_expired(c, e, now))
+        {
+            nfqueue_flow_delete(c, i);  //another entry may be moved to i, so check it again
+            removed++;
+        }
+        else
+            i++;
+    }
+    c->stats.expirations += removed;
+    return removed;
+}
+
+
+//Return true if packet was answered from the cache (its verdict is then added to vq)
+//Convenience for the batch verdict path
+bool nfqueue_flow_verdict(struct nf_flow_cache* c, struct nf_verdict_queue* vq, const struct nf_packet* packet)
+{
+    int verdict;
+    int64_t connmark;
+    if (!nfqueue_flow_lookup(c, packet, &verdict, &connmark))
+        return false;
+    return nfqueue_vq_push(vq, packet->packet_id, verdict, connmark);
+}
+
+
+void nfqueue_flow_stats(const struct nf_flow_cache* c, struct nf_flow_stats* stats)
+{
+    ASSERT(c);
+    ASSERT(stats);
+    *stats = c->stats;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Flow offload
+
+
+/*
+Flow offload
+
+Most connections need to be inspected only at the beginning. The usual pattern is to queue packets only while
+connmark does not have the bypass bit set, and set it once the connection has been decided; the rest of the
+connection is then handled by the kernel alone. Ruleset template (bypass bit 0x10000000, queue 0):
+
+    iptables -t mangle -A FORWARD -m connmark ! --mark 0x10000000/0x10000000 -j NFQUEUE --queue-num 0 --queue-bypass
+
+    nft add rule inet filter forward ct mark and 0x10000000 == 0 queue num 0 bypass
+
+nfqueue_offload_packet() counts packets of every connection and returns the connmark to be sent with the
+verdict: after threshold packets have been accepted, it is the packet's connmark with the bypass bits set.
+nfqueue_offload_bypass() does the same immediately, for connections decided earlier. A few packets already queued
+when the mark is set still arrive; they carry the bypass bits and are not counted. Connections without conntrack
+info are never offloaded. Counters are kept in a flow cache (see above), with its TTL and eviction policy.
+*/
+
+struct nf_offload_options
+{
+    struct nf_flow_options   flow;       //options of the counter table
+    uint16_t                 threshold;  //number of accepted packets after which connection is offloaded
+    uint32_t                 mark;       //bypass bits set in connmark
+    uint32_t                 mask;       //bits of connmark replaced by mark (usually equal to mark)
+};
+
+struct nf_flow_offload
+{
+    struct nf_flow_cache     cache;
+    uint16_t                 threshold;
+    uint32_t                 mark;
+    uint32_t                 mask;
+    uint64_t                 offloaded;  //connections offloaded
+};
+
+
+void nfqueue_offload_default_options(struct nf_offload_options* opt)
+{
+    ASSERT(opt);
+    memset(opt, 0, sizeof(*opt));
+    nfqueue_flow_default_options(&opt->flow);
+    opt->threshold = 8;
+    opt->mark = 0x10000000;
+    opt->mask = 0x10000000;
+}
+
+
+//Return false on failure
+//If opt is NULL, use defaults
+bool nfqueue_offload_init(struct nf_flow_offload* o, const struct nf_offload_options* opt)
+{
+    ASSERT(o);
+    struct nf_offload_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_offload_default_options(&defaults);
+        opt = &defaults;
+    }
+    ASSERT(opt->threshold > 0);
+    ASSERT((opt->mark & ~opt->mask) == 0);
+    memset(o, 0, sizeof(*o));
+    o->threshold = opt->threshold;
+    o->mark = opt->mark;
+    o->mask = opt->mask;
+    return nfqueue_flow_init(&o->cache, &opt->flow);
+}
+
+
+void nfqueue_offload_free(struct nf_flow_offload* o)
+{
+    ASSERT(o);
+    nfqueue_flow_free(&o->cache);
+}
+
+
+//Return connmark for the verdict: connmark with bypass bits set, if connection is to be offloaded, otherwise
+//unchanged connmark (-1 means don't set connmark)
+//Offload connection immediately
+int64_t nfqueue_offload_bypass(struct nf_flow_offload* o, const struct nf_packet* packet, int64_t connmark)
+{
+    ASSERT(o);
+    ASSERT(packet);
+    if (!packet->has_conntrack || (packet->skipped & NF_SKIP_CONNTRACK))
+        return connmark;
+    nfqueue_flow_remove(&o->cache, packet->conn_id, &packet->orig);
+    uint32_t mark = connmark >= 0? (uint32_t)connmark : packet->conn_mark;
+    o->offloaded++;
+    DEBUG("Offloading connection %u", packet->conn_id);
+    return (mark & ~o->mask) | o->mark;
+}
+
+
+//Return connmark for the verdict, as above
+//Count packet given verdict; connection is offloaded when threshold accepted packets have been counted
+int64_t nfqueue_offload_packet(struct nf_flow_offload* o, const struct nf_packet* packet, int verdict, int64_t connmark)
+{
+    ASSERT(o);
+    ASSERT(packet);
+    if (verdict != NF_ACCEPT)
+        return connmark;
+    if ((packet->conn_mark & o->mask) == o->mark && packet->has_connmark)  //queued before the mark was set
+        return connmark;
+
+    struct nf_flow_entry key;
+    if (!nfqueue_flow_key(&o->cache, packet, &key))
+        return connmark;
+    struct nf_flow_entry* e = nfqueue_flow_upsert(&o->cache, &key, nfqueue_flow_now());
+    if (++e->packets < o->threshold)
+        return connmark;
+    return nfqueue_offload_bypass(o, packet, connmark);
+}
+
+
+#endif //NFQUEUE_MNL_FLOW_H
@@ -0,0 +1,324 @@
+/*
+ *  nfqueue-mnl-group.h - Multi-queue fanout with one worker thread per queue
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_GROUP_H
+#define NFQUEUE_MNL_GROUP_H
+
+
+//CPU affinity functions need _GNU_SOURCE; it must be defined before any system header is included
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <pthread.h>      //pthread_create, pthread_attr_setaffinity_np
+#include <sched.h>        //cpu_set_t, CPU_SET
+
+#include "nfqueue-mnl.h"
+
+
+/*
+Queue group
+
+A queue group is a range of queues, e.g. used with iptables target NFQUEUE --queue-balance 0:15 --queue-cpu-fanout.
+Every queue is served by its own worker thread, which receives packets, calls the user callback, and sends
+verdicts returned by it (all verdicts resulting from one nfqueue_receive() are sent in one syscall). Workers
+share nothing except for the callback context, thus the callback must be thread-safe with respect to it.
+With --queue-cpu-fanout, packets processed on CPU n go to queue first_queue + n, so by default worker n is pinned
+to CPU n. This can be overridden by passing a CPU number or a CPU set (e.g. all CPUs of a NUMA node) per worker.
+
+    struct nf_queue_group group[1];
+    if (!nfqueue_group_open(group, 0, 16, NULL))
+        ...
+    if (!nfqueue_group_start(group, callback, ctx))
+        ...
+    wait_for_signal();
+    nfqueue_group_stop(group);
+    nfqueue_group_close(group);
+
+Unless zero_copy option is cleared, payloads point into worker's receive buffer and are valid only during the
+callback. Callback may keep a packet by calling nfqueue_packet_detach() and then taking over the payload (setting
+packet->payload to NULL, so that the worker does not free it).
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+//Worker exits after this many consecutive nfqueue_receive() failures (e.g. socket closed)
+#define NF_GROUP_MAX_ERRORS 100
+
+//Return verdict (NF_ACCEPT, NF_DROP, ...); connmark may be set (it is -1, i.e. not set, on entry)
+//Called concurrently by all workers
+typedef int (*nf_group_callback_t)(struct nf_packet* packet, int64_t* connmark, void* ctx);
+
+struct nf_group_options
+{
+    struct nf_queue_options    queue;       //options of every queue
+    const int*                 cpus;        //CPU for every worker (-1 means no pinning); NULL means worker n on CPU n
+    const cpu_set_t*           cpusets;     //CPU set for every worker; overrides cpus if not NULL
+    bool                       zero_copy;   //see nf_buffer.zero_copy
+    uint32_t                   skip;        //see nf_buffer.skip
+    int64_t                    timeout_ms;  //how often workers check for stop request (must be > 0)
+};
+
+struct nf_group_worker
+{
+    struct nf_queue            q;
+    struct nf_queue_group*     group;
+    pthread_t                  thread;
+    bool                       started;
+    cpu_set_t                  cpuset;
+    bool                       pinned;      //false if cpuset is not used
+    uint64_t                   packets;     //packets processed (updated by the worker)
+    bool                       failed;      //true if worker exited because of persistent receive errors
+};
+
+struct nf_queue_group
+{
+    int                        first_queue;
+    int                        count;
+    struct nf_group_worker*    workers;
+    nf_group_callback_t        callback;
+    void*                      ctx;
+    bool                       zero_copy;
+    uint32_t                   skip;
+    int64_t                    timeout_ms;
+    atomic_bool                stop;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Worker
+
+
+//helper
+static void* nfqueue_group_worker(void* arg)
+{
+    struct nf_group_worker* w = arg;
+    struct nf_queue_group* g = w->group;
+
+    struct nf_buffer buf[1];
+    memset(buf, 0, sizeof(struct nf_buffer));
+    buf->zero_copy = g->zero_copy;
+    buf->skip = g->skip;
+    struct nf_verdict_queue vq[1];
+    if (!nfqueue_vq_init(vq, &w->q, 0, 0, 0))
+    {
+        w->failed = true;
+        return NULL;
+    }
+
+    DEBUG("Worker for queue %d started", w->q.queue_num);
+
+    struct nf_packet packet[1];
+    memset(packet, 0, sizeof(struct nf_packet));
+    int errors = 0;
+    while (!atomic_load_explicit(&g->stop, memory_order_relaxed))
+    {
+        int ret = nfqueue_receive(&w->q, buf, g->timeout_ms);
+        if (ret == IO_ERROR)
+        {
+            if (++errors < NF_GROUP_MAX_ERRORS)
+                continue;
+            LOG(LOG_ERR, "Worker for queue %d failed", w->q.queue_num);
+            w->failed = true;
+            break;
+        }
+        if (ret != IO_READY)
+            continue;
+        errors = 0;
+
+        while ((ret = nfqueue_next(buf, packet)) != IO_NOTREADY)
+        {
+            if (ret == IO_ERROR)
+            {
+                //nfqueue_next() stays at the failed message; skip it, later packets get their verdicts as usual
+                nfqueue_packet_free(packet);
+                buf->nlh = mnl_nlmsg_next(buf->nlh, &buf->len);
+                continue;
+            }
+            int64_t connmark = -1;
+            int verdict = g->callback(packet, &connmark, g->ctx);
+            nfqueue_vq_push(vq, packet->packet_id, verdict, connmark);
+            nfqueue_stats_latency(&w->q, packet, buf->timestamps);
+            nfqueue_packet_free(packet);
+            w->packets++;
+        }
+        nfqueue_vq_flush(vq);
+    }
+
+    DEBUG("Worker for queue %d stopped", w->q.queue_num);
+    nfqueue_vq_free(vq);
+    free(buf->data);
+    return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+void nfqueue_group_default_options(struct nf_group_options* opt)
+{
+    ASSERT(opt);
+    memset(opt, 0, sizeof(*opt));
+    nfqueue_default_options(&opt->queue);
+    opt->zero_copy = true;
+    opt->timeout_ms = 100;
+}
+
+
+//Return false on failure
+//Open count queues starting with first_queue; if opt is NULL, use defaults
+bool nfqueue_group_open(struct nf_queue_group* g, int first_queue, int count, const struct nf_group_options* opt)
+{
+    ASSERT(g);
+    ASSERT(count > 0);
+    struct nf_group_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_group_default_options(&defaults);
+        opt = &defaults;
+    }
+    ASSERT(opt->timeout_ms > 0);
+
+    memset(g, 0, sizeof(*g));
+    g->first_queue = first_queue;
+    g->count = count;
+    g->zero_copy = opt->zero_copy;
+    g->skip = opt->skip;
+    g->timeout_ms = opt->timeout_ms;
+    atomic_init(&g->stop, false);
+    g->workers = calloc(count, sizeof(struct nf_group_worker));
+    ASSERT(g->workers != NULL);
+
+    //CPUs available to the process; by default, workers are pinned only to these
+    cpu_set_t available;
+    CPU_ZERO(&available);
+    if (sched_getaffinity(0, sizeof(available), &available) < 0)
+        LOG_SYSERR("sched_getaffinity");
+
+    for (int i = 0; i < count; i++)
+    {
+        struct nf_group_worker* w = &g->workers[i];
+        w->group = g;
+        CPU_ZERO(&w->cpuset);
+        if (opt->cpusets)
+        {
+            w->cpuset = opt->cpusets[i];
+            w->pinned = true;
+        }
+        else
+        {
+            int cpu = opt->cpus? opt->cpus[i] : i;
+            if (opt->cpus == NULL && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &available)))
+            {
+                LOG(LOG_WARNING, "CPU %d not available, worker for queue %d not pinned", cpu, first_queue + i);
+                cpu = -1;
+            }
+            if (cpu >= 0)
+            {
+                CPU_SET(cpu, &w->cpuset);
+                w->pinned = true;
+            }
+        }
+
+        if (!nfqueue_open2(&w->q, first_queue + i, &opt->queue))
+        {
+            LOG(LOG_ERR, "Can't open queue %d of group", first_queue + i);
+            for (int j = 0; j < i; j++)
+                nfqueue_close(&g->workers[j].q);
+            free(g->workers);
+            g->workers = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//Request workers to stop and wait for them
+//Packets received but not yet processed stay in the kernel queue (until the queue is closed)
+void nfqueue_group_stop(struct nf_queue_group* g)
+{
+    ASSERT(g);
+    atomic_store(&g->stop, true);
+    for (int i = 0; i < g->count; i++)
+    {
+        struct nf_group_worker* w = &g->workers[i];
+        if (w->started)
+        {
+            pthread_join(w->thread, NULL);
+            w->started = false;
+        }
+    }
+}
+
+
+//Return false on failure (workers already started are stopped)
+//Start worker threads; callback is called for every packet with ctx as the last argument
+bool nfqueue_group_start(struct nf_queue_group* g, nf_group_callback_t callback, void* ctx)
+{
+    ASSERT(g);
+    ASSERT(g->workers);
+    ASSERT(callback);
+    g->callback = callback;
+    g->ctx = ctx;
+    atomic_store(&g->stop, false);
+
+    for (int i = 0; i < g->count; i++)
+    {
+        struct nf_group_worker* w = &g->workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (w->pinned)
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &w->cpuset);
+        int ret = pthread_create(&w->thread, &attr, nfqueue_group_worker, w);
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+        {
+            errno = ret;
+            LOG_SYSERR("pthread_create");
+            nfqueue_group_stop(g);
+            return false;
+        }
+        w->started = true;
+    }
+    return true;
+}
+
+
+//Workers must be stopped before the group is closed
+void nfqueue_group_close(struct nf_queue_group* g)
+{
+    ASSERT(g);
+    if (g->workers == NULL)
+        return;
+    for (int i = 0; i < g->count; i++)
+    {
+        ASSERT(!g->workers[i].started);
+        nfqueue_close(&g->workers[i].q);
+    }
+    free(g->workers);
+    g->workers = NULL;
+}
+
+
+#endif //NFQUEUE_MNL_GROUP_H
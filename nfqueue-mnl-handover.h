@@ -0,0 +1,690 @@
+/*
+ *  nfqueue-mnl-handover.h - Queue handover between processes for restarts without packet loss
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_HANDOVER_H
+#define NFQUEUE_MNL_HANDOVER_H
+
+
+#include "nfqueue-mnl.h"  //must be first, defines _GNU_SOURCE (needed by accept4 and SO_PEERCRED)
+#include "nfqueue-mnl-flow.h"
+
+#include <sys/un.h>       //sockaddr_un
+#include <poll.h>         //poll
+#include <fcntl.h>        //fcntl, O_NONBLOCK
+
+
+/*
+Queue handover
+
+A queue is bound to the netlink socket that bound it, and it is unbound by the kernel only when that socket is
+released. Restarting a daemon with nfqueue_close() and nfqueue_open() thus leaves the queue without a listener
+for a while: packets arriving meanwhile are dropped (or accepted unfiltered with NFQA_CFG_F_FAIL_OPEN or
+--queue-bypass), and packets queued but not answered by the old process are lost. Instead, the old process can
+pass its netlink sockets to the new one over a UNIX socket (SCM_RIGHTS). The queue is never unbound, packets
+waiting in the socket buffer are received by the new process, and the switch takes as long as one round trip.
+
+Old process (listens on a UNIX socket, e.g. "@nfqueue-77" in the abstract namespace, or a file path):
+
+    nfqueue_handover_listen(h, path);
+    ...when nfqueue_handover_fd(h) becomes readable:
+    int conn = nfqueue_handover_accept(h, 0);
+    ...stop receiving, answer all packets received so far (e.g. until nfqueue_defer_outstanding() is zero)
+    if (nfqueue_handover_send(conn, queues, count, flows, 1000))
+        exit_without_unbinding();  //nfqueue_close() releases only this process' reference to the socket
+    else
+        resume();  //new process failed, keep serving
+    close(conn);
+
+New process (prepares everything it needs beforehand: ruleset, classifier, flow caches):
+
+    int conn = nfqueue_handover_connect(path);
+    int count = nfqueue_handover_receive(conn, queues, max, opt, flows, 1000);
+    close(conn);
+
+nfqueue_handover_receive() adopts the sockets into nf_queue objects, which are then used as if opened by
+nfqueue_open2(), and returns their number. If opt is not NULL, the backend it selects is set up, and socket options
+and queue parameters (copy mode and range, queue_len, flags) are applied to the bound queue; otherwise the new
+process uses NF_BACKEND_RECVFROM and the kernel keeps the parameters set by the old process. If flows is not NULL,
+entries of the old process' flow caches (one per queue, NULL entries are skipped) are copied to the new ones, so
+connections decided before the restart are not classified again; both caches must use the same key_by_tuple.
+
+The old process must use NF_BACKEND_RECVFROM (a netlink ring or io_uring holds data outside of the socket buffer,
+which cannot be passed on), and stop receiving before nfqueue_handover_send() so that no packet is read by both.
+Packets received but never answered stay in the kernel queue until they are covered by a batch verdict of the new
+process, which does not know about them. Both processes must be built with the same version of this file.
+Both ends check the peer with SO_PEERCRED: connections are accepted only from, and queues are received only from,
+processes run by the same user or by root. Every message is sent and received within timeout_ms, so a peer that
+stops reading cannot block the old process; the new process should connect only when the old one is expected
+to answer, as connect() itself does not time out if the listen backlog is full.
+Only the old process decides whether the handover happened: after the acknowledgement it sends a confirmation,
+which the new process waits for without timeout before returning the queues; if it fails at any point after the
+sockets were sent, it shuts the connection down before resuming, and the new process closes the adopted queues.
+Rules should still use --queue-bypass (or the queue NFQA_CFG_F_FAIL_OPEN flag) if packets must pass when the daemon
+is not running at all; with a handover this never happens during a restart.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_HANDOVER_MAGIC       0x4E46484FU  //"NFHO"
+#define NF_HANDOVER_MAX_QUEUES  128          //kernel limit of descriptors in one message is 253 (SCM_MAX_FD)
+#define NF_HANDOVER_FLOW_CHUNK  256          //flow entries per message (16 KiB)
+
+//nf_handover_msg.type
+enum
+{
+    NF_HANDOVER_FLOWS   = 1,  //old to new: flow entries of queue index, key_by_tuple in flags
+    NF_HANDOVER_QUEUES  = 2,  //old to new: queues (socket descriptors attached), ends the handover
+    NF_HANDOVER_ACK     = 3,  //new to old: queues adopted
+    NF_HANDOVER_CONFIRM = 4,  //old to new: old process stops serving, new one may start receiving
+};
+
+struct nf_handover_msg
+{
+    uint32_t           magic;
+    uint16_t           type;      //NF_HANDOVER_*
+    uint16_t           size;      //size of one element following the header
+    uint32_t           count;     //number of elements following the header
+    uint32_t           index;     //NF_HANDOVER_FLOWS: queue index
+    uint32_t           flags;     //NF_HANDOVER_FLOWS: key_by_tuple
+};
+
+struct nf_handover_queue
+{
+    int32_t            queue_num;
+    uint32_t           reserved;
+};
+
+struct nf_handover
+{
+    int                fd;        //listening socket
+    struct sockaddr_un addr;
+    socklen_t          addr_len;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+//Return false if path is too long; a leading '@' means the abstract namespace
+static bool nfqueue_handover_addr(const char* path, struct sockaddr_un* addr, socklen_t* addr_len)
+{
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path))
+    {
+        LOG(LOG_ERR, "Invalid handover socket path %s", path);
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == '@')
+        addr->sun_path[0] = 0;
+    else
+        len++;  //include terminating null
+    *addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    return true;
+}
+
+
+//helper
+//Return 1 if ready, 0 on timeout, -1 on failure; negative timeout_ms means wait indefinitely
+static int nfqueue_handover_wait(int fd, short events, int64_t timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ret;
+    do
+        ret = poll(&pfd, 1, timeout_ms < 0? -1 : timeout_ms > 0x7FFFFFFF? 0x7FFFFFFF : (int)timeout_ms);
+    while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        LOG_SYSERR("poll");
+    return ret;
+}
+
+
+//helper
+//Return false if peer process is run by another user (except root), or on failure
+static bool nfqueue_handover_peer_ok(int conn)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+    {
+        LOG_SYSERR("getsockopt(SO_PEERCRED)");
+        return false;
+    }
+    if (cred.uid != 0 && cred.uid != geteuid())
+    {
+        LOG(LOG_ERR, "Queue handover refused with process %d of user %u", cred.pid, cred.uid);
+        return false;
+    }
+    DEBUG("Queue handover peer is process %d", cred.pid);
+    return true;
+}
+
+
+//helper
+//Return false on failure or timeout
+static bool nfqueue_handover_write(int conn, const struct nf_handover_msg* msg, const void* data, const int* fds, int nfds,
+    int64_t timeout_ms)
+{
+    struct iovec iov[2] =
+    {
+        { .iov_base = (void*)msg, .iov_len = sizeof(*msg) },
+        { .iov_base = (void*)data, .iov_len = (size_t)msg->count * msg->size },
+    };
+    union
+    {
+        char           buf[CMSG_SPACE(NF_HANDOVER_MAX_QUEUES * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh =
+    {
+        .msg_iov = iov,
+        .msg_iovlen = iov[1].iov_len > 0? 2 : 1,
+    };
+    if (nfds > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    for (;;)
+    {
+        if (sendmsg(conn, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            LOG_SYSERR("sendmsg");
+            return false;
+        }
+        if (nfqueue_handover_wait(conn, POLLOUT, timeout_ms) <= 0)
+        {
+            LOG(LOG_ERR, "Handover message not sent: peer is not reading");
+            return false;
+        }
+    }
+}
+
+
+//helper
+//Return message length, or -1 on failure or timeout
+//Header is stored in msg, elements in data, and received descriptors in fds (nfds is updated)
+static ssize_t nfqueue_handover_read(int conn, struct nf_handover_msg* msg, void* data, size_t len, int* fds, int* nfds,
+    int64_t timeout_ms)
+{
+    int max_fds = *nfds;
+    *nfds = 0;
+    if (nfqueue_handover_wait(conn, POLLIN, timeout_ms) <= 0)
+    {
+        LOG(LOG_ERR, "No handover message received");
+        return -1;
+    }
+    struct iovec iov[2] =
+    {
+        { .iov_base = msg, .iov_len = sizeof(*msg) },
+        { .iov_base = data, .iov_len = len },
+    };
+    union
+    {
+        char           buf[CMSG_SPACE(NF_HANDOVER_MAX_QUEUES * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh =
+    {
+        .msg_iov = iov,
+        .msg_iovlen = len > 0? 2 : 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t ret;
+    do
+        ret = recvmsg(conn, &mh, 0);
+    while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+    {
+        LOG_SYSERR("recvmsg");
+        return -1;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*nfds < max_fds)
+                fds[(*nfds)++] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    {
+        LOG(LOG_ERR, "Handover message truncated");
+        return -1;
+    }
+    if (ret == 0)
+        LOG(LOG_ERR, "Handover connection closed by peer");
+    return ret > 0? ret : -1;
+}
+
+
+//helper
+//Return false if message is malformed
+static bool nfqueue_handover_check(const struct nf_handover_msg* msg, ssize_t len, uint16_t size)
+{
+    if (len < (ssize_t)sizeof(*msg) || msg->magic != NF_HANDOVER_MAGIC || msg->size != size ||
+        (size_t)len != sizeof(*msg) + (size_t)msg->count * size)
+    {
+        LOG(LOG_ERR, "Invalid handover message (length=%zd, type=%u)", len, len >= (ssize_t)sizeof(*msg)? msg->type : 0);
+        return false;
+    }
+    return true;
+}
+
+
+//helper
+//Return false on failure
+//Send live entries of a flow cache
+static bool nfqueue_handover_send_flows(int conn, uint32_t index, const struct nf_flow_cache* c, struct nf_flow_entry* chunk,
+    int64_t timeout_ms)
+{
+    struct nf_handover_msg msg =
+    {
+        .magic = NF_HANDOVER_MAGIC,
+        .type = NF_HANDOVER_FLOWS,
+        .size = sizeof(struct nf_flow_entry),
+        .index = index,
+        .flags = c->key_by_tuple,
+    };
+    uint32_t now = nfqueue_flow_now();
+    for (uint32_t i = 0; i <= c->mask; i++)
+    {
+        const struct nf_flow_entry* e = &c->table[i];
+        if (e->hash == 0 || nfqueue_flow_expired(c, e, now))
+            continue;
+        chunk[msg.count++] = *e;
+        if (msg.count == NF_HANDOVER_FLOW_CHUNK)
+        {
+            if (!nfqueue_handover_write(conn, &msg, chunk, NULL, 0, timeout_ms))
+                return false;
+            msg.count = 0;
+        }
+    }
+    return msg.count == 0 || nfqueue_handover_write(conn, &msg, chunk, NULL, 0, timeout_ms);
+}
+
+
+//helper
+//Insert flow entries received from the old process, keeping their last use time
+static void nfqueue_handover_import_flows(struct nf_flow_cache* c, const struct nf_flow_entry* entries, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const struct nf_flow_entry* key = &entries[i];
+        struct nf_flow_entry* e = nfqueue_flow_upsert(c, key, key->last_used);
+        e->verdict = key->verdict;
+        e->connmark = key->connmark;
+        e->has_connmark = key->has_connmark;
+        e->packets = key->packets;
+        c->stats.inserts++;
+    }
+}
+
+
+//helper
+//Return false on failure (fd is then closed)
+//Make q use the bound netlink socket fd, as if opened by nfqueue_open2() (see note above)
+static bool nfqueue_handover_adopt(struct nf_queue* q, int fd, int queue_num, const struct nf_queue_options* opt)
+{
+    memset(q, 0, sizeof(*q));
+    q->queue_num = queue_num;
+    q->backend = NF_BACKEND_RECVFROM;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        LOG_SYSERR("fcntl");
+        close(fd);
+        return false;
+    }
+    if ((q->nl_socket = mnl_socket_fdopen(fd)) == NULL)
+    {
+        LOG_SYSERR("mnl_socket_fdopen");
+        close(fd);
+        return false;
+    }
+    nfqueue_stats_alloc(q);
+
+    if (opt != NULL)
+    {
+        if (!nfqueue_set_socket_options(q->nl_socket, opt))
+            goto error;
+        nfqueue_backend_setup(q, opt);
+        if (nfqueue_set_params(q->nl_socket, queue_num, opt->copy_mode, opt->copy_range, opt->queue_len, opt->flags) < 0)
+        {
+            LOG_SYSERR("nfqueue_set_params");
+            goto error;
+        }
+    }
+    DEBUG("nfqueue %d adopted (socket=%d, portid=%u)", queue_num, fd, mnl_socket_get_portid(q->nl_socket));
+    return true;
+
+error:
+    nfqueue_close(q);
+    return false;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure
+//Listen for a new process taking over the queues; path starting with '@' is in the abstract namespace
+//A stale socket file left at path is removed
+bool nfqueue_handover_listen(struct nf_handover* h, const char* path)
+{
+    ASSERT(h);
+    ASSERT(path);
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+    if (!nfqueue_handover_addr(path, &h->addr, &h->addr_len))
+        return false;
+    if ((h->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        LOG_SYSERR("socket");
+        return false;
+    }
+    if (h->addr.sun_path[0] != 0)
+        unlink(h->addr.sun_path);
+    if (bind(h->fd, (struct sockaddr*)&h->addr, h->addr_len) < 0 || listen(h->fd, 1) < 0)
+    {
+        LOG_SYSERR("bind/listen");
+        close(h->fd);
+        h->fd = -1;
+        return false;
+    }
+    DEBUG("Listening for queue handover on %s", path);
+    return true;
+}
+
+
+//Return listening socket descriptor, which becomes readable when a new process connects
+int nfqueue_handover_fd(const struct nf_handover* h)
+{
+    ASSERT(h);
+    return h->fd;
+}
+
+
+//Return connection descriptor, or -1 if no new process connected within timeout_ms (zero means don't wait)
+//Peers run by other users (except root) are rejected
+int nfqueue_handover_accept(struct nf_handover* h, int64_t timeout_ms)
+{
+    ASSERT(h);
+    ASSERT(h->fd >= 0);
+    if (timeout_ms != 0 && nfqueue_handover_wait(h->fd, POLLIN, timeout_ms) <= 0)
+        return -1;
+    int conn = accept4(h->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            LOG_SYSERR("accept4");
+        return -1;
+    }
+    if (!nfqueue_handover_peer_ok(conn))
+    {
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+
+//Return false if the new process did not take over the queues (the caller should then keep serving them)
+//Send flow cache entries (if flows is not NULL, one cache or NULL per queue) and queue sockets, and wait up to
+//timeout_ms for every message to be sent and for acknowledgement; on success, the caller exits without receiving
+//from queues again. On failure the connection is shut down, so the new process does not use the sockets.
+bool nfqueue_handover_send(int conn, struct nf_queue* const* queues, int count, struct nf_flow_cache* const* flows,
+    int64_t timeout_ms)
+{
+    ASSERT(queues);
+    ASSERT(count > 0 && count <= NF_HANDOVER_MAX_QUEUES);
+    for (int i = 0; i < count; i++)
+    {
+        if (queues[i]->backend != NF_BACKEND_RECVFROM)
+        {
+            LOG(LOG_ERR, "Queue %d cannot be handed over: only NF_BACKEND_RECVFROM is supported", queues[i]->queue_num);
+            return false;
+        }
+    }
+
+    if (flows != NULL)
+    {
+        struct nf_flow_entry* chunk = aligned_alloc(CACHELINE_SIZE, NF_HANDOVER_FLOW_CHUNK * sizeof(struct nf_flow_entry));
+        ASSERT(chunk != NULL);
+        bool ok = true;
+        for (int i = 0; ok && i < count; i++)
+        {
+            if (flows[i] != NULL)
+                ok = nfqueue_handover_send_flows(conn, i, flows[i], chunk, timeout_ms);
+        }
+        free(chunk);
+        if (!ok)
+            return false;
+    }
+
+    struct nf_handover_queue meta[NF_HANDOVER_MAX_QUEUES];
+    int fds[NF_HANDOVER_MAX_QUEUES];
+    memset(meta, 0, sizeof(meta));
+    for (int i = 0; i < count; i++)
+    {
+        meta[i].queue_num = queues[i]->queue_num;
+        fds[i] = mnl_socket_get_fd(queues[i]->nl_socket);
+    }
+    struct nf_handover_msg msg =
+    {
+        .magic = NF_HANDOVER_MAGIC,
+        .type = NF_HANDOVER_QUEUES,
+        .size = sizeof(struct nf_handover_queue),
+        .count = count,
+    };
+    //Once sockets are sent, only this process decides: it either confirms, or shuts the connection down, which
+    //makes the new process give up the sockets before it has received from them
+    struct nf_handover_msg ack;
+    int nfds = 0;
+    ssize_t len;
+    if (!nfqueue_handover_write(conn, &msg, meta, fds, count, timeout_ms))
+        goto fail;
+    len = nfqueue_handover_read(conn, &ack, NULL, 0, NULL, &nfds, timeout_ms);
+    if (len < 0 || !nfqueue_handover_check(&ack, len, 0) || ack.type != NF_HANDOVER_ACK || ack.count != (uint32_t)count)
+    {
+        LOG(LOG_ERR, "Queue handover not acknowledged");
+        goto fail;
+    }
+    struct nf_handover_msg confirm =
+    {
+        .magic = NF_HANDOVER_MAGIC,
+        .type = NF_HANDOVER_CONFIRM,
+        .count = count,
+    };
+    if (!nfqueue_handover_write(conn, &confirm, NULL, NULL, 0, timeout_ms))
+        goto fail;
+    LOG(LOG_INFO, "%d queue(s) handed over", count);
+    return true;
+
+fail:
+    shutdown(conn, SHUT_RDWR);
+    return false;
+}
+
+
+//Return connection descriptor, or -1 on failure
+//Connect to the process serving the queues; path as in nfqueue_handover_listen()
+//Processes run by other users (except root) are refused
+int nfqueue_handover_connect(const char* path)
+{
+    ASSERT(path);
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    if (!nfqueue_handover_addr(path, &addr, &addr_len))
+        return -1;
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0)
+    {
+        LOG_SYSERR("socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr*)&addr, addr_len) < 0)
+    {
+        LOG_SYSERR("connect");
+        close(conn);
+        return -1;
+    }
+    if (!nfqueue_handover_peer_ok(conn))
+    {
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+
+//Return number of queues taken over, or -1 on failure (the old process then keeps serving them)
+//Adopt up to max queues into queues, applying opt if not NULL, and copy flows into flows (if not NULL, one cache
+//or NULL per queue); wait up to timeout_ms for every message, except the final confirmation (see note above)
+//Sockets are taken only from processes run by the same user or by root
+int nfqueue_handover_receive(int conn, struct nf_queue* const* queues, int max, const struct nf_queue_options* opt,
+    struct nf_flow_cache* const* flows, int64_t timeout_ms)
+{
+    ASSERT(queues);
+    ASSERT(max > 0);
+    if (!nfqueue_handover_peer_ok(conn))
+        return -1;
+    size_t buf_len = NF_HANDOVER_FLOW_CHUNK * sizeof(struct nf_flow_entry);
+    void* buf = aligned_alloc(CACHELINE_SIZE, buf_len);
+    ASSERT(buf != NULL);
+    struct nf_handover_msg msg[1];
+    int fds[NF_HANDOVER_MAX_QUEUES];
+    int nfds;
+    int count = -1;
+    ssize_t len;
+
+    for (;;)
+    {
+        nfds = NF_HANDOVER_MAX_QUEUES;
+        len = nfqueue_handover_read(conn, msg, buf, buf_len, fds, &nfds, timeout_ms);
+        if (len < 0)
+            goto end;
+        if (len >= (ssize_t)sizeof(*msg) && msg->type == NF_HANDOVER_QUEUES)
+            break;
+        if (!nfqueue_handover_check(msg, len, sizeof(struct nf_flow_entry)) || msg->type != NF_HANDOVER_FLOWS)
+            goto end;
+        if (flows == NULL || msg->index >= (uint32_t)max || flows[msg->index] == NULL)
+            continue;
+        if (flows[msg->index]->key_by_tuple != (bool)msg->flags)
+        {
+            LOG(LOG_WARNING, "Flow cache of queue index %u uses a different key, entries discarded", msg->index);
+            continue;
+        }
+        nfqueue_handover_import_flows(flows[msg->index], buf, msg->count);
+    }
+
+    const struct nf_handover_queue* meta = buf;
+    if (!nfqueue_handover_check(msg, len, sizeof(struct nf_handover_queue)) ||
+        msg->count != (uint32_t)nfds || nfds > max)
+    {
+        LOG(LOG_ERR, "Handover of %u queue(s) with %d socket(s) cannot be accepted (max %d)", msg->count, nfds, max);
+        goto end;
+    }
+    int adopted = 0;
+    for (; adopted < nfds; adopted++)
+    {
+        if (!nfqueue_handover_adopt(queues[adopted], fds[adopted], meta[adopted].queue_num, opt))
+            break;
+    }
+    if (adopted < nfds)
+    {
+        for (int i = adopted + 1; i < nfds; i++)
+            close(fds[i]);
+        nfds = 0;
+        while (adopted > 0)
+            nfqueue_close(queues[--adopted]);
+        goto end;
+    }
+    nfds = 0;
+
+    struct nf_handover_msg ack =
+    {
+        .magic = NF_HANDOVER_MAGIC,
+        .type = NF_HANDOVER_ACK,
+        .count = adopted,
+    };
+    //Wait for confirmation without timeout: the old process either confirms, or closes the connection and keeps
+    //serving the queues, so they must not be received from before that is known
+    struct nf_handover_msg confirm;
+    if (!nfqueue_handover_write(conn, &ack, NULL, NULL, 0, timeout_ms) ||
+        (len = nfqueue_handover_read(conn, &confirm, NULL, 0, NULL, &nfds, -1)) < 0 ||
+        !nfqueue_handover_check(&confirm, len, 0) || confirm.type != NF_HANDOVER_CONFIRM)
+    {
+        LOG(LOG_ERR, "Queue handover not confirmed, the old process keeps serving the queues");
+        while (adopted > 0)
+            nfqueue_close(queues[--adopted]);
+        goto end;
+    }
+    count = adopted;
+    LOG(LOG_INFO, "%d queue(s) taken over", count);
+
+end:
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(buf);
+    return count;
+}
+
+
+//Stop listening; remove socket file
+void nfqueue_handover_close(struct nf_handover* h)
+{
+    ASSERT(h);
+    if (h->fd < 0)
+        return;
+    close(h->fd);
+    h->fd = -1;
+    if (h->addr.sun_path[0] != 0)
+        unlink(h->addr.sun_path);
+}
+
+
+#endif //NFQUEUE_MNL_HANDOVER_H
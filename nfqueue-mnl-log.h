@@ -0,0 +1,246 @@
+/*
+ *  nfqueue-mnl-log.h - Asynchronous log sink
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_LOG_H
+#define NFQUEUE_MNL_LOG_H
+
+
+#ifdef NFQUEUE_MNL_H
+    #error "nfqueue-mnl-log.h must be included before nfqueue-mnl.h"
+#endif
+
+//This file precedes nfqueue-mnl.h, so it has to include config.h and define _GNU_SOURCE (needed for recvmmsg)
+//before any system header, for the same reasons
+#ifdef HAVE_CONFIG_H
+    #include "config.h"  //created by configure script
+#endif
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <pthread.h>      //pthread_create, pthread_join
+#include <stdarg.h>       //va_list
+#include <stdatomic.h>    //atomic_*
+#include <stdbool.h>      //bool
+#include <stdint.h>       //uint64_t
+#include <stdio.h>        //vsnprintf, fprintf
+#include <string.h>       //strerror
+#include <syslog.h>       //syslog, LOG_*
+#include <time.h>         //nanosleep
+
+
+/*
+Asynchronous log sink
+
+This file defines LOG so that messages are formatted by the calling thread into a bounded lock-free ring, and
+written (to syslog or stderr) by a separate thread, so that packet processing threads never block on the log
+device. When the ring is full, messages are dropped and counted. Until nfqueue_log_start() is called (and after
+nfqueue_log_stop()), messages are written directly. Messages longer than NF_LOG_MSG_LEN - 1 are truncated.
+The compile-time level NFQUEUE_MNL_LOG_LEVEL (see nfqueue-mnl.h) applies as well.
+
+    #include "nfqueue-mnl-log.h"    //before nfqueue-mnl.h or any other nfqueue-mnl-*.h
+    #include "nfqueue-mnl.h"
+    ...
+    nfqueue_log_start(true);
+    ...
+    nfqueue_log_stop();
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_LOG_SLOTS     256       //must be a power of 2
+#define NF_LOG_MSG_LEN   240
+#define NF_LOG_POLL_MS   10        //how often the writer thread checks an empty ring
+
+struct nf_log_slot
+{
+    _Atomic(size_t)            seq;
+    int                        priority;
+    char                       msg[NF_LOG_MSG_LEN];
+};
+
+struct nf_log
+{
+    struct nf_log_slot         slots[NF_LOG_SLOTS];
+    _Atomic(size_t)            tail;        //next slot to be claimed by writers of messages
+    size_t                     head;        //next slot to be read by the writer thread
+    atomic_bool                active;      //messages go to the ring
+    atomic_bool                stop;        //writer thread should exit when the ring is empty
+    bool                       use_syslog;
+    bool                       started;
+    pthread_t                  thread;
+    _Atomic(uint64_t)          dropped;
+};
+
+static struct nf_log nf_log_state;
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static void nfqueue_log_output(int priority, const char* msg)
+{
+    if (nf_log_state.use_syslog)
+        syslog(priority, "%s", msg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+
+//helper
+//Return false if the ring is empty
+static bool nfqueue_log_drain_one(void)
+{
+    struct nf_log* l = &nf_log_state;
+    struct nf_log_slot* slot = &l->slots[l->head & (NF_LOG_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != l->head + 1)
+        return false;
+    nfqueue_log_output(slot->priority, slot->msg);
+    atomic_store_explicit(&slot->seq, l->head + NF_LOG_SLOTS, memory_order_release);
+    l->head++;
+    return true;
+}
+
+
+//helper
+static void* nfqueue_log_thread(void* arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        if (nfqueue_log_drain_one())
+            continue;
+        if (atomic_load_explicit(&nf_log_state.stop, memory_order_acquire))
+            break;
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = NF_LOG_POLL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+
+//helper
+__attribute__((format(printf, 2, 3)))
+static void nfqueue_log_write(int priority, const char* fmt, ...)
+{
+    struct nf_log* l = &nf_log_state;
+    va_list args;
+    va_start(args, fmt);
+    if (!atomic_load_explicit(&l->active, memory_order_acquire))
+    {
+        char msg[NF_LOG_MSG_LEN];
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        va_end(args);
+        nfqueue_log_output(priority, msg);
+        return;
+    }
+
+    //Bounded MPMC ring (D. Vyukov); every slot's seq tells which lap of the ring it is ready for
+    size_t pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+    struct nf_log_slot* slot;
+    for (;;)
+    {
+        slot = &l->slots[pos & (NF_LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&l->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)  //full
+        {
+            va_end(args);
+            atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+    }
+    slot->priority = priority;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+
+#ifdef LOG
+    #error "LOG is already defined"
+#endif
+
+#define LOG(priority, fmt, ...) \
+    do { if (LOG_ENABLED(priority)) nfqueue_log_write((priority), fmt, ##__VA_ARGS__); } while(0)
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure (messages are still written, synchronously)
+//Start the writer thread; if use_syslog is false, messages go to stderr
+//Not thread-safe with respect to nfqueue_log_stop()
+bool nfqueue_log_start(bool use_syslog)
+{
+    struct nf_log* l = &nf_log_state;
+    if (l->started)
+        return true;
+    l->use_syslog = use_syslog;
+    if (atomic_load_explicit(&l->tail, memory_order_relaxed) == 0)
+        for (size_t i = 0; i < NF_LOG_SLOTS; i++)
+            atomic_init(&l->slots[i].seq, i);
+    atomic_store(&l->stop, false);
+    int ret = pthread_create(&l->thread, NULL, nfqueue_log_thread, NULL);
+    if (ret != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return false;
+    }
+    l->started = true;
+    atomic_store_explicit(&l->active, true, memory_order_release);
+    return true;
+}
+
+
+//Write pending messages and stop the writer thread
+//Messages logged concurrently with this call may be written only after the next nfqueue_log_start()
+void nfqueue_log_stop(void)
+{
+    struct nf_log* l = &nf_log_state;
+    if (!l->started)
+        return;
+    atomic_store_explicit(&l->active, false, memory_order_release);
+    atomic_store_explicit(&l->stop, true, memory_order_release);
+    pthread_join(l->thread, NULL);
+    l->started = false;
+}
+
+
+//Return number of messages dropped because the ring was full
+uint64_t nfqueue_log_dropped(void)
+{
+    return atomic_load_explicit(&nf_log_state.dropped, memory_order_relaxed);
+}
+
+
+#endif //NFQUEUE_MNL_LOG_H
@@ -0,0 +1,229 @@
+/*
+ *  nfqueue-mnl-loop.h - epoll-based event loop for multiple queues
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_LOOP_H
+#define NFQUEUE_MNL_LOOP_H
+
+
+#include "nfqueue-mnl.h"  //must be first, defines _GNU_SOURCE
+
+#include <sys/epoll.h>    //epoll_create1, epoll_ctl, epoll_wait
+#include <unistd.h>       //close
+
+
+/*
+Event loop
+
+nf_loop waits for any number of queues (and other file descriptors) with epoll. Sockets are registered
+edge-triggered; when a queue socket becomes readable, it is drained until no more data is available, calling the
+queue callback after every nfqueue_receive(). The callback iterates the buffer with nfqueue_next() as usual.
+Every call to nfqueue_loop_run() costs one epoll_wait() plus one recvfrom() per datagram, and no select().
+
+A loop is meant to be run by a single thread; it owns the nf_buffer passed to callbacks. Several threads may serve
+the same queue, each running its own loop with the queue added with exclusive flag set (EPOLLEXCLUSIVE, kernel 4.5+),
+so that only one of them is woken up for given data.
+
+    struct nf_loop loop[1];
+    nfqueue_loop_init(loop);
+    nfqueue_loop_add(loop, queue, handle_buffer, ctx, false);
+    while (running)
+        nfqueue_loop_run(loop, TIMEOUT);
+    nfqueue_loop_free(loop);
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_LOOP_MAX_EVENTS 64
+
+//Called after data has been received from q into buf
+typedef void (*nf_loop_queue_callback_t)(struct nf_queue* q, struct nf_buffer* buf, void* ctx);
+//Called when fd is readable (level-triggered)
+typedef void (*nf_loop_fd_callback_t)(int fd, uint32_t events, void* ctx);
+
+struct nf_loop_entry
+{
+    struct nf_loop_entry*     next;
+    struct nf_queue*          q;         //NULL for other file descriptors
+    int                       fd;
+    nf_loop_queue_callback_t  queue_callback;
+    nf_loop_fd_callback_t     fd_callback;
+    void*                     ctx;
+};
+
+struct nf_loop
+{
+    int                       epoll_fd;
+    struct nf_loop_entry*     entries;
+    struct nf_buffer          buf;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure
+bool nfqueue_loop_init(struct nf_loop* loop)
+{
+    ASSERT(loop);
+    memset(loop, 0, sizeof(*loop));
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        LOG_SYSERR("epoll_create1");
+        return false;
+    }
+    return true;
+}
+
+
+//Queues and file descriptors are not closed
+void nfqueue_loop_free(struct nf_loop* loop)
+{
+    ASSERT(loop);
+    struct nf_loop_entry* e = loop->entries;
+    while (e)
+    {
+        struct nf_loop_entry* next = e->next;
+        free(e);
+        e = next;
+    }
+    loop->entries = NULL;
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+    free(loop->buf.data);
+    loop->buf.data = NULL;
+}
+
+
+//helper
+static bool nfqueue_loop_register(struct nf_loop* loop, struct nf_loop_entry* e, uint32_t events)
+{
+    struct epoll_event ev =
+    {
+        .events = events,
+        .data.ptr = e,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, e->fd, &ev) < 0)
+    {
+        LOG_SYSERR("epoll_ctl");
+        free(e);
+        return false;
+    }
+    e->next = loop->entries;
+    loop->entries = e;
+    return true;
+}
+
+
+//Return false on failure
+//If exclusive is true, other loops waiting for the same queue are not woken up together with this one
+bool nfqueue_loop_add(struct nf_loop* loop, struct nf_queue* q, nf_loop_queue_callback_t callback, void* ctx, bool exclusive)
+{
+    ASSERT(loop);
+    ASSERT(q);
+    ASSERT(callback);
+    struct nf_loop_entry* e = calloc(1, sizeof(struct nf_loop_entry));
+    ASSERT(e != NULL);
+    e->q = q;
+    e->fd = nfqueue_fd(q);
+    e->queue_callback = callback;
+    e->ctx = ctx;
+    uint32_t events = EPOLLIN | EPOLLET;
+    if (exclusive)
+    {
+#ifdef EPOLLEXCLUSIVE
+        events |= EPOLLEXCLUSIVE;
+#else
+        LOG_ONCE(LOG_WARNING, "EPOLLEXCLUSIVE not supported");
+#endif
+    }
+    return nfqueue_loop_register(loop, e, events);
+}
+
+
+//Return false on failure
+//Add other file descriptor (e.g. control socket, eventfd or signalfd) to the loop
+bool nfqueue_loop_add_fd(struct nf_loop* loop, int fd, uint32_t events, nf_loop_fd_callback_t callback, void* ctx)
+{
+    ASSERT(loop);
+    ASSERT(callback);
+    struct nf_loop_entry* e = calloc(1, sizeof(struct nf_loop_entry));
+    ASSERT(e != NULL);
+    e->fd = fd;
+    e->fd_callback = callback;
+    e->ctx = ctx;
+    return nfqueue_loop_register(loop, e, events);
+}
+
+
+//Return number of ready file descriptors, 0 on timeout, -1 on failure
+//Wait for events and handle them; if timeout_ms is zero, wait indefinitely, if negative, do not wait
+//A receive error on one queue does not stop handling of the other ready descriptors; -1 is returned afterwards
+int nfqueue_loop_run(struct nf_loop* loop, int64_t timeout_ms)
+{
+    ASSERT(loop);
+    struct epoll_event events[NF_LOOP_MAX_EVENTS];
+    int timeout = timeout_ms > 0? (int)timeout_ms : timeout_ms == 0? -1 : 0;
+    int n = epoll_wait(loop->epoll_fd, events, NF_LOOP_MAX_EVENTS, timeout);
+    if (n < 0)
+    {
+        if (errno == EINTR)  //signal
+            return 0;
+        LOG_SYSERR("epoll_wait");
+        return -1;
+    }
+
+    bool failed = false;
+    for (int i = 0; i < n; i++)
+    {
+        struct nf_loop_entry* e = events[i].data.ptr;
+        if (e->q == NULL)
+        {
+            e->fd_callback(e->fd, events[i].events, e->ctx);
+            continue;
+        }
+        //Edge-triggered: drain the socket; an overrun (IO_NOTREADY with ENOBUFS) does not mean it is empty
+        for (;;)
+        {
+            uint64_t overruns = nfqueue_overruns(e->q);
+            int ret = nfqueue_receive(e->q, &loop->buf, -1);
+            if (ret == IO_READY)
+                e->queue_callback(e->q, &loop->buf, e->ctx);
+            else if (ret == IO_NOTREADY)
+            {
+                if (nfqueue_overruns(e->q) == overruns)
+                    break;
+            }
+            else
+            {
+                LOG(LOG_ERR, "Receive from queue %d failed", e->q->queue_num);
+                failed = true;
+                break;
+            }
+        }
+    }
+    return failed? -1 : n;
+}
+
+
+#endif //NFQUEUE_MNL_LOOP_H
@@ -0,0 +1,351 @@
+/*
+ *  nfqueue-mnl-ring.h - Lock-free hand-off rings between threads
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+
+#ifndef NFQUEUE_MNL_RING_H
+#define NFQUEUE_MNL_RING_H
+
+
+#include "nfqueue-mnl.h"
+
+
+/*
+Hand-off rings
+
+Bounded lock-free rings pass packets from the thread that drains a queue socket to worker threads, and verdicts
+back, without locks or syscalls. Elements are copied into the ring (e.g. struct nf_packet, or struct
+nf_ring_verdict), so elem_size is given at init. Push and pop move up to count elements at once and return how many
+were moved: zero when the ring is full or empty, which the caller handles (drop the packet, back off, or do other
+work). Producer and consumer indices are kept on separate cache lines.
+
+nf_spsc_ring has one producer thread and one consumer thread, e.g. one ring per worker. nf_mpmc_ring may be used by
+any number of producers and consumers (e.g. a pool of workers taking packets from a shared ring, so that a slow
+packet does not hold up others); every slot has a sequence number telling which lap of the ring it is ready for.
+
+Packets are handed over by value, so a zero-copy payload or a skipped field, which point into the receive buffer,
+must be detached with nfqueue_packet_detach() first. The worker owns the payload afterwards and frees it with nfqueue_packet_free().
+Verdicts go back through a return ring per worker (nf_ring_verdict elements in nf_spsc_ring), and the receive
+thread, which owns the queue and its verdict queue, sends them in batches:
+
+    //receive thread
+    while (nfqueue_next(buf, packet) == IO_READY)
+    {
+        nfqueue_packet_detach(packet);
+        if (nfqueue_spsc_push(&work[n], packet, 1) == 0)
+            ...  //worker busy: answer here, or drop
+    }
+    for (all workers)
+        nfqueue_ring_return(&ret[n], vq);
+
+    //worker n
+    if (nfqueue_spsc_pop(&work[n], packets, 32) > 0)
+        ...  //classify, then push struct nf_ring_verdict elements to ret[n]
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object definitions
+
+
+#define NF_RING_RETURN_BATCH 64  //verdicts taken from a return ring at once
+
+//Single producer, single consumer ring
+struct nf_spsc_ring
+{
+    _Atomic(size_t)    head __attribute__((aligned(CACHELINE_SIZE)));  //next slot to be written (producer)
+    size_t             cached_tail;  //producer's copy of tail
+    _Atomic(size_t)    tail __attribute__((aligned(CACHELINE_SIZE)));  //next slot to be read (consumer)
+    size_t             cached_head;  //consumer's copy of head
+    char*              slots __attribute__((aligned(CACHELINE_SIZE)));
+    size_t             mask;         //capacity - 1
+    size_t             elem_size;
+};
+
+//Multi producer, multi consumer ring
+struct nf_mpmc_ring
+{
+    _Atomic(size_t)    head __attribute__((aligned(CACHELINE_SIZE)));  //next slot to be claimed by producers
+    _Atomic(size_t)    tail __attribute__((aligned(CACHELINE_SIZE)));  //next slot to be claimed by consumers
+    _Atomic(size_t)*   seq __attribute__((aligned(CACHELINE_SIZE)));   //per slot: position + 1 if full, position if free
+    char*              slots;
+    size_t             mask;
+    size_t             elem_size;
+};
+
+//Element of a return ring
+struct nf_ring_verdict
+{
+    uint32_t           packet_id;
+    int32_t            verdict;
+    int64_t            connmark;     //-1 means don't set
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+
+//helper
+static inline char* nfqueue_ring_slot(char* slots, size_t elem_size, size_t mask, size_t pos)
+{
+    return slots + (pos & mask) * elem_size;
+}
+
+
+//helper
+//Return capacity rounded up to a power of 2, zero if too large
+static size_t nfqueue_ring_capacity(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity && size < ((size_t)1 << (sizeof(size_t) * 8 - 2)))
+        size <<= 1;
+    return size < capacity? 0 : size;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+
+//Return false on failure
+//Capacity is rounded up to a power of 2
+bool nfqueue_spsc_init(struct nf_spsc_ring* r, size_t capacity, size_t elem_size)
+{
+    ASSERT(r);
+    ASSERT(elem_size > 0);
+    memset(r, 0, sizeof(*r));
+    size_t size = nfqueue_ring_capacity(capacity);
+    if (size == 0 || (r->slots = aligned_alloc(CACHELINE_SIZE, (size * elem_size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1))) == NULL)
+    {
+        LOG_SYSERR("aligned_alloc");
+        return false;
+    }
+    r->mask = size - 1;
+    r->elem_size = elem_size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return true;
+}
+
+
+void nfqueue_spsc_free(struct nf_spsc_ring* r)
+{
+    ASSERT(r);
+    free(r->slots);
+    r->slots = NULL;
+}
+
+
+//Return number of elements pushed (less than count if ring is full)
+//Producer thread only
+size_t nfqueue_spsc_push(struct nf_spsc_ring* r, const void* elems, size_t count)
+{
+    ASSERT(r);
+    ASSERT(r->slots);
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t free_slots = r->mask + 1 - (head - r->cached_tail);
+    if (free_slots < count)
+    {
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        free_slots = r->mask + 1 - (head - r->cached_tail);
+        if (count > free_slots)
+            count = free_slots;
+    }
+    for (size_t i = 0; i < count; i++)
+        memcpy(nfqueue_ring_slot(r->slots, r->elem_size, r->mask, head + i), (const char*)elems + i * r->elem_size, r->elem_size);
+    atomic_store_explicit(&r->head, head + count, memory_order_release);
+    return count;
+}
+
+
+//Return number of elements popped into elems (zero if ring is empty)
+//Consumer thread only
+size_t nfqueue_spsc_pop(struct nf_spsc_ring* r, void* elems, size_t max_count)
+{
+    ASSERT(r);
+    ASSERT(r->slots);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t count = r->cached_head - tail;
+    if (count < max_count)
+    {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        count = r->cached_head - tail;
+    }
+    if (count > max_count)
+        count = max_count;
+    for (size_t i = 0; i < count; i++)
+        memcpy((char*)elems + i * r->elem_size, nfqueue_ring_slot(r->slots, r->elem_size, r->mask, tail + i), r->elem_size);
+    atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+    return count;
+}
+
+
+//Return approximate number of elements in the ring
+size_t nfqueue_spsc_count(const struct nf_spsc_ring* r)
+{
+    ASSERT(r);
+    return atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+//Return false on failure
+//Capacity is rounded up to a power of 2
+bool nfqueue_mpmc_init(struct nf_mpmc_ring* r, size_t capacity, size_t elem_size)
+{
+    ASSERT(r);
+    ASSERT(elem_size > 0);
+    memset(r, 0, sizeof(*r));
+    size_t size = nfqueue_ring_capacity(capacity);
+    if (size == 0)
+    {
+        LOG(LOG_ERR, "Ring capacity too large");
+        return false;
+    }
+    r->seq = aligned_alloc(CACHELINE_SIZE, (size * sizeof(size_t) + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1));
+    r->slots = aligned_alloc(CACHELINE_SIZE, (size * elem_size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1));
+    if (r->seq == NULL || r->slots == NULL)
+    {
+        LOG_SYSERR("aligned_alloc");
+        free(r->seq);
+        free(r->slots);
+        r->seq = NULL;
+        r->slots = NULL;
+        return false;
+    }
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&r->seq[i], i);
+    r->mask = size - 1;
+    r->elem_size = elem_size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return true;
+}
+
+
+void nfqueue_mpmc_free(struct nf_mpmc_ring* r)
+{
+    ASSERT(r);
+    free(r->seq);
+    free(r->slots);
+    r->seq = NULL;
+    r->slots = NULL;
+}
+
+
+//Return number of elements pushed (less than count if ring is full)
+//Thread-safe; elements pushed by one call occupy consecutive slots
+size_t nfqueue_mpmc_push(struct nf_mpmc_ring* r, const void* elems, size_t count)
+{
+    ASSERT(r);
+    ASSERT(r->slots);
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t n;
+    for (;;)
+    {
+        //Count free slots from pos on; a slot still full from the previous lap ends the run
+        for (n = 0; n < count && n <= r->mask; n++)
+        {
+            size_t seq = atomic_load_explicit(&r->seq[(pos + n) & r->mask], memory_order_acquire);
+            if (seq != pos + n)
+                break;
+        }
+        if (n == 0)
+        {
+            size_t seq = atomic_load_explicit(&r->seq[pos & r->mask], memory_order_acquire);
+            if ((intptr_t)(seq - pos) < 0)  //full
+                return 0;
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);  //another producer got there first
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + n, memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        memcpy(nfqueue_ring_slot(r->slots, r->elem_size, r->mask, pos + i), (const char*)elems + i * r->elem_size, r->elem_size);
+        atomic_store_explicit(&r->seq[(pos + i) & r->mask], pos + i + 1, memory_order_release);
+    }
+    return n;
+}
+
+
+//Return number of elements popped into elems (zero if ring is empty)
+//Thread-safe
+size_t nfqueue_mpmc_pop(struct nf_mpmc_ring* r, void* elems, size_t max_count)
+{
+    ASSERT(r);
+    ASSERT(r->slots);
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t n;
+    for (;;)
+    {
+        for (n = 0; n < max_count && n <= r->mask; n++)
+        {
+            size_t seq = atomic_load_explicit(&r->seq[(pos + n) & r->mask], memory_order_acquire);
+            if (seq != pos + n + 1)
+                break;
+        }
+        if (n == 0)
+        {
+            size_t seq = atomic_load_explicit(&r->seq[pos & r->mask], memory_order_acquire);
+            if ((intptr_t)(seq - (pos + 1)) < 0)  //empty
+                return 0;
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + n, memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        memcpy((char*)elems + i * r->elem_size, nfqueue_ring_slot(r->slots, r->elem_size, r->mask, pos + i), r->elem_size);
+        atomic_store_explicit(&r->seq[(pos + i) & r->mask], pos + i + r->mask + 1, memory_order_release);
+    }
+    return n;
+}
+
+
+//Return approximate number of elements in the ring
+size_t nfqueue_mpmc_count(const struct nf_mpmc_ring* r)
+{
+    ASSERT(r);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    return head > tail? head - tail : 0;
+}
+
+
+//Return false on failure to send verdicts
+//Move all verdicts from return ring r (elements: struct nf_ring_verdict) to vq and flush it
+//Called by the thread that owns vq, i.e. the consumer of r
+bool nfqueue_ring_return(struct nf_spsc_ring* r, struct nf_verdict_queue* vq)
+{
+    ASSERT(r);
+    ASSERT(r->elem_size == sizeof(struct nf_ring_verdict));
+    ASSERT(vq);
+    struct nf_ring_verdict v[NF_RING_RETURN_BATCH];
+    size_t n;
+    bool ok = true;
+    while ((n = nfqueue_spsc_pop(r, v, NF_RING_RETURN_BATCH)) > 0)
+        for (size_t i = 0; i < n; i++)
+            ok = nfqueue_vq_push(vq, v[i].packet_id, v[i].verdict, v[i].connmark) && ok;
+    return nfqueue_vq_flush(vq) && ok;
+}
+
+
+#endif //NFQUEUE_MNL_RING_H
@@ -24,26 +24,53 @@
 #define NFQUEUE_MNL_H
 
 
+//config.h must precede system headers, because it defines _GNU_SOURCE (AC_USE_SYSTEM_EXTENSIONS)
+#ifdef HAVE_CONFIG_H
+    #include "config.h"  //created by configure script
+#endif
+
+//_GNU_SOURCE is needed for recvmmsg; this works only if no system header has been included before
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>        //fprintf
 #include <stdlib.h>       //malloc, free
+#include <stddef.h>       //offsetof
 #include <stdbool.h>      //bool type
 #include <sys/select.h>   //pselect
+#include <sys/socket.h>   //recvmmsg
+#include <linux/netlink.h>  //sockaddr_nl, nl_mmap_*
+#include <sys/mman.h>     //mmap
 #include <errno.h>        //errno, EINTR, ...
 #include <netinet/in.h>   //in_addr, in6_addr, ...
 #include <time.h>         //timespec, clock_gettime
 #include <string.h>       //memset, strerror
+#include <stdatomic.h>    //atomic_*
+#include <unistd.h>       //sysconf, syscall
 #include <libmnl/libmnl.h>
 
+//io_uring backend needs kernel headers 6.0+ (multishot recvmsg, provided buffer rings); no liburing is needed
+#if !defined(HAVE_CONFIG_H) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_LINUX_IO_URING_H 1
+    #endif
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+    #include <linux/io_uring.h>   //io_uring_*, IORING_*
+    #include <sys/syscall.h>      //__NR_io_uring_*
+    #include <sched.h>            //sched_yield
+    #ifdef IORING_RECV_MULTISHOT
+        #define NFQUEUE_MNL_URING 1
+    #endif
+#endif
+
 //The following includes are needed only for constants
 #include <linux/netfilter.h>                      //NF_ACCEPT and NF_DROP
 #include <linux/netfilter/nfnetlink_queue.h>      //NFQA_* and NFQNL_*
 #include <linux/netfilter/nfnetlink_conntrack.h>  //CTA_*
 #include <syslog.h>                               //LOG_*
 
-#ifdef HAVE_CONFIG_H
-    #include "config.h"  //created by configure script
-#endif
-
 
 /*
 Kernel compatibility notes
@@ -58,6 +85,8 @@ This is worked around by using our own timestamps.
 // Enums and object definitions
 
 
+#define CACHELINE_SIZE 64
+
 //ip_version
 enum
 {
@@ -105,6 +134,41 @@ struct ip_tuple
     ip_address_t  dst;
     uint16_t      src_port;
     uint16_t      dst_port;
+    uint8_t       protocol;
+};
+
+
+//Parts of packet data that nfqueue_next() may skip (nf_buffer.skip)
+//Skipped fields are zero, until loaded with nfqueue_packet_load()
+enum
+{
+    NF_SKIP_PAYLOAD    = 1 << 0,  //payload is neither copied nor referenced (payload_len and orig_len are set)
+    NF_SKIP_TIMESTAMP  = 1 << 1,  //timestamp, wall_time and mono_time (no clock_gettime calls)
+    NF_SKIP_CONNTRACK  = 1 << 2,  //NFQA_CT contents: conn_id, conn_mark, conn_status, orig, reply (has_conntrack is set); implies NF_SKIP_REPLY
+    NF_SKIP_REPLY      = 1 << 3,  //reply tuple only
+};
+
+
+//Timestamp policy (nf_buffer.timestamps): one of NF_TS_PRECISE..NF_TS_TSC, optionally with NF_TS_TRUST_KERNEL
+//See note about timestamps
+enum
+{
+    NF_TS_PRECISE       = 0,       //CLOCK_MONOTONIC_RAW and CLOCK_REALTIME read for every packet (default)
+    NF_TS_BATCH         = 1,       //clocks read once per nfqueue_receive(), shared by all packets received
+    NF_TS_COARSE        = 2,       //CLOCK_MONOTONIC_COARSE and CLOCK_REALTIME_COARSE (resolution of 1-4 ms)
+    NF_TS_TSC           = 3,       //CPU timestamp counter, calibrated against CLOCK_MONOTONIC_RAW (x86 only)
+    NF_TS_CLOCK_MASK    = 0xFF,
+    NF_TS_TRUST_KERNEL  = 1 << 8,  //take wall_time from NFQA_TIMESTAMP, if kernel passed it
+};
+
+
+//Payload allocator hooks
+//Used for payload copies instead of malloc/free; free may be called from any thread.
+struct nf_allocator
+{
+    void* (*alloc)(void* ctx, size_t size);
+    void  (*free)(void* ctx, void* ptr);
+    void*  ctx;
 };
 
 
@@ -116,8 +180,12 @@ struct nf_packet
     int               queue_num;
     uint32_t          packet_id;      // from NFQA_PACKET_HDR
     uint16_t          hw_protocol;    // from NFQA_PACKET_HDR; see https://en.wikipedia.org/wiki/EtherType
-    size_t            payload_len;    // NFQA_PAYLOAD length
+    size_t            payload_len;    // NFQA_PAYLOAD length (zero if payload is absent)
+    size_t            orig_len;       // NFQA_CAP_LEN (original packet length) if payload is truncated, otherwise payload_len
     void*             payload;        // NFQA_PAYLOAD
+    bool              payload_view;   // true if payload points into nf_buffer (zero-copy mode) and must not be freed
+    const struct nf_allocator* allocator;  // allocator of payload copy, NULL if allocated with malloc
+    uint32_t          skb_info;       // NFQA_SKB_INFO (NFQA_SKB_CSUMNOTREADY, NFQA_SKB_GSO, NFQA_SKB_CSUM_NOTVERIFIED) or zero
     bool              has_timestamp;  // true if netfilter provided a timestamp
     struct timeval    timestamp;      // NFQA_TIMESTAMP (if has_timestamp) or zero
     struct timespec   wall_time;      // clock_gettime(CLOCK_REALTIME)
@@ -130,6 +198,53 @@ struct nf_packet
     uint32_t          conn_status;    // NDQA_CT > CTA_STATUS (IPS_SEEN_REPLY/CONFIRMED/...)
     struct ip_tuple   orig;           // NFQA_CT > CTA_TUPLE_ORIG
     struct ip_tuple   reply;          // NFQA_CT > CTA_TUPLE_REPLY
+    const struct nf_buffer* buffer;   // buffer the packet was parsed from (used to check validity of payload view)
+    uint32_t          generation;     // buffer generation at the time of parsing
+    uint32_t          skipped;        // NF_SKIP_* flags of data not parsed yet (see nfqueue_packet_load())
+    const struct nlattr* raw_payload;    // NFQA_PAYLOAD in buffer (valid as long as payload view would be)
+    const struct nlattr* raw_timestamp;  // NFQA_TIMESTAMP in buffer
+    const struct nlattr* raw_ct;         // NFQA_CT in buffer
+};
+
+//Compact packet descriptor, filled by nfqueue_next_batch() for many packets at once
+//Payload is referenced by offset into the datagram (see nfqueue_desc_payload()); nfqueue_desc_packet() gives the
+//full nf_packet view.
+struct nf_packet_desc
+{
+    uint32_t          packet_id;
+    uint32_t          msg_offset;     // netlink message, from nf_desc_batch.base
+    uint32_t          payload_offset; // NFQA_PAYLOAD data, from nf_desc_batch.base (if NF_DESC_PAYLOAD)
+    uint32_t          payload_len;
+    uint32_t          orig_len;       // NFQA_CAP_LEN if payload is truncated, otherwise payload_len
+    uint32_t          conn_id;        // NFQA_CT > CTA_ID
+    uint32_t          conn_mark;      // NFQA_CT > CTA_MARK (if NF_DESC_CONNMARK)
+    uint32_t          conn_status;    // NFQA_CT > CTA_STATUS
+    uint16_t          hw_protocol;
+    uint16_t          queue_num;
+    uint8_t           conn_state;     // NFQA_CT_INFO
+    uint8_t           skb_info;       // NFQA_SKB_INFO
+    uint8_t           flags;          // NF_DESC_*
+    uint64_t          mono_ns;        // monotonic time of nfqueue_next_batch() call (see nf_buffer.timestamps), zero if skipped
+} __attribute__((aligned(CACHELINE_SIZE)));
+_Static_assert(sizeof(struct nf_packet_desc) == CACHELINE_SIZE, "nf_packet_desc must fit a cache line");
+
+//nf_packet_desc.flags
+enum
+{
+    NF_DESC_PAYLOAD    = 1 << 0,  //NFQA_PAYLOAD present
+    NF_DESC_CONNTRACK  = 1 << 1,  //NFQA_CT present (conn_* fields are zero unless parsed, see NF_SKIP_CONNTRACK)
+    NF_DESC_CONNMARK   = 1 << 2,  //CTA_MARK present
+};
+
+//Array of descriptors, with the datagram they point into
+struct nf_desc_batch
+{
+    struct nf_packet_desc*  descs;
+    uint32_t                count;       //filled by the last nfqueue_next_batch()
+    uint32_t                capacity;
+    const char*             base;        //offsets of descriptors are relative to this
+    const struct nf_buffer* buf;
+    uint32_t                generation;  //buffer generation at the time of parsing
 };
 
 /* addr_tuple fields
@@ -138,20 +253,154 @@ struct nf_packet
     ip_address_t      dst;            // CTA_TUPLE_IP > CTA_IP_V?_DST
     uint16_t          src_port;       // CTA_TUPLE_PROTO > CTA_PROTO_SRC_PORT
     uint16_t          dst_port;       // CTA_TUPLE_PROTO > CTA_PROTO_DST_PORT
+    uint8_t           protocol;       // CTA_TUPLE_PROTO > CTA_PROTO_NUM (IPPROTO_*)
 */
 
 
+//Receive backend (nf_queue_options.backend)
+enum
+{
+    NF_BACKEND_RECVFROM = 0,  //recvfrom() into nf_buffer (default)
+    NF_BACKEND_MMAP     = 1,  //experimental: memory-mapped netlink ring, if supported by kernel (see note)
+    NF_BACKEND_URING    = 2,  //io_uring with multishot recvmsg and provided buffers (kernel 6.0+, see note)
+};
+
+//Queue options
+//Use nfqueue_default_options() to initialize.
+struct nf_queue_options
+{
+    uint32_t           queue_len;   //zero means default
+    uint8_t            copy_mode;   //NFQNL_COPY_META (no payload) or NFQNL_COPY_PACKET
+    uint32_t           copy_range;  //max payload bytes passed by kernel in NFQNL_COPY_PACKET mode
+    uint32_t           flags;       //NFQA_CFG_F_* flags (see note below)
+    int                rcvbuf;      //socket receive buffer size in bytes; zero means system default
+    bool               no_enobufs;  //set NETLINK_NO_ENOBUFS: overruns are not reported to nfqueue_receive()
+    bool               ext_ack;     //set NETLINK_EXT_ACK: kernel error messages are logged (kernel 4.12+)
+    int                backend;     //NF_BACKEND_*; falls back to NF_BACKEND_RECVFROM if not supported
+    uint32_t           ring_frame_size;  //NF_BACKEND_MMAP: frame size (rounded up to page size); zero means default
+    uint32_t           ring_frames;      //NF_BACKEND_MMAP: number of frames; zero means default
+    uint32_t           uring_buffers;    //NF_BACKEND_URING: number of receive buffers (power of 2); zero means default
+    bool               uring_sqpoll;     //NF_BACKEND_URING: use kernel submission thread (IORING_SETUP_SQPOLL)
+};
+
+/*
+Note about queue flags
+NFQA_CFG_F_CONNTRACK   pass conntrack info (NFQA_CT, NFQA_CT_INFO); set by default
+NFQA_CFG_F_GSO         queue GSO/GRO packets without segmenting them first (kernel 3.10+); recommended at high
+                       packet rates, as it reduces the number of queued packets; see nf_packet.skb_info
+NFQA_CFG_F_FAIL_OPEN   accept packets when the queue is full, instead of dropping them (kernel 3.6+)
+NFQA_CFG_F_UID_GID     pass socket owner (kernel 4.0+)
+NFQA_CFG_F_SECCTX      pass security context (kernel 4.4+)
+Kernels that do not support a flag reject the config command; the error is logged by nfqueue_next().
+*/
+
 struct nf_queue
 {
     int                queue_num;
     struct mnl_socket* nl_socket;
+    _Atomic(uint64_t)  overruns;  //number of ENOBUFS errors, i.e. socket buffer overruns (packets dropped by kernel)
+    int                backend;   //NF_BACKEND_* in use
+    void*              ring;      //NF_BACKEND_MMAP: mapped ring
+    size_t             ring_frame_size;
+    size_t             ring_frames;
+    size_t             ring_pos;  //NF_BACKEND_MMAP: index of the next frame to read
+    struct nf_uring*   uring;     //NF_BACKEND_URING: ring state
+    struct nf_stats_shard* stats; //NF_STATS_SHARDS counter shards, see note about statistics
 };
 
 struct nf_buffer
 {
     void*            data;
     struct nlmsghdr* nlh;
-    int              len;   //used part of data buffer
+    int              len;         //used part of data buffer
+    bool             zero_copy;   //if true, payloads returned by nfqueue_next() point into data (set by user)
+    const struct nf_allocator* allocator;  //allocator for payload copies; NULL means malloc (set by user)
+    uint32_t         skip;        //NF_SKIP_* flags (set by user)
+    uint32_t         timestamps;  //NF_TS_* policy (set by user)
+    struct timespec  batch_mono;  //time of the last nfqueue_receive() (NF_TS_BATCH only)
+    struct timespec  batch_wall;
+    uint32_t         generation;  //incremented by every nfqueue_receive()
+    struct nl_mmap_hdr* frame;    //NF_BACKEND_MMAP: ring frame holding the data, released by the next nfqueue_receive()
+    struct nf_uring* uring;       //NF_BACKEND_URING: owner of the provided buffer holding the data
+    uint16_t         uring_bid;   //NF_BACKEND_URING: id of that buffer, returned by the next nfqueue_receive()
+    struct nf_stats_shard* stats; //counters of the receiving thread, set by nfqueue_receive()
+};
+
+//Ring of receive buffers
+//Filled by nfqueue_receive_ring() with many datagrams in one syscall; iterated with nfqueue_ring_next().
+struct nf_buffer_ring
+{
+    struct nf_buffer*  slots;
+    int                depth;      //number of slots
+    size_t             slot_size;  //size of data buffer of every slot
+    int                count;      //number of slots filled by the last receive
+    int                current;    //slot being iterated
+    bool               zero_copy;  //applied to all slots, see nf_buffer.zero_copy (set by user)
+    const struct nf_allocator* allocator;  //applied to all slots, see nf_buffer.allocator (set by user)
+    uint32_t           skip;       //applied to all slots, see nf_buffer.skip (set by user)
+    uint32_t           timestamps; //applied to all slots, see nf_buffer.timestamps (set by user)
+    struct mmsghdr*    msgs;
+    struct iovec*      iov;
+    struct sockaddr_nl* addr;
+};
+
+//Verdict accumulator
+//Collects a run of ACCEPT verdicts and sends them as one NFQNL_MSG_VERDICT_BATCH message.
+//Not thread-safe; use one accumulator per thread.
+struct nf_verdict_batch
+{
+    struct nf_queue* q;
+    uint32_t         max_id;  //highest packet id in the pending run
+    uint32_t         count;   //number of pending packets
+    uint32_t         limit;   //flush when count reaches limit; zero means flush only explicitly
+};
+
+//Verdict queue
+//Packs many verdict messages into one buffer, sent with a single syscall.
+//Not thread-safe; use one verdict queue per thread.
+struct nf_verdict_queue
+{
+    struct nf_queue* q;
+    void*            data;       //allocated once by nfqueue_vq_init()
+    size_t           size;       //allocated size of data, also the flush threshold in bytes
+    size_t           len;        //used part of data buffer
+    uint32_t         count;      //number of pending messages
+    uint32_t         max_count;  //flush when count reaches max_count; zero means no limit
+    int64_t          max_delay;  //flush when the oldest pending message is older (in us); zero means no limit
+    struct timespec  first;      //time of the oldest pending message (only if max_delay > 0)
+};
+
+//Latency histogram: log-linear buckets of nanoseconds, NF_HIST_SUB sub-buckets per power of 2 (HDR-style)
+//Bucket i counts values in [nfqueue_stats_bucket_min(i), nfqueue_stats_bucket_min(i + 1))
+#define NF_HIST_SUB_BITS  3
+#define NF_HIST_SUB       (1 << NF_HIST_SUB_BITS)
+#define NF_HIST_MAX_BITS  40  //values of 2^40 ns (about 18 minutes) or more go to the last bucket
+#define NF_HIST_BUCKETS   ((NF_HIST_MAX_BITS - NF_HIST_SUB_BITS + 1) * NF_HIST_SUB)
+
+//Queue statistics snapshot, see nfqueue_stats()
+struct nf_queue_stats
+{
+    uint64_t         packets;         //packets returned by nfqueue_next()
+    uint64_t         bytes;           //sum of their orig_len
+    uint64_t         batches;         //successful nfqueue_receive() calls, i.e. datagrams; packets / batches is batch size
+    uint64_t         parse_errors;    //messages nfqueue_next() failed to parse
+    uint64_t         enobufs;         //socket buffer overruns, see nfqueue_overruns()
+    uint64_t         verdict_errors;  //verdict messages (or batches of them) that could not be sent
+    uint64_t         latency_count;   //values recorded by nfqueue_stats_latency()
+    uint64_t         latency_sum;     //their sum in ns
+    uint64_t         latency[NF_HIST_BUCKETS];
+};
+
+//Kernel statistics of a queue, from /proc/net/netfilter/nfnetlink_queue
+struct nf_kernel_stats
+{
+    uint32_t         portid;          //netlink port id of the bound socket
+    uint32_t         queue_total;     //packets currently waiting for verdict
+    uint32_t         copy_mode;
+    uint32_t         copy_range;
+    uint32_t         queue_dropped;   //packets dropped because the queue was full
+    uint32_t         user_dropped;    //packets dropped because netlink socket buffer was full
+    uint32_t         id_sequence;     //id of the last packet queued
 };
 
 
@@ -159,8 +408,31 @@ struct nf_buffer
 // Error handling and logging
 
 
+/*
+Note about logging
+
+Messages of priority higher (numerically) than NFQUEUE_MNL_LOG_LEVEL are compiled out, including their arguments.
+The default level is LOG_INFO, or LOG_DEBUG if NFQUEUE_MNL_DEBUG is defined, so that per-packet DEBUG() messages
+cost nothing in release builds; define NFQUEUE_MNL_LOG_LEVEL before including this file to override it.
+The level applies to DEBUG() with any LOG definition, and to all messages with the default LOG.
+Messages that may repeat on the hot path (e.g. socket overruns) use LOG_RATELIMIT(), which is lock-free and logs
+at most once per interval, with the number of messages suppressed in between. To move writing the messages (e.g.
+syslog calls) off packet processing threads, see nfqueue-mnl-log.h.
+*/
+
+#ifndef NFQUEUE_MNL_LOG_LEVEL
+    #ifdef NFQUEUE_MNL_DEBUG
+        #define NFQUEUE_MNL_LOG_LEVEL LOG_DEBUG
+    #else
+        #define NFQUEUE_MNL_LOG_LEVEL LOG_INFO
+    #endif
+#endif
+
+#define LOG_ENABLED(priority)  ((priority) <= NFQUEUE_MNL_LOG_LEVEL)
+
 #ifndef LOG
-    #define LOG(priority, fmt, ...)  fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+    #define LOG(priority, fmt, ...) \
+        do { if (LOG_ENABLED(priority)) fprintf(stderr, fmt "\n", ##__VA_ARGS__); } while(0)
 #endif
 
 #ifndef DIE
@@ -169,17 +441,54 @@ struct nf_buffer
 
 
 #define LOG_ONCE(priority, fmt, ...) \
-    do { static bool done = false; if (!done) { LOG((priority), fmt, ##__VA_ARGS__); done = true; } } while(0)
+    do { static atomic_bool done; if (!atomic_exchange_explicit(&done, true, memory_order_relaxed)) LOG((priority), fmt, ##__VA_ARGS__); } while(0)
+
+//helper
+static inline int64_t log_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//Log at most once per interval_ms (per call site, across all threads)
+#define LOG_RATELIMIT(priority, interval_ms, fmt, ...) \
+    do { \
+        if (LOG_ENABLED(priority)) \
+        { \
+            static _Atomic(int64_t) next_ms; \
+            static _Atomic(uint32_t) suppressed; \
+            int64_t now_ms = log_time_ms(); \
+            int64_t prev_ms = atomic_load_explicit(&next_ms, memory_order_relaxed); \
+            if (now_ms >= prev_ms && atomic_compare_exchange_strong(&next_ms, &prev_ms, now_ms + (interval_ms))) \
+            { \
+                uint32_t n = atomic_exchange_explicit(&suppressed, 0, memory_order_relaxed); \
+                if (n > 0) \
+                    LOG((priority), fmt " (%u similar messages suppressed)", ##__VA_ARGS__, n); \
+                else \
+                    LOG((priority), fmt, ##__VA_ARGS__); \
+            } \
+            else \
+                atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed); \
+        } \
+    } while(0)
 
 #define LOG_SYSERR(fmt, ...) \
     LOG(LOG_ERR, fmt ": %s", ##__VA_ARGS__, strerror(errno))
 
 #define DEBUG(fmt, ...) \
-    LOG(LOG_DEBUG, fmt, ##__VA_ARGS__)
+    do { if (LOG_ENABLED(LOG_DEBUG)) LOG(LOG_DEBUG, fmt, ##__VA_ARGS__); } while(0)
 
 #define ASSERT(condition) \
     do { if (!(condition)) { LOG(LOG_CRIT, "Assert failed: %s [%s:%s:%d]", #condition, __func__, __FILE__, __LINE__); DIE(); } } while(0)
 
+//Checks that are too expensive for release builds; enabled by defining NFQUEUE_MNL_DEBUG
+#ifdef NFQUEUE_MNL_DEBUG
+    #define DEBUG_ASSERT(condition)  ASSERT(condition)
+#else
+    #define DEBUG_ASSERT(condition)  do { } while(0)
+#endif
+
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // MNL integer attr functions redefinitions
@@ -216,30 +525,38 @@ static uint32_t fixed_attr_get_u32(const struct nlattr* attr)
 
 #define SEND_BUF_LEN  MNL_SOCKET_BUFFER_SIZE
 #define RECV_BUF_LEN (MNL_SOCKET_BUFFER_SIZE + 0xFFFF)
+#define CMD_BUF_LEN   256  //single config command or verdict message
 #define BUF_TOO_SHORT -42
+#define NF_PAYLOAD_IOV_MAX 16  //iovecs of a verdict with payload, including the header and padding
+
+/*
+Note about send buffers
+Commands and verdicts are built in a caller-provided buffer. Functions sending a single message use a small
+cache-aligned buffer on the stack (CMD_BUF_LEN bytes, enough for header, verdict header and the CT nest), so
+the verdict path does not touch the heap. Being local to the calling thread, such buffer keeps nfqueue_verdict()
+thread-safe with respect to nf_queue.
+*/
+
+#define CMD_BUF(name) \
+    char name[CMD_BUF_LEN] __attribute__((aligned(CACHELINE_SIZE)))
 
 //helper
 //Return NULL on failure
-static struct nlmsghdr* nfqueue_put_header(int queue_num, int msg_type)
+static struct nlmsghdr* nfqueue_put_header(void* buf, size_t buf_len, int queue_num, int msg_type)
 {
-    if (MNL_ALIGN(sizeof(struct nlmsghdr)) > SEND_BUF_LEN)  //check buffer size
+    if (MNL_ALIGN(sizeof(struct nlmsghdr)) > buf_len)  //check buffer size
         return NULL;
-    void* buf = malloc(SEND_BUF_LEN);
-    ASSERT(buf != NULL);
-	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
     ASSERT(nlh == buf);
-	nlh->nlmsg_type	= (NFNL_SUBSYS_QUEUE << 8) | msg_type;
-	nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | msg_type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
 
-    if (nlh->nlmsg_len + MNL_ALIGN(sizeof(struct nfgenmsg)) > SEND_BUF_LEN)  //check buffer size
-    {
-        free(buf);
+    if (nlh->nlmsg_len + MNL_ALIGN(sizeof(struct nfgenmsg)) > buf_len)  //check buffer size
         return NULL;
-    }
-	struct nfgenmsg *nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
-	nfg->nfgen_family = AF_UNSPEC;
-	nfg->version = NFNETLINK_V0;
-	nfg->res_id = htons(queue_num);
+    struct nfgenmsg *nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(queue_num);
 
     return nlh;
 }
@@ -248,22 +565,112 @@ static struct nlmsghdr* nfqueue_put_header(int queue_num, int msg_type)
 //Return <0 on failure
 static int nfqueue_send_command(struct mnl_socket* nl, int queue_num, int msg_type, int attr_type, void* data, size_t data_size)
 {
+    CMD_BUF(buf);
     int ret = BUF_TOO_SHORT;
     struct nlmsghdr* nlh;
-    if ((nlh = nfqueue_put_header(queue_num, msg_type)) == NULL)
-        return ret;
-    if (!mnl_attr_put_check(nlh, SEND_BUF_LEN, attr_type, data_size, data))
+    if ((nlh = nfqueue_put_header(buf, sizeof(buf), queue_num, msg_type)) == NULL)
+        goto end;
+    if (!mnl_attr_put_check(nlh, sizeof(buf), attr_type, data_size, data))
         goto end;
     ret = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
 
 end:
-    free(nlh);
     if (ret == BUF_TOO_SHORT)
         errno = ENOBUFS;
     return ret;
 }
 
 
+//Helper
+//Return extended ACK message from NLMSG_ERROR, or NULL if not present
+static const char* nlmsg_ext_ack_msg(const struct nlmsghdr* nlh)
+{
+    if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+        return NULL;
+    const struct nlmsgerr* err = mnl_nlmsg_get_payload(nlh);
+    size_t offset = sizeof(struct nlmsgerr);
+    if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+        offset += err->msg.nlmsg_len - sizeof(struct nlmsghdr);
+    if (MNL_NLMSG_HDRLEN + offset >= nlh->nlmsg_len)
+        return NULL;
+    const struct nlattr* attr;
+    mnl_attr_for_each(attr, nlh, offset)
+    {
+        if (mnl_attr_get_type(attr) == NLMSGERR_ATTR_MSG && mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) >= 0)
+            return mnl_attr_get_str(attr);
+    }
+    return NULL;
+}
+
+
+//Helper
+//Return <0 on failure, with errno set to the error returned by kernel
+//Send config command and wait for its ACK. Packets queued meanwhile (e.g. after bind) are read before the ACK, and
+//are given NF_REPEAT verdict, so that the kernel queues them again instead of leaving them unanswered.
+static int nfqueue_send_config(struct mnl_socket* nl, int queue_num, struct nlmsghdr* nlh)
+{
+    uint32_t seq = (uint32_t)time(NULL);
+    nlh->nlmsg_flags |= NLM_F_ACK;
+    nlh->nlmsg_seq = seq;
+    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+        return -1;
+
+    //ACK is queued to the socket before sendto() returns, so there is no need to wait for it
+    char buf[CMD_BUF_LEN * 4] __attribute__((aligned(CACHELINE_SIZE)));
+    int fd = mnl_socket_get_fd(nl);
+    for (;;)
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+        if (len < 0)
+        {
+            if (errno == EINTR || errno == ENOBUFS)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                LOG(LOG_WARNING, "No ACK received for config command on queue %d", queue_num);
+                return 0;  //lost in a socket buffer overrun
+            }
+            return -1;
+        }
+        const struct nlmsghdr* reply = (const struct nlmsghdr*)buf;
+        if ((size_t)len > sizeof(buf))
+            len = sizeof(buf);  //truncated message, only its beginning is needed
+        if (len < (ssize_t)sizeof(struct nlmsghdr) || reply->nlmsg_len < sizeof(struct nlmsghdr))
+            continue;
+
+        if (reply->nlmsg_type == NLMSG_ERROR && reply->nlmsg_seq == seq)
+        {
+            const struct nlmsgerr* err = mnl_nlmsg_get_payload(reply);
+            if (len < (ssize_t)(MNL_NLMSG_HDRLEN + sizeof(struct nlmsgerr)) || err->error == 0)
+                return 0;
+            const char* msg = reply->nlmsg_len <= (size_t)len? nlmsg_ext_ack_msg(reply) : NULL;
+            if (msg)
+                LOG(LOG_ERR, "Config command on queue %d rejected: %s", queue_num, msg);
+            errno = -err->error;
+            return -1;
+        }
+
+        if (reply->nlmsg_type == ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET))
+        {
+            //NFQA_PACKET_HDR is the first attribute
+            size_t offset = MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg));
+            const struct nlattr* attr = (const struct nlattr*)(buf + offset);
+            if ((size_t)len >= offset + MNL_ATTR_HDRLEN + sizeof(struct nfqnl_msg_packet_hdr) &&
+                mnl_attr_get_type(attr) == NFQA_PACKET_HDR)
+            {
+                const struct nfqnl_msg_packet_hdr* ph = mnl_attr_get_payload(attr);
+                struct nfqnl_msg_verdict_hdr vh =
+                {
+                    .verdict = htonl(NF_REPEAT),
+                    .id = ph->packet_id,
+                };
+                nfqueue_send_command(nl, queue_num, NFQNL_MSG_VERDICT, NFQA_VERDICT_HDR, &vh, sizeof(vh));
+            }
+        }
+    }
+}
+
+
 /*
 Note about pf parameter of NFQNL_CFG_CMD_BIND command
 This command can be executed only once, so we cannot call it twice with AF_INET and then AF_INET6.
@@ -278,7 +685,16 @@ static int nfqueue_bind(struct mnl_socket* nl, int queue_num)
 		.command = NFQNL_CFG_CMD_BIND,
 		.pf = 0,  //this parameter is ignored
 	};
-    return nfqueue_send_command(nl, queue_num, NFQNL_MSG_CONFIG, NFQA_CFG_CMD, &cmd, sizeof(cmd));
+
+    CMD_BUF(buf);
+    struct nlmsghdr* nlh;
+    if ((nlh = nfqueue_put_header(buf, sizeof(buf), queue_num, NFQNL_MSG_CONFIG)) == NULL ||
+        !mnl_attr_put_check(nlh, sizeof(buf), NFQA_CFG_CMD, sizeof(cmd), &cmd))
+    {
+        errno = ENOBUFS;
+        return BUF_TOO_SHORT;
+    }
+    return nfqueue_send_config(nl, queue_num, nlh);
 }
 
 
@@ -292,31 +708,31 @@ static int nfqueue_set_params(struct mnl_socket* nl, int queue_num, uint8_t mode
 		.copy_mode = mode,
 	};
 
+    CMD_BUF(buf);
     int ret = BUF_TOO_SHORT;
     struct nlmsghdr* nlh;
-    if ((nlh = nfqueue_put_header(queue_num, NFQNL_MSG_CONFIG)) == NULL)
-        return ret;
-    if (!mnl_attr_put_check(nlh, SEND_BUF_LEN, NFQA_CFG_PARAMS, sizeof(params), &params))
+    if ((nlh = nfqueue_put_header(buf, sizeof(buf), queue_num, NFQNL_MSG_CONFIG)) == NULL)
+        goto end;
+    if (!mnl_attr_put_check(nlh, sizeof(buf), NFQA_CFG_PARAMS, sizeof(params), &params))
         goto end;
 
     if (maxlen > 0)
     {
-        if (!mnl_attr_put_u32_check(nlh, SEND_BUF_LEN, NFQA_CFG_QUEUE_MAXLEN, htonl(maxlen)))
+        if (!mnl_attr_put_u32_check(nlh, sizeof(buf), NFQA_CFG_QUEUE_MAXLEN, htonl(maxlen)))
             goto end;
     }
 
     if (flags)
     {
-        if (!mnl_attr_put_u32_check(nlh, SEND_BUF_LEN, NFQA_CFG_FLAGS, htonl(flags)))
+        if (!mnl_attr_put_u32_check(nlh, sizeof(buf), NFQA_CFG_FLAGS, htonl(flags)))
             goto end;
-        if (!mnl_attr_put_u32_check(nlh, SEND_BUF_LEN, NFQA_CFG_MASK,  htonl(flags)))
+        if (!mnl_attr_put_u32_check(nlh, sizeof(buf), NFQA_CFG_MASK,  htonl(flags)))
             goto end;
     }
 
-	ret = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+	ret = nfqueue_send_config(nl, queue_num, nlh);
 
 end:
-    free(nlh);
     if (ret == BUF_TOO_SHORT)
         errno = ENOBUFS;
     return ret;
@@ -336,9 +752,22 @@ static int nfqueue_send_verdict(struct mnl_socket* nl, int queue_num, uint32_t p
 
 
 //Return <0 on failure
+//Verdict applies to all queued packets with id <= max_packet_id
+static int nfqueue_send_verdict_batch(struct mnl_socket* nl, int queue_num, uint32_t max_packet_id, int verdict)
+{
+    struct nfqnl_msg_verdict_hdr vh =
+    {
+        .verdict = htonl(verdict),
+        .id = htonl(max_packet_id),
+    };
+    return nfqueue_send_command(nl, queue_num, NFQNL_MSG_VERDICT_BATCH, NFQA_VERDICT_HDR, &vh, sizeof(vh));
+}
+
+
+//helper
+//Build a verdict message of given type (NFQNL_MSG_VERDICT or NFQNL_MSG_VERDICT_BATCH) in buf; return NULL on failure
 //Connmark is set if it is >= 0
-//connmark is uint64_t to allow full 32-bit unsigned integer and also -1
-static int nfqueue_send_verdict_connmark(struct mnl_socket* nl, int queue_num, uint32_t packet_id, int verdict, int64_t connmark)
+static struct nlmsghdr* nfqueue_put_verdict_type(void* buf, size_t buf_len, int queue_num, int type, uint32_t packet_id, int verdict, int64_t connmark)
 {
 	struct nfqnl_msg_verdict_hdr vh =
 	{
@@ -346,36 +775,253 @@ static int nfqueue_send_verdict_connmark(struct mnl_socket* nl, int queue_num, u
 		.id = htonl(packet_id),
 	};
 
-    int ret = BUF_TOO_SHORT;
     struct nlmsghdr* nlh;
-    if ((nlh = nfqueue_put_header(queue_num, NFQNL_MSG_VERDICT)) == NULL)
-        return ret;
-    if (!mnl_attr_put_check(nlh, SEND_BUF_LEN, NFQA_VERDICT_HDR, sizeof(vh), &vh))
-        goto end;
+    if ((nlh = nfqueue_put_header(buf, buf_len, queue_num, type)) == NULL)
+        return NULL;
+    if (!mnl_attr_put_check(nlh, buf_len, NFQA_VERDICT_HDR, sizeof(vh), &vh))
+        return NULL;
 
     //Connmark
     if (connmark >= 0)
     {
         struct nlattr* nest;
-        if ((nest = mnl_attr_nest_start_check(nlh, SEND_BUF_LEN, NFQA_CT)) == NULL)
-            goto end;
-        if (!mnl_attr_put_u32_check(nlh, SEND_BUF_LEN, CTA_MARK, htonl((uint32_t)connmark)))
-            goto end;
+        if ((nest = mnl_attr_nest_start_check(nlh, buf_len, NFQA_CT)) == NULL)
+            return NULL;
+        if (!mnl_attr_put_u32_check(nlh, buf_len, CTA_MARK, htonl((uint32_t)connmark)))
+            return NULL;
         mnl_attr_nest_end(nlh, nest);
     }
 
-	ret = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+    return nlh;
+}
+
 
-end:
-    free(nlh);
-    if (ret == BUF_TOO_SHORT)
+//helper
+//Build a verdict message in buf; return NULL on failure
+//Connmark is set if it is >= 0
+static struct nlmsghdr* nfqueue_put_verdict(void* buf, size_t buf_len, int queue_num, uint32_t packet_id, int verdict, int64_t connmark)
+{
+    return nfqueue_put_verdict_type(buf, buf_len, queue_num, NFQNL_MSG_VERDICT, packet_id, verdict, connmark);
+}
+
+
+//Return <0 on failure
+//Connmark is set if it is >= 0
+//connmark is uint64_t to allow full 32-bit unsigned integer and also -1
+static int nfqueue_send_verdict_connmark(struct mnl_socket* nl, int queue_num, uint32_t packet_id, int verdict, int64_t connmark)
+{
+    CMD_BUF(buf);
+    struct nlmsghdr* nlh = nfqueue_put_verdict(buf, sizeof(buf), queue_num, packet_id, verdict, connmark);
+    if (nlh == NULL)
+    {
         errno = ENOBUFS;
-    return ret;
+        return BUF_TOO_SHORT;
+    }
+	return mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+}
+
+
+//Return <0 on failure
+//Verdict with modified packet (NFQA_PAYLOAD), gathered from iovcnt buffers; connmark is set if it is >= 0
+//Payload is not copied, so an in-place modified payload view can be sent directly
+static int nfqueue_send_verdict_payload(struct mnl_socket* nl, int queue_num, uint32_t packet_id, int verdict, int64_t connmark,
+                                        const struct iovec* iov, int iovcnt)
+{
+    CMD_BUF(buf);
+    struct nlmsghdr* nlh = nfqueue_put_verdict(buf, sizeof(buf), queue_num, packet_id, verdict, connmark);
+    size_t payload_len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        payload_len += iov[i].iov_len;
+    if (nlh == NULL || nlh->nlmsg_len + MNL_ATTR_HDRLEN > sizeof(buf) || MNL_ATTR_HDRLEN + payload_len > 0xFFFF)
+    {
+        errno = nlh == NULL? ENOBUFS : EMSGSIZE;
+        return BUF_TOO_SHORT;
+    }
+
+    //Attribute header goes after the verdict; payload follows in separate iovecs, and then the padding
+    struct nlattr* attr = (struct nlattr*)((char*)nlh + nlh->nlmsg_len);
+    attr->nla_type = NFQA_PAYLOAD;
+    attr->nla_len = MNL_ATTR_HDRLEN + payload_len;
+    size_t header_len = nlh->nlmsg_len + MNL_ATTR_HDRLEN;
+    nlh->nlmsg_len += MNL_ALIGN(attr->nla_len);
+
+    if (iovcnt > NF_PAYLOAD_IOV_MAX - 2)
+    {
+        errno = EINVAL;
+        return BUF_TOO_SHORT;
+    }
+    static const char padding[MNL_ALIGNTO] = {0};
+    struct iovec msg_iov[NF_PAYLOAD_IOV_MAX];
+    msg_iov[0].iov_base = buf;
+    msg_iov[0].iov_len = header_len;
+    memcpy(&msg_iov[1], iov, iovcnt * sizeof(struct iovec));
+    msg_iov[iovcnt + 1].iov_base = (void*)padding;
+    msg_iov[iovcnt + 1].iov_len = MNL_ALIGN(payload_len) - payload_len;
+
+    struct sockaddr_nl addr =
+    {
+        .nl_family = AF_NETLINK,
+    };
+    struct msghdr msg =
+    {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = msg_iov,
+        .msg_iovlen = iovcnt + 2,
+    };
+    return sendmsg(mnl_socket_get_fd(nl), &msg, 0);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// NFQA and CTA attribute callbacks
+// Checksums
+
+
+/*
+Note about checksums
+
+Kernel does not fix checksums of packets modified in user space, so a packet rewritten by the application must
+carry correct IPv4 header and TCP/UDP checksums. When a few fields are changed (e.g. an address or a port in
+NAT-like rewriting), it is cheapest to update the checksums incrementally (RFC 1624, eqn. 3):
+HC' = ~(~HC + ~m + m'). The helpers below take values as stored in the packet (network byte order) and return
+the new checksum, also in network byte order; note that TCP and UDP checksums cover the pseudo-header, so they
+must be updated after an address change too. A UDP checksum of zero means that no checksum is used (IPv4);
+it must be left alone. nfqueue_csum_partial() computes the one's complement sum of a whole buffer with
+a 64-bit accumulator over 32-bit words, which compilers vectorize well; nfqueue_csum_ipv4() and
+nfqueue_csum_l4() use it to recompute checksums of a packet from scratch.
+*/
+
+//Return one's complement sum of data (not complemented, not folded), added to sum
+static inline uint64_t nfqueue_csum_partial(const void* data, size_t len, uint64_t sum)
+{
+    const uint8_t* p = data;
+    while (len >= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        sum += v;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        sum += v;
+        p += 2;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        uint16_t v = 0;
+        memcpy(&v, p, 1);  //odd byte is padded with zero
+        sum += v;
+    }
+    return sum;
+}
+
+
+//Return checksum (complemented and folded sum)
+static inline uint16_t nfqueue_csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+
+//Return checksum updated for 16-bit field changed from old_value to new_value
+static inline uint16_t nfqueue_csum_replace16(uint16_t csum, uint16_t old_value, uint16_t new_value)
+{
+    uint64_t sum = (uint16_t)~csum + (uint16_t)~old_value + (uint64_t)new_value;
+    return nfqueue_csum_fold(sum);
+}
+
+
+//Return checksum updated for 32-bit field (e.g. IPv4 address) changed from old_value to new_value
+static inline uint16_t nfqueue_csum_replace32(uint16_t csum, uint32_t old_value, uint32_t new_value)
+{
+    uint64_t sum = (uint16_t)~csum + (uint64_t)(uint32_t)~old_value + new_value;
+    return nfqueue_csum_fold(sum);
+}
+
+
+//Return checksum updated for IPv6 address changed from old_value to new_value
+static inline uint16_t nfqueue_csum_replace128(uint16_t csum, const ip_address_t* old_value, const ip_address_t* new_value)
+{
+    uint64_t sum = (uint16_t)~csum;
+    sum += (uint32_t)~(uint32_t)old_value->hi + (uint64_t)(uint32_t)~(uint32_t)(old_value->hi >> 32);
+    sum += (uint32_t)~(uint32_t)old_value->lo + (uint64_t)(uint32_t)~(uint32_t)(old_value->lo >> 32);
+    sum += (uint32_t)new_value->hi + (uint64_t)(uint32_t)(new_value->hi >> 32);
+    sum += (uint32_t)new_value->lo + (uint64_t)(uint32_t)(new_value->lo >> 32);
+    return nfqueue_csum_fold(sum);
+}
+
+
+//Return false if packet is not a valid IPv4 packet
+//Recompute IPv4 header checksum
+static inline bool nfqueue_csum_ipv4(void* packet, size_t len)
+{
+    uint8_t* ip = packet;
+    if (len < 20 || (ip[0] >> 4) != IPV4 || (size_t)(ip[0] & 0x0F) * 4 > len)
+        return false;
+    size_t ihl = (ip[0] & 0x0F) * 4;
+    memset(ip + 10, 0, 2);
+    uint16_t csum = nfqueue_csum_fold(nfqueue_csum_partial(ip, ihl, 0));
+    memcpy(ip + 10, &csum, 2);
+    return true;
+}
+
+
+//Return false if packet is not TCP or UDP over IPv4 or IPv6 (without extension headers), or is a fragment
+//Recompute TCP or UDP checksum of the whole packet (L4 length is taken from len)
+static inline bool nfqueue_csum_l4(void* packet, size_t len)
+{
+    uint8_t* ip = packet;
+    if (len < 1)
+        return false;
+    size_t l3_len;
+    uint8_t protocol;
+    uint64_t sum;
+    if ((ip[0] >> 4) == IPV4)
+    {
+        l3_len = (ip[0] & 0x0F) * 4;
+        if (len < 20 || l3_len < 20 || l3_len > len)
+            return false;
+        if ((ip[6] & 0x3F) != 0 || ip[7] != 0)  //MF flag or fragment offset
+            return false;
+        protocol = ip[9];
+        sum = nfqueue_csum_partial(ip + 12, 8, 0);  //addresses
+    }
+    else if ((ip[0] >> 4) == IPV6)
+    {
+        l3_len = 40;
+        if (len < l3_len)
+            return false;
+        protocol = ip[6];
+        sum = nfqueue_csum_partial(ip + 8, 32, 0);
+    }
+    else
+        return false;
+
+    uint8_t* l4 = ip + l3_len;
+    size_t l4_len = len - l3_len;
+    size_t csum_offset;
+    if (protocol == IPPROTO_TCP && l4_len >= 20)
+        csum_offset = 16;
+    else if (protocol == IPPROTO_UDP && l4_len >= 8)
+        csum_offset = 6;
+    else
+        return false;
+
+    sum += htons(protocol) + (uint64_t)htonl(l4_len);
+    memset(l4 + csum_offset, 0, 2);
+    uint16_t csum = nfqueue_csum_fold(nfqueue_csum_partial(l4, l4_len, sum));
+    if (csum == 0 && protocol == IPPROTO_UDP)
+        csum = 0xFFFF;  //zero means no checksum
+    memcpy(l4 + csum_offset, &csum, 2);
+    return true;
+}
 
 
 //Code from libnetfilter_queue/nlmsg.c
@@ -548,13 +1194,570 @@ static int parse_proto_cb(const struct nlattr *attr, void *data)
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Parse netfilter data into nf_packet
+// Timestamps
+
+
+/*
+Note about timestamps
+
+By default every packet gets two timestamps, mono_time and wall_time, read with clock_gettime(). This costs two
+calls per packet, and CLOCK_MONOTONIC_RAW is not handled by vDSO on many kernels, i.e. it is a real syscall.
+Timestamp policy (nf_buffer.timestamps) allows trading precision for speed:
+NF_TS_BATCH    all packets from one nfqueue_receive() get the same timestamps, taken after receiving the data
+NF_TS_COARSE   _COARSE clocks are read by vDSO without reading hardware clock, but have resolution of a jiffy;
+               note that CLOCK_MONOTONIC_COARSE is NTP-adjusted, unlike CLOCK_MONOTONIC_RAW, and the two differ
+NF_TS_TSC      time is computed from the CPU timestamp counter; this requires invariant TSC, synchronized between
+               CPUs (true for modern x86 CPUs). Counter is calibrated by nfqueue_tsc_calibrate(), which takes about
+               10 ms; otherwise it is calibrated over the first 10 ms of use, without blocking, and timestamps are
+               read with clock_gettime() until then. Calibration is global; it may be run again to correct drift,
+               also concurrently with packet processing.
+On architectures other than x86, NF_TS_TSC is handled as NF_TS_PRECISE.
+With NF_TS_TRUST_KERNEL, wall_time is taken from the kernel timestamp, when it is present (see kernel compatibility
+notes above), and CLOCK_REALTIME is not read. Field mono_time is always taken from a local clock.
+Timestamps can also be turned off completely with NF_SKIP_TIMESTAMP.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>  //__rdtsc
+    #define HAVE_TSC 1
+#endif
+
+#define NF_TSC_CALIBRATION_NS  10000000  //10 ms
+
+//nf_tsc.state
+enum
+{
+    NF_TSC_IDLE      = 0,  //not calibrated
+    NF_TSC_SAMPLING  = 1,  //first sample taken, waiting for calibration period to pass
+    NF_TSC_BUSY      = 2,  //a thread is taking a sample or publishing the result
+    NF_TSC_READY     = 3,
+    NF_TSC_FAILED    = 4,  //counter not usable
+};
+
+/*
+Calibration is published with a sequence lock, so that packet threads never read a half-written calibration,
+also when nfqueue_tsc_calibrate() is called again while they run. State transitions are made with CAS by whichever
+thread gets there first; until a calibration is ready, timestamps are read with clock_gettime().
+*/
+static struct
+{
+    _Atomic(int)       state;    //NF_TSC_*
+    uint64_t           tsc0;     //first sample, written in state NF_TSC_BUSY
+    _Atomic(uint64_t)  mono0;    //also read in state NF_TSC_SAMPLING
+    uint64_t           wall0;
+    _Atomic(uint32_t)  seq;      //odd while calibration below is being written
+    _Atomic(uint64_t)  tsc;      //counter value at calibration
+    _Atomic(uint64_t)  mono;     //CLOCK_MONOTONIC_RAW at calibration, in ns
+    _Atomic(uint64_t)  wall;     //CLOCK_REALTIME at calibration, in ns
+    _Atomic(uint64_t)  mult;     //nanoseconds per tick, in 32.32 fixed point; zero if not calibrated
+} nf_tsc;
 
 
 //helper
-static bool inline read_ip_addr(struct nlattr* attr, int af, ip_address_t* ip_num, int* ip_version)
+static inline uint64_t timespec_ns(const struct timespec* ts)
 {
-    if (attr)
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+
+//helper
+static inline void ns_timespec(uint64_t ns, struct timespec* ts)
+{
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+
+#ifdef HAVE_TSC
+
+//helper
+//Called with state NF_TSC_BUSY; take first sample
+static void nf_tsc_start(void)
+{
+    struct timespec mono, wall;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &mono);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    nf_tsc.tsc0 = __rdtsc();
+    atomic_store_explicit(&nf_tsc.mono0, timespec_ns(&mono), memory_order_relaxed);
+    nf_tsc.wall0 = timespec_ns(&wall);
+}
+
+
+//helper
+//Return false if counter is not usable
+//Called with state NF_TSC_BUSY; take second sample, publish calibration and move to NF_TSC_READY (or FAILED)
+static bool nf_tsc_finish(uint64_t mono1)
+{
+    uint64_t tsc1 = __rdtsc();
+    uint64_t mono0 = atomic_load_explicit(&nf_tsc.mono0, memory_order_relaxed);
+    uint64_t ns = mono1 - mono0;
+    if (tsc1 <= nf_tsc.tsc0 || ns == 0)
+    {
+        LOG(LOG_WARNING, "TSC not usable, using clock_gettime()");
+        atomic_store_explicit(&nf_tsc.state, NF_TSC_FAILED, memory_order_release);
+        return false;
+    }
+    uint64_t mult = (uint64_t)(((__uint128_t)ns << 32) / (tsc1 - nf_tsc.tsc0));
+
+    uint32_t seq = atomic_load_explicit(&nf_tsc.seq, memory_order_relaxed);
+    atomic_store_explicit(&nf_tsc.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&nf_tsc.tsc, nf_tsc.tsc0, memory_order_relaxed);
+    atomic_store_explicit(&nf_tsc.mono, mono0, memory_order_relaxed);
+    atomic_store_explicit(&nf_tsc.wall, nf_tsc.wall0, memory_order_relaxed);
+    atomic_store_explicit(&nf_tsc.mult, mult, memory_order_relaxed);
+    atomic_store_explicit(&nf_tsc.seq, seq + 2, memory_order_release);
+
+    atomic_store_explicit(&nf_tsc.state, NF_TSC_READY, memory_order_release);
+    DEBUG("TSC calibrated: %lu ticks in %lu ns", tsc1 - nf_tsc.tsc0, ns);
+    return true;
+}
+
+
+//helper
+//Advance calibration without waiting; called from the packet path while no calibration is ready
+static void nf_tsc_progress(void)
+{
+    int state = atomic_load_explicit(&nf_tsc.state, memory_order_acquire);
+    if (state == NF_TSC_IDLE)
+    {
+        if (atomic_compare_exchange_strong(&nf_tsc.state, &state, NF_TSC_BUSY))
+        {
+            nf_tsc_start();
+            atomic_store_explicit(&nf_tsc.state, NF_TSC_SAMPLING, memory_order_release);
+        }
+    }
+    else if (state == NF_TSC_SAMPLING)
+    {
+        struct timespec mono;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &mono);
+        if (timespec_ns(&mono) - atomic_load_explicit(&nf_tsc.mono0, memory_order_relaxed) >= NF_TSC_CALIBRATION_NS &&
+            atomic_compare_exchange_strong(&nf_tsc.state, &state, NF_TSC_BUSY))
+        {
+            nf_tsc_finish(timespec_ns(&mono));
+        }
+    }
+}
+
+#endif //HAVE_TSC
+
+
+//Return false if TSC is not supported
+//Calibrate CPU timestamp counter for NF_TS_TSC policy, blocking for about 10 ms; see note about timestamps
+//May be called again to correct drift, also while packets are being processed
+bool nfqueue_tsc_calibrate(void)
+{
+#ifdef HAVE_TSC
+    int state = atomic_load_explicit(&nf_tsc.state, memory_order_acquire);
+    for (;;)
+    {
+        if (state == NF_TSC_FAILED)
+            return false;
+        if (state != NF_TSC_BUSY && atomic_compare_exchange_weak(&nf_tsc.state, &state, NF_TSC_BUSY))
+            break;
+        if (state == NF_TSC_BUSY)  //another thread is taking a sample
+        {
+            struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+            nanosleep(&delay, NULL);
+            state = atomic_load_explicit(&nf_tsc.state, memory_order_acquire);
+        }
+    }
+    nf_tsc_start();  //state stays NF_TSC_BUSY while sleeping
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = NF_TSC_CALIBRATION_NS };
+    nanosleep(&delay, NULL);
+    struct timespec mono;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &mono);
+    return nf_tsc_finish(timespec_ns(&mono));
+#else
+    return false;
+#endif
+}
+
+
+//helper
+//Return false if TSC is not available, or not calibrated yet
+static bool tsc_time(struct timespec* mono, struct timespec* wall)
+{
+#ifdef HAVE_TSC
+    uint32_t seq;
+    uint64_t tsc, mono_ns, wall_ns, mult;
+    do
+    {
+        seq = atomic_load_explicit(&nf_tsc.seq, memory_order_acquire);
+        tsc = atomic_load_explicit(&nf_tsc.tsc, memory_order_relaxed);
+        mono_ns = atomic_load_explicit(&nf_tsc.mono, memory_order_relaxed);
+        wall_ns = atomic_load_explicit(&nf_tsc.wall, memory_order_relaxed);
+        mult = atomic_load_explicit(&nf_tsc.mult, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    }
+    while ((seq & 1) || seq != atomic_load_explicit(&nf_tsc.seq, memory_order_relaxed));
+    if (mult == 0)
+    {
+        nf_tsc_progress();
+        return false;
+    }
+    uint64_t ns = (uint64_t)(((__uint128_t)(__rdtsc() - tsc) * mult) >> 32);
+    ns_timespec(mono_ns + ns, mono);
+    if (wall)
+        ns_timespec(wall_ns + ns, wall);
+    return true;
+#else
+    LOG_ONCE(LOG_WARNING, "TSC not supported, using clock_gettime()");
+    return false;
+#endif
+}
+
+
+//helper
+//Read clocks according to policy; wall may be NULL if not needed
+static void read_clocks(uint32_t policy, struct timespec* mono, struct timespec* wall)
+{
+    switch (policy & NF_TS_CLOCK_MASK)
+    {
+        case NF_TS_COARSE:
+            clock_gettime(CLOCK_MONOTONIC_COARSE, mono);
+            if (wall)
+                clock_gettime(CLOCK_REALTIME_COARSE, wall);
+            return;
+        case NF_TS_TSC:
+            if (tsc_time(mono, wall))
+                return;
+            //fall through
+        default:
+            clock_gettime(CLOCK_MONOTONIC_RAW, mono);
+            if (wall)
+                clock_gettime(CLOCK_REALTIME, wall);
+            return;
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+
+
+/*
+Note about statistics
+
+Every queue has NF_STATS_SHARDS sets of counters, each in its own cache lines. A thread picks a shard on first
+use (round-robin), so threads serving the same queue do not share cache lines (unless there are more threads
+than shards). Counters are updated with relaxed atomic additions and never read on the data path; nfqueue_stats()
+sums all shards into a snapshot, which may be taken at any time from any thread, e.g. by a metrics exporter.
+Latency is not measured automatically, because the library does not know when a verdict is final (it may be
+queued, batched or deferred). nfqueue_stats_latency() records time elapsed since packet->mono_time, so it should
+be called right after the verdict is sent; queue group workers call it after pushing every verdict.
+nfqueue_kernel_stats() reads counters maintained by the kernel, including packets dropped before they reached
+the socket. It reads a procfs file, so it should not be called on the data path either.
+*/
+
+#define NF_STATS_SHARDS  8
+
+struct nf_stats_shard
+{
+    _Atomic(uint64_t)  packets;
+    _Atomic(uint64_t)  bytes;
+    _Atomic(uint64_t)  batches;
+    _Atomic(uint64_t)  parse_errors;
+    _Atomic(uint64_t)  verdict_errors;
+    _Atomic(uint64_t)  latency_count;
+    _Atomic(uint64_t)  latency_sum;
+    _Atomic(uint64_t)  latency[NF_HIST_BUCKETS];
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static _Atomic(unsigned) nf_stats_next_shard;
+static _Thread_local int nf_stats_thread_shard = -1;
+
+
+//helper
+static inline struct nf_stats_shard* nfqueue_stats_shard(const struct nf_queue* q)
+{
+    if (nf_stats_thread_shard < 0)
+        nf_stats_thread_shard = atomic_fetch_add_explicit(&nf_stats_next_shard, 1, memory_order_relaxed) % NF_STATS_SHARDS;
+    return &q->stats[nf_stats_thread_shard];
+}
+
+
+//helper
+static inline void nfqueue_stats_add(_Atomic(uint64_t)* counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+
+//helper
+static inline int nfqueue_stats_bucket(uint64_t ns)
+{
+    if (ns < NF_HIST_SUB)
+        return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= NF_HIST_MAX_BITS)
+        return NF_HIST_BUCKETS - 1;
+    return (msb - NF_HIST_SUB_BITS + 1) * NF_HIST_SUB + (int)((ns >> (msb - NF_HIST_SUB_BITS)) & (NF_HIST_SUB - 1));
+}
+
+
+//Return the smallest value (in ns) counted by histogram bucket i; for i == NF_HIST_BUCKETS, the limit of the last one
+uint64_t nfqueue_stats_bucket_min(int i)
+{
+    ASSERT(i >= 0 && i <= NF_HIST_BUCKETS);
+    if (i < NF_HIST_SUB)
+        return i;
+    int msb = i / NF_HIST_SUB + NF_HIST_SUB_BITS - 1;
+    return (uint64_t)(NF_HIST_SUB + i % NF_HIST_SUB) << (msb - NF_HIST_SUB_BITS);
+}
+
+
+//Record latency of a packet, i.e. time since packet->mono_time; timestamps must be the policy it was received with
+//Packets without timestamp (NF_SKIP_TIMESTAMP) are ignored
+void nfqueue_stats_latency(struct nf_queue* q, const struct nf_packet* packet, uint32_t timestamps)
+{
+    ASSERT(q);
+    ASSERT(packet);
+    if (packet->mono_time.tv_sec == 0 && packet->mono_time.tv_nsec == 0)
+        return;
+    struct timespec now;
+    read_clocks(timestamps, &now, NULL);
+    int64_t ns = (now.tv_sec - packet->mono_time.tv_sec) * 1000000000 + (now.tv_nsec - packet->mono_time.tv_nsec);
+    if (ns < 0)  //e.g. TSC recalibrated
+        ns = 0;
+    struct nf_stats_shard* shard = nfqueue_stats_shard(q);
+    nfqueue_stats_add(&shard->latency_count, 1);
+    nfqueue_stats_add(&shard->latency_sum, ns);
+    nfqueue_stats_add(&shard->latency[nfqueue_stats_bucket(ns)], 1);
+}
+
+
+//Take a snapshot of queue statistics
+//Counters are read one by one while they may be updated, so they may be slightly inconsistent with each other
+void nfqueue_stats(const struct nf_queue* q, struct nf_queue_stats* stats)
+{
+    ASSERT(q);
+    ASSERT(q->stats);
+    ASSERT(stats);
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < NF_STATS_SHARDS; i++)
+    {
+        struct nf_stats_shard* shard = &q->stats[i];
+        stats->packets += atomic_load_explicit(&shard->packets, memory_order_relaxed);
+        stats->bytes += atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+        stats->batches += atomic_load_explicit(&shard->batches, memory_order_relaxed);
+        stats->parse_errors += atomic_load_explicit(&shard->parse_errors, memory_order_relaxed);
+        stats->verdict_errors += atomic_load_explicit(&shard->verdict_errors, memory_order_relaxed);
+        stats->latency_count += atomic_load_explicit(&shard->latency_count, memory_order_relaxed);
+        stats->latency_sum += atomic_load_explicit(&shard->latency_sum, memory_order_relaxed);
+        for (int j = 0; j < NF_HIST_BUCKETS; j++)
+            stats->latency[j] += atomic_load_explicit(&shard->latency[j], memory_order_relaxed);
+    }
+    stats->enobufs = atomic_load_explicit(&q->overruns, memory_order_relaxed);
+}
+
+
+//Return latency (in ns) below which the fraction p (0..1) of recorded values falls, or 0 if there are none
+//Result is the lower bound of the bucket containing the percentile, i.e. it is within 1/NF_HIST_SUB below the exact value
+uint64_t nfqueue_stats_percentile(const struct nf_queue_stats* stats, double p)
+{
+    ASSERT(stats);
+    uint64_t total = 0;
+    for (int i = 0; i < NF_HIST_BUCKETS; i++)
+        total += stats->latency[i];
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < NF_HIST_BUCKETS; i++)
+    {
+        seen += stats->latency[i];
+        if (seen > rank)
+            return nfqueue_stats_bucket_min(i);
+    }
+    return nfqueue_stats_bucket_min(NF_HIST_BUCKETS - 1);
+}
+
+
+//Return false on failure (e.g. nfnetlink_queue module is not loaded; no queue bound yet) or if queue is not found
+//Read kernel statistics of queue queue_num
+bool nfqueue_kernel_stats(int queue_num, struct nf_kernel_stats* ks)
+{
+    ASSERT(ks);
+    FILE* f = fopen("/proc/net/netfilter/nfnetlink_queue", "r");
+    if (f == NULL)
+    {
+        LOG_SYSERR("fopen(/proc/net/netfilter/nfnetlink_queue)");
+        return false;
+    }
+    bool found = false;
+    char line[256];
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        unsigned num;
+        struct nf_kernel_stats k;
+        if (sscanf(line, "%u %u %u %u %u %u %u %u", &num, &k.portid, &k.queue_total, &k.copy_mode, &k.copy_range,
+                   &k.queue_dropped, &k.user_dropped, &k.id_sequence) == 8 && num == (unsigned)queue_num)
+        {
+            *ks = k;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Payload allocator
+
+
+/*
+Note about slab allocator
+
+nf_slab is a pool of fixed-size blocks, in size classes given by NF_SLAB_CLASS_SIZES. Payloads larger than the
+largest class are allocated with malloc. Blocks are carved from chunks allocated with malloc, which are never
+returned to the system until nfqueue_slab_destroy(); thus in steady state no malloc calls are made.
+A slab is meant to be owned by one receiving thread (i.e. assigned to its nf_buffer), which is the only thread
+allocating from it. Blocks may be freed by any thread: they are pushed to a lock-free list of the owner slab,
+which the owner takes over as a whole when its local free list runs out (thus there is no ABA problem). Every block records its owner slab, so a packet can be freed without knowing where it came from.
+All blocks must be freed before nfqueue_slab_destroy() is called.
+*/
+
+#define NF_SLAB_CLASSES      4
+#define NF_SLAB_CLASS_SIZES  { 128, 512, 2048, 65536 }
+#define NF_SLAB_CHUNK_SIZE   (256 * 1024)  //chunk size, rounded up to at least 4 blocks
+#define NF_SLAB_LARGE        NF_SLAB_CLASSES  //size class of blocks allocated with malloc
+
+struct nf_slab_block
+{
+    struct nf_slab*       owner;
+    uint32_t              size_class;
+    uint32_t              reserved;
+    struct nf_slab_block* next;  //used only while the block is free; overlaps payload
+};
+
+#define NF_SLAB_HEADER_LEN  offsetof(struct nf_slab_block, next)
+
+struct nf_slab_stats
+{
+    uint64_t allocs;         //blocks allocated
+    uint64_t frees;          //blocks freed
+    uint64_t chunk_mallocs;  //chunks allocated with malloc
+    uint64_t large_mallocs;  //oversized payloads allocated with malloc
+};
+
+struct nf_slab
+{
+    struct nf_allocator    allocator;  //pass &slab->allocator to nf_buffer
+    //Owner thread data
+    struct nf_slab_block*  local[NF_SLAB_CLASSES];
+    void*                  chunks;     //list of allocated chunks, linked through their first word
+    uint64_t               allocs;
+    uint64_t               chunk_mallocs;
+    uint64_t               large_mallocs;
+    //Data shared with other threads
+    _Atomic(struct nf_slab_block*) remote[NF_SLAB_CLASSES] __attribute__((aligned(CACHELINE_SIZE)));
+    _Atomic(uint64_t)      frees;
+};
+
+
+//helper
+static bool nfqueue_slab_grow(struct nf_slab* slab, uint32_t size_class)
+{
+    static const size_t class_size[] = NF_SLAB_CLASS_SIZES;
+    size_t block_len = (NF_SLAB_HEADER_LEN + class_size[size_class] + 15) & ~(size_t)15;
+    size_t count = NF_SLAB_CHUNK_SIZE / block_len;
+    if (count < 4)
+        count = 4;
+
+    //The first CACHELINE_SIZE bytes of a chunk link it to the chunk list
+    char* chunk = malloc(CACHELINE_SIZE + count * block_len);
+    if (chunk == NULL)
+        return false;
+    slab->chunk_mallocs++;
+    *(void**)chunk = slab->chunks;
+    slab->chunks = chunk;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct nf_slab_block* block = (struct nf_slab_block*)(chunk + CACHELINE_SIZE + i * block_len);
+        block->owner = slab;
+        block->size_class = size_class;
+        block->next = slab->local[size_class];
+        slab->local[size_class] = block;
+    }
+    return true;
+}
+
+
+//helper
+//Must be called by the owner thread only
+static void* nfqueue_slab_alloc(void* ctx, size_t size)
+{
+    static const size_t class_size[] = NF_SLAB_CLASS_SIZES;
+    struct nf_slab* slab = ctx;
+
+    uint32_t c = 0;
+    while (c < NF_SLAB_CLASSES && size > class_size[c])
+        c++;
+
+    struct nf_slab_block* block;
+    if (c == NF_SLAB_LARGE)
+    {
+        if ((block = malloc(NF_SLAB_HEADER_LEN + size)) == NULL)
+            return NULL;
+        slab->large_mallocs++;
+        block->owner = slab;
+        block->size_class = NF_SLAB_LARGE;
+    }
+    else
+    {
+        if (slab->local[c] == NULL)
+            slab->local[c] = atomic_exchange_explicit(&slab->remote[c], NULL, memory_order_acquire);
+        if (slab->local[c] == NULL && !nfqueue_slab_grow(slab, c))
+            return NULL;
+        block = slab->local[c];
+        slab->local[c] = block->next;
+    }
+
+    slab->allocs++;
+    return (char*)block + NF_SLAB_HEADER_LEN;
+}
+
+
+//helper
+//May be called from any thread
+static void nfqueue_slab_free(void* ctx, void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    struct nf_slab_block* block = (struct nf_slab_block*)((char*)ptr - NF_SLAB_HEADER_LEN);
+    struct nf_slab* slab = block->owner;
+    uint32_t c = block->size_class;
+    ASSERT(c <= NF_SLAB_LARGE);
+
+    atomic_fetch_add_explicit(&slab->frees, 1, memory_order_relaxed);
+    if (c == NF_SLAB_LARGE)
+    {
+        free(block);
+        return;
+    }
+
+    struct nf_slab_block* head = atomic_load_explicit(&slab->remote[c], memory_order_relaxed);
+    do
+    {
+        block->next = head;
+    }
+    while (!atomic_compare_exchange_weak_explicit(&slab->remote[c], &head, block, memory_order_release, memory_order_relaxed));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parse netfilter data into nf_packet
+
+
+//helper
+static bool inline read_ip_addr(struct nlattr* attr, int af, ip_address_t* ip_num, int* ip_version)
+{
+    if (attr)
     {
         //Note: addr may be unaligned, so we use memcpy to copy it to an integer
         void* addr = mnl_attr_get_payload(attr);
@@ -609,6 +1812,8 @@ static bool read_addr_tuple(struct nlattr* attr, struct ip_tuple* tuple)
         struct nlattr* attr3[CTA_PROTO_MAX+1] = {0};
         if (mnl_attr_parse_nested(attr2[CTA_TUPLE_PROTO], parse_proto_cb, attr3) < 0)
             return false;
+        if (attr3[CTA_PROTO_NUM])
+            tuple->protocol = mnl_attr_get_u8(attr3[CTA_PROTO_NUM]);
         if (attr3[CTA_PROTO_SRC_PORT])
             tuple->src_port = ntohs(mnl_attr_get_u16(attr3[CTA_PROTO_SRC_PORT]));
         if (attr3[CTA_PROTO_DST_PORT])
@@ -622,67 +1827,42 @@ static bool read_addr_tuple(struct nlattr* attr, struct ip_tuple* tuple)
 // The functions below log errors
 
 
+//helper
 //Return false on failure
-static bool nfqueue_parse(const struct nlmsghdr* nlh, struct nf_packet* packet)
+//Payload is copied using buf->allocator, unless buf->zero_copy is set
+static bool nfqueue_parse_payload(const struct nlattr* attr, struct nf_packet* packet, const struct nf_buffer* buf)
 {
-    memset(packet, 0, sizeof(*packet));
-    clock_gettime(CLOCK_MONOTONIC_RAW, &packet->mono_time);
-    clock_gettime(CLOCK_REALTIME, &packet->wall_time);
-
-    struct nlattr* attr[NFQA_MAX+1] = {0};
-
-	if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), parse_nfqa_attr_cb, attr) < 0)
+    //Unless in zero-copy mode, create a separate copy so that buffer can be reused
+    void* payload = mnl_attr_get_payload(attr);
+    if (buf->zero_copy)
     {
-        LOG_SYSERR("mnl_attr_parse");
-        return false;
-    }
-
-	if (attr[NFQA_PACKET_HDR] == NULL)
-    {
-        LOG(LOG_ERR, "Packet metaheader not set");
-        return false;
+        packet->payload = payload;
+        packet->payload_view = true;
     }
-
-    if (attr[NFQA_PAYLOAD] == NULL)
-    {
-        LOG(LOG_ERR, "Packet has no payload");
-        return false;
-    }
-
-    //Queue number
-    struct nfgenmsg* nfg = mnl_nlmsg_get_payload(nlh);
-    packet->queue_num = ntohs(nfg->res_id);
-
-    //Data from netlink message header
-    struct nfqnl_msg_packet_hdr *ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
-    if (ph == NULL)
+    else
     {
-        LOG(LOG_ERR, "Packet metaheader is null");
-        return false;
+        packet->allocator = buf->allocator;
+        if (buf->allocator)
+            packet->payload = buf->allocator->alloc(buf->allocator->ctx, packet->payload_len);
+        else
+            packet->payload = malloc(packet->payload_len);
+        ASSERT(packet->payload != NULL);
+        memmove(packet->payload, payload, packet->payload_len);
     }
-    packet->packet_id = ntohl(ph->packet_id);
-    packet->hw_protocol = ntohs(ph->hw_protocol);
+    return true;
+}
 
-    //Packet payload
-    //Create a separate copy so that buffer can be reused
-    void* payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
-    packet->payload_len = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
-    if (packet->payload_len == 0)
-    {
-        LOG(LOG_ERR, "Packet payload has zero length");
-        return false;
-    }
-    packet->payload = malloc(packet->payload_len);
-    ASSERT(packet->payload != NULL);
-    memmove(packet->payload, payload, packet->payload_len);
 
-    //Timestamp
+//helper
+//attr may be NULL
+static void nfqueue_parse_timestamp(const struct nlattr* attr, struct nf_packet* packet, const struct nf_buffer* buf)
+{
     //Note: Packet timestamps do not always work reliably, e.g. kernel 4.4 always passes timestamp zero.
     //See https://patchwork.ozlabs.org/patch/269090/
     packet->has_timestamp = false;
-    if (attr[NFQA_TIMESTAMP])
+    if (attr)
     {
-        struct nfqnl_msg_packet_timestamp* ts = mnl_attr_get_payload(attr[NFQA_TIMESTAMP]);
+        struct nfqnl_msg_packet_timestamp* ts = mnl_attr_get_payload(attr);
         if (ts->sec != 0 || ts->usec != 0)
         {
             packet->has_timestamp = true;
@@ -696,16 +1876,36 @@ static bool nfqueue_parse(const struct nlmsghdr* nlh, struct nf_packet* packet)
         DEBUG("Packet timestamp not set");
     }
 
-    //Conntrack data
-    if (attr[NFQA_CT])
+    //Local timestamps
+    bool trust_kernel = packet->has_timestamp && (buf->timestamps & NF_TS_TRUST_KERNEL);
+    if ((buf->timestamps & NF_TS_CLOCK_MASK) == NF_TS_BATCH)
+    {
+        packet->mono_time = buf->batch_mono;
+        packet->wall_time = buf->batch_wall;
+    }
+    else
+        read_clocks(buf->timestamps, &packet->mono_time, trust_kernel? NULL : &packet->wall_time);
+    if (trust_kernel)
+    {
+        packet->wall_time.tv_sec  = packet->timestamp.tv_sec;
+        packet->wall_time.tv_nsec = packet->timestamp.tv_usec * 1000;
+    }
+}
+
+
+//helper
+//Return false on failure
+//Parse NFQA_CT nest: if main is true, all data except for the reply tuple; if reply is true, the reply tuple
+static bool nfqueue_parse_conntrack(const struct nlattr* attr, struct nf_packet* packet, bool main, bool reply)
+{
+    struct nlattr* attr1[CTA_MAX+1] = {0};
+    if (mnl_attr_parse_nested(attr, parse_cta_attr_cb, attr1) < 0)
+    {
+        LOG_SYSERR("mnl_attr_parse_nested(CT)");
+        return false;
+    }
+    if (main)
     {
-        struct nlattr* attr1[CTA_MAX+1] = {0};
-        packet->has_conntrack = true;
-        if (mnl_attr_parse_nested(attr[NFQA_CT], parse_cta_attr_cb, attr1) < 0)
-        {
-            LOG_SYSERR("mnl_attr_parse_nested(CT)");
-            return false;
-        }
         if (attr1[CTA_ID])
             packet->conn_id = ntohl(mnl_attr_get_u32(attr1[CTA_ID]));
         if (attr1[CTA_STATUS])
@@ -721,6 +1921,9 @@ static bool nfqueue_parse(const struct nlmsghdr* nlh, struct nf_packet* packet)
                 LOG_SYSERR("read_addr_tuple(orig)");
                 return false;
             }
+    }
+    if (reply)
+    {
         if (attr1[CTA_TUPLE_REPLY])
             if (!read_addr_tuple(attr1[CTA_TUPLE_REPLY], &packet->reply))
             {
@@ -728,51 +1931,1069 @@ static bool nfqueue_parse(const struct nlmsghdr* nlh, struct nf_packet* packet)
                 return false;
             }
     }
-    else
-    {
-        packet->has_conntrack = false;
-        LOG_ONCE(LOG_WARNING, "Kernel does not support conntrack");
-        DEBUG("Conntrack data not passed by kernel");
-    }
-
-    //Conntrack state
-    if (attr[NFQA_CT_INFO])
-        packet->conn_state = ntohl(mnl_attr_get_u32(attr[NFQA_CT_INFO]));
-    else
-        DEBUG("Conntrack state not passed by kernel");
-
     return true;
 }
 
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Helpers and workarounds
+//Return false on failure
+//Parts of data listed in buf->skip are not parsed, but can be loaded later with nfqueue_packet_load()
+static bool nfqueue_parse(const struct nlmsghdr* nlh, struct nf_packet* packet, const struct nf_buffer* buf)
+{
+    memset(packet, 0, sizeof(*packet));
 
+    struct nlattr* attr[NFQA_MAX+1] = {0};
 
-//Helper
+	if (mnl_attr_parse(nlh, sizeof(struct nfgenmsg), parse_nfqa_attr_cb, attr) < 0)
+    {
+        LOG_SYSERR("mnl_attr_parse");
+        return false;
+    }
+
+	if (attr[NFQA_PACKET_HDR] == NULL)
+    {
+        LOG(LOG_ERR, "Packet metaheader not set");
+        return false;
+    }
+
+    //Queue number
+    struct nfgenmsg* nfg = mnl_nlmsg_get_payload(nlh);
+    packet->queue_num = ntohs(nfg->res_id);
+
+    //Data from netlink message header
+    struct nfqnl_msg_packet_hdr *ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
+    if (ph == NULL)
+    {
+        LOG(LOG_ERR, "Packet metaheader is null");
+        return false;
+    }
+    packet->packet_id = ntohl(ph->packet_id);
+    packet->hw_protocol = ntohs(ph->hw_protocol);
+
+    //Attributes kept for nfqueue_packet_load()
+    packet->skipped = buf->skip;
+    if (packet->skipped & NF_SKIP_CONNTRACK)
+        packet->skipped |= NF_SKIP_REPLY;
+    packet->raw_payload = attr[NFQA_PAYLOAD];
+    packet->raw_timestamp = attr[NFQA_TIMESTAMP];
+    packet->raw_ct = attr[NFQA_CT];
+
+    //Packet payload
+    //Payload is absent in NFQNL_COPY_META mode, and truncated to copy_range in NFQNL_COPY_PACKET mode;
+    //in both cases kernel passes original packet length in NFQA_CAP_LEN
+    if (attr[NFQA_CAP_LEN])
+        packet->orig_len = ntohl(mnl_attr_get_u32(attr[NFQA_CAP_LEN]));
+    if (attr[NFQA_PAYLOAD])
+    {
+        packet->payload_len = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
+        if (packet->payload_len == 0)
+        {
+            LOG(LOG_ERR, "Packet payload has zero length");
+            return false;
+        }
+        if (packet->orig_len < packet->payload_len)
+            packet->orig_len = packet->payload_len;
+        if (!(buf->skip & NF_SKIP_PAYLOAD) && !nfqueue_parse_payload(attr[NFQA_PAYLOAD], packet, buf))
+            return false;
+    }
+    else if (attr[NFQA_CAP_LEN] == NULL)
+    {
+        LOG(LOG_ERR, "Packet has no payload");
+        return false;
+    }
+
+    //Skb info (passed with NFQA_CFG_F_GSO)
+    //NFQA_SKB_GSO means payload is a GSO packet that may be larger than MTU; NFQA_SKB_CSUMNOTREADY means that
+    //checksums were not computed yet (offloaded to NIC) and must not be verified
+    if (attr[NFQA_SKB_INFO])
+        packet->skb_info = ntohl(mnl_attr_get_u32(attr[NFQA_SKB_INFO]));
+
+    //Timestamp
+    if (!(buf->skip & NF_SKIP_TIMESTAMP))
+        nfqueue_parse_timestamp(attr[NFQA_TIMESTAMP], packet, buf);
+
+    //Conntrack data
+    if (attr[NFQA_CT])
+    {
+        packet->has_conntrack = true;
+        bool main = !(buf->skip & NF_SKIP_CONNTRACK);
+        bool reply = !(buf->skip & (NF_SKIP_CONNTRACK | NF_SKIP_REPLY));
+        if ((main || reply) && !nfqueue_parse_conntrack(attr[NFQA_CT], packet, main, reply))
+            return false;
+    }
+    else
+    {
+        packet->has_conntrack = false;
+        LOG_ONCE(LOG_WARNING, "Kernel does not support conntrack");
+        DEBUG("Conntrack data not passed by kernel");
+    }
+
+    //Conntrack state
+    if (attr[NFQA_CT_INFO])
+        packet->conn_state = ntohl(mnl_attr_get_u32(attr[NFQA_CT_INFO]));
+    else
+        DEBUG("Conntrack state not passed by kernel");
+
+    return true;
+}
+
+
+//helper
+//Return u32 attribute payload in host byte order, or zero if the attribute is too short
+static inline uint32_t nfqueue_desc_u32(const struct nlattr* attr)
+{
+    uint32_t v;
+    if (attr->nla_len < MNL_ATTR_HDRLEN + sizeof(v))
+        return 0;
+    memcpy(&v, (const char*)attr + MNL_ATTR_HDRLEN, sizeof(v));
+    return ntohl(v);
+}
+
+
+//Return false on failure
+//Fill descriptor from packet message, walking attributes once without validating them through libmnl calls;
+//conntrack nest is parsed for conn_id, conn_mark and conn_status only (tuples are left to nfqueue_desc_packet())
+static bool nfqueue_parse_desc(const struct nlmsghdr* nlh, const char* base, struct nf_packet_desc* d, const struct nf_buffer* buf)
+{
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+    {
+        LOG(LOG_ERR, "Packet message too short (length=%u)", nlh->nlmsg_len);
+        return false;
+    }
+    const struct nfgenmsg* nfg = mnl_nlmsg_get_payload(nlh);
+    *d = (struct nf_packet_desc)
+    {
+        .msg_offset = (const char*)nlh - base,
+        .queue_num = ntohs(nfg->res_id),
+    };
+    bool has_header = false, has_cap_len = false;
+    const char* p = (const char*)nlh + MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg));
+    const char* end = (const char*)nlh + nlh->nlmsg_len;
+    while (end - p >= (ptrdiff_t)MNL_ATTR_HDRLEN)
+    {
+        const struct nlattr* attr = (const struct nlattr*)p;
+        if (attr->nla_len < MNL_ATTR_HDRLEN || attr->nla_len > end - p)
+        {
+            LOG(LOG_ERR, "Malformed packet attribute");
+            return false;
+        }
+        switch (attr->nla_type & NLA_TYPE_MASK)
+        {
+            case NFQA_PACKET_HDR:
+                if (attr->nla_len >= MNL_ATTR_HDRLEN + sizeof(struct nfqnl_msg_packet_hdr))
+                {
+                    const struct nfqnl_msg_packet_hdr* ph = (const void*)(p + MNL_ATTR_HDRLEN);
+                    d->packet_id = ntohl(ph->packet_id);
+                    d->hw_protocol = ntohs(ph->hw_protocol);
+                    has_header = true;
+                }
+                break;
+            case NFQA_PAYLOAD:
+                d->flags |= NF_DESC_PAYLOAD;
+                d->payload_offset = p + MNL_ATTR_HDRLEN - base;
+                d->payload_len = attr->nla_len - MNL_ATTR_HDRLEN;
+                break;
+            case NFQA_CAP_LEN:
+                d->orig_len = nfqueue_desc_u32(attr);
+                has_cap_len = true;
+                break;
+            case NFQA_SKB_INFO:
+                d->skb_info = nfqueue_desc_u32(attr);
+                break;
+            case NFQA_CT_INFO:
+                d->conn_state = nfqueue_desc_u32(attr);
+                break;
+            case NFQA_CT:
+                d->flags |= NF_DESC_CONNTRACK;
+                if (buf->skip & NF_SKIP_CONNTRACK)
+                    break;
+                for (const char* q = p + MNL_ATTR_HDRLEN; p + attr->nla_len - q >= (ptrdiff_t)MNL_ATTR_HDRLEN;)
+                {
+                    const struct nlattr* ct = (const struct nlattr*)q;
+                    if (ct->nla_len < MNL_ATTR_HDRLEN || ct->nla_len > p + attr->nla_len - q)
+                        break;
+                    switch (ct->nla_type & NLA_TYPE_MASK)
+                    {
+                        case CTA_ID:
+                            d->conn_id = nfqueue_desc_u32(ct);
+                            break;
+                        case CTA_MARK:
+                            d->conn_mark = nfqueue_desc_u32(ct);
+                            d->flags |= NF_DESC_CONNMARK;
+                            break;
+                        case CTA_STATUS:
+                            d->conn_status = nfqueue_desc_u32(ct);
+                            break;
+                    }
+                    q += MNL_ALIGN(ct->nla_len);
+                }
+                break;
+        }
+        p += MNL_ALIGN(attr->nla_len);
+    }
+
+    if (!has_header)
+    {
+        LOG(LOG_ERR, "Packet metaheader not set");
+        return false;
+    }
+    if ((d->flags & NF_DESC_PAYLOAD) && d->payload_len == 0)
+    {
+        LOG(LOG_ERR, "Packet payload has zero length");
+        return false;
+    }
+    if (!(d->flags & NF_DESC_PAYLOAD) && !has_cap_len)
+    {
+        LOG(LOG_ERR, "Packet has no payload");
+        return false;
+    }
+    if (d->orig_len < d->payload_len)
+        d->orig_len = d->payload_len;
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers and workarounds
+
+
+//Helper
 //Return <0 on failure
 //See http://www.masterraghu.com/subjects/np/introduction/unix_network_programming_v1.3/ch14lev1sec2.html
 static int recv_timeout(int fd, int64_t timeout_ms)
 {
-    fd_set rset;
-    FD_ZERO(&rset);
-    FD_SET(fd, &rset);
-    struct timespec ts =
+    fd_set rset;
+    FD_ZERO(&rset);
+    FD_SET(fd, &rset);
+    struct timespec ts =
+    {
+        .tv_sec  = timeout_ms/1000,
+        .tv_nsec = (timeout_ms%1000) * 1000000
+    };
+    int retval = pselect(fd + 1, &rset, NULL, NULL, timeout_ms > 0? &ts : NULL, NULL);
+    if (retval == -1 && errno == EINTR)  //signal
+        return 0;  //no data
+    else
+        return retval;  // >0 if descriptor is readable
+}
+
+
+//Helper
+//Return false on failure
+//Receive buffer larger than net.core.rmem_max requires SO_RCVBUFFORCE, and thus CAP_NET_ADMIN, which we need anyway
+static bool nfqueue_set_socket_options(struct mnl_socket* nl, const struct nf_queue_options* opt)
+{
+    int fd = mnl_socket_get_fd(nl);
+    if (opt->rcvbuf > 0)
+    {
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &opt->rcvbuf, sizeof(opt->rcvbuf)) < 0)
+        {
+            LOG_SYSERR("setsockopt(SO_RCVBUFFORCE)");
+            if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt->rcvbuf, sizeof(opt->rcvbuf)) < 0)
+            {
+                LOG_SYSERR("setsockopt(SO_RCVBUF)");
+                return false;
+            }
+        }
+    }
+
+    int on = 1;
+    if (opt->no_enobufs && setsockopt(fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &on, sizeof(on)) < 0)
+    {
+        LOG_SYSERR("setsockopt(NETLINK_NO_ENOBUFS)");
+        return false;
+    }
+    if (opt->ext_ack && setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK, &on, sizeof(on)) < 0)
+        LOG_SYSERR("setsockopt(NETLINK_EXT_ACK)");  //not critical
+    return true;
+}
+
+
+//Helper
+//Socket buffer overrun: kernel dropped messages, but the socket is still usable
+static void nfqueue_overrun(struct nf_queue* q)
+{
+    uint64_t n = atomic_fetch_add_explicit(&q->overruns, 1, memory_order_relaxed);
+    if (n == 0)
+        LOG(LOG_WARNING, "Netlink socket buffer overrun on queue %d; consider increasing rcvbuf", q->queue_num);
+    else
+        LOG_RATELIMIT(LOG_WARNING, 1000, "Netlink socket buffer overrun on queue %d (%lu total)", q->queue_num, (unsigned long)(n + 1));
+}
+
+
+/*
+Note about memory-mapped ring (NF_BACKEND_MMAP)
+
+Kernels 3.10 to 4.5 support memory-mapped netlink (NETLINK_RX_RING): the kernel writes messages directly to
+frames of a ring shared with user space, so there is no copy from the socket to nf_buffer, and no recvfrom()
+call as long as there are frames ready. nfqueue_receive() then makes nf_buffer refer to the next ready frame, and
+returns the frame to kernel on the next call with the same buffer (thus a few frames may be held at a time).
+Messages that do not fit in a frame are passed the usual way, and read with recvfrom().
+This backend is experimental, and meant for benchmarking. The ring position is kept in nf_queue, so only one thread
+may receive from the queue. Kernel 4.6 removed memory-mapped netlink; there, and if the ring cannot be set up,
+NF_BACKEND_RECVFROM is used (the backend in use is reported by nf_queue.backend).
+Note that AF_XDP is not an option here: packets redirected to an XDP socket never reach netfilter.
+*/
+
+#define NF_RING_FRAME_SIZE  16384
+#define NF_RING_FRAMES      1024
+
+//Helper
+//Return false if ring is not supported; the socket is then usable as before
+static bool nfqueue_ring_setup(struct nf_queue* q, const struct nf_queue_options* opt)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t frame_size = opt->ring_frame_size > 0? opt->ring_frame_size : NF_RING_FRAME_SIZE;
+    frame_size = (frame_size + page - 1) / page * page;
+    size_t frames = opt->ring_frames > 0? opt->ring_frames : NF_RING_FRAMES;
+
+    struct nl_mmap_req req =
+    {
+        .nm_block_size = frame_size,
+        .nm_block_nr = frames,
+        .nm_frame_size = frame_size,
+        .nm_frame_nr = frames,
+    };
+    int fd = mnl_socket_get_fd(q->nl_socket);
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_RX_RING, &req, sizeof(req)) < 0)
+    {
+        LOG_SYSERR("setsockopt(NETLINK_RX_RING)");
+        return false;
+    }
+    void* ring = mmap(NULL, frame_size * frames, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        LOG_SYSERR("mmap");
+        return false;
+    }
+
+    q->ring = ring;
+    q->ring_frame_size = frame_size;
+    q->ring_frames = frames;
+    q->ring_pos = 0;
+    DEBUG("Netlink ring for queue %d: %zu frames of %zu bytes", q->queue_num, frames, frame_size);
+    return true;
+}
+
+
+//Helper
+static void nfqueue_ring_release(struct nl_mmap_hdr* frame)
+{
+    atomic_thread_fence(memory_order_release);  //done with frame contents
+    frame->nm_status = NL_MMAP_STATUS_UNUSED;
+}
+
+
+//Helper
+//Return 1 on success, -1 on failure, 0 on timeout (if timeout_ms > 0) or data not ready
+static int nfqueue_receive_mmap(struct nf_queue* q, struct nf_buffer* buf, int64_t timeout_ms)
+{
+    if (buf->frame)
+    {
+        nfqueue_ring_release(buf->frame);
+        buf->frame = NULL;
+    }
+
+    for (;;)
+    {
+        struct nl_mmap_hdr* frame = (struct nl_mmap_hdr*)((char*)q->ring + q->ring_pos * q->ring_frame_size);
+        unsigned int status = __atomic_load_n(&frame->nm_status, __ATOMIC_ACQUIRE);
+        if (status == NL_MMAP_STATUS_VALID || status == NL_MMAP_STATUS_COPY || status == NL_MMAP_STATUS_SKIP)
+            q->ring_pos = (q->ring_pos + 1) % q->ring_frames;
+
+        if (status == NL_MMAP_STATUS_VALID)
+        {
+            if (frame->nm_len == 0)  //nothing to read
+            {
+                nfqueue_ring_release(frame);
+                continue;
+            }
+            buf->frame = frame;
+            buf->nlh = (struct nlmsghdr*)((char*)frame + NL_MMAP_HDRLEN);
+            buf->len = frame->nm_len;
+            return IO_READY;
+        }
+        if (status == NL_MMAP_STATUS_COPY)  //message did not fit in frame, read it from socket
+        {
+            nfqueue_ring_release(frame);
+            int len = mnl_socket_recvfrom(q->nl_socket, buf->data, RECV_BUF_LEN);
+            if (len < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return IO_NOTREADY;
+                if (errno == ENOBUFS)
+                {
+                    nfqueue_overrun(q);
+                    return IO_NOTREADY;
+                }
+                LOG_SYSERR("mnl_socket_recvfrom");
+                return IO_ERROR;
+            }
+            buf->nlh = (struct nlmsghdr*)buf->data;
+            buf->len = len;
+            return IO_READY;
+        }
+        if (status == NL_MMAP_STATUS_SKIP)
+        {
+            nfqueue_ring_release(frame);
+            continue;
+        }
+
+        //Frame is unused or being filled by kernel; wait for data
+        if (timeout_ms < 0)
+            return IO_NOTREADY;
+        int retval = recv_timeout(mnl_socket_get_fd(q->nl_socket), timeout_ms);
+        if (retval == 0 || (retval < 0 && errno == EINTR))
+            return IO_NOTREADY;
+        if (retval < 0)
+        {
+            LOG_SYSERR("recv_timeout");
+            return IO_ERROR;
+        }
+        timeout_ms = -1;  //check the frame once more, but do not wait again
+    }
+}
+
+
+/*
+Note about io_uring backend (NF_BACKEND_URING)
+
+The queue socket is read by a multishot recvmsg request, which stays armed and completes once per datagram into
+a buffer taken from a provided buffer ring (registered with the kernel, so there is no malloc per nf_buffer).
+nfqueue_receive() takes the next completion and makes nf_buffer refer to its buffer; the buffer is given back to
+the kernel on the next call with the same nf_buffer. Verdicts flushed with nfqueue_vq_flush() are copied to one of
+NF_URING_SEND_SLOTS send buffers and queued as sendmsg requests; they are submitted by the next nfqueue_receive(),
+together with waiting for data. A receive/process/verdict cycle thus costs at most one io_uring_enter() syscall,
+and none under load if uring_sqpoll is set (at the price of a kernel thread polling the submission queue).
+Other verdict functions send synchronously, as with other backends, but first wait until queued verdicts have been
+sent, so verdicts leave in the order they were issued (e.g. a batch verdict cannot overtake individual verdicts).
+If all send buffers are in flight, nfqueue_vq_flush() waits the same way and sends synchronously.
+Submission queue and send buffers are guarded by a spinlock, so verdicts may be flushed from any thread; only one
+thread may receive from the queue. A -ENOBUFS recvmsg completion is counted as overrun, unless all buffers are held
+by nf_buffers (the multishot request is then re-armed by the next nfqueue_receive()). nfqueue_fd() returns the io_uring descriptor, which is readable when
+completions are ready, so the queue can be used with event loops as usual.
+If io_uring is not available (kernel older than 6.0, or disabled by kernel.io_uring_disabled sysctl), the queue
+falls back to NF_BACKEND_RECVFROM.
+*/
+
+#ifdef NFQUEUE_MNL_URING
+
+#define NF_URING_BUFFERS     64
+#define NF_URING_SEND_SLOTS  4
+#define NF_URING_SEND_LEN    MNL_SOCKET_BUFFER_SIZE
+#define NF_URING_BUFFER_LEN  ((sizeof(struct io_uring_recvmsg_out) + RECV_BUF_LEN + 63) & ~(size_t)63)  //aligned stride
+#define NF_URING_RECV        ((uint64_t)1 << 32)  //user_data of receive completions; send completions carry the slot index
+#define NF_URING_WAKE        ((uint64_t)1 << 33)  //user_data of nop waking up the receiving thread
+
+struct nf_uring
+{
+    int                       fd;
+    bool                      sqpoll;
+    void*                     sq_ring;
+    size_t                    sq_ring_size;
+    void*                     cq_ring;
+    size_t                    cq_ring_size;
+    struct io_uring_sqe*      sqes;
+    size_t                    sqes_size;
+    unsigned*                 sq_head;
+    unsigned*                 sq_tail;
+    unsigned*                 sq_flags;
+    unsigned*                 sq_array;
+    unsigned                  sq_mask;
+    unsigned                  sq_entries;
+    unsigned*                 cq_head;
+    unsigned*                 cq_tail;
+    struct io_uring_cqe*      cqes;
+    unsigned                  cq_mask;
+    unsigned                  to_submit;  //SQEs queued but not yet submitted
+    struct io_uring_buf_ring* br;         //provided buffer ring
+    size_t                    br_size;
+    unsigned                  br_entries;
+    char*                     bufs;       //br_entries buffers of NF_URING_BUFFER_LEN bytes
+    size_t                    bufs_size;
+    int                       sock;
+    struct msghdr             recv_msg;   //template of multishot recvmsg (read by kernel on every completion)
+    bool                      armed;      //multishot recvmsg is active
+    bool                      received;   //any data has been received
+    unsigned                  held;       //buffers referenced by nf_buffers
+    char*                     send_bufs;  //NF_URING_SEND_SLOTS buffers of NF_URING_SEND_LEN bytes
+    struct iovec              send_iov[NF_URING_SEND_SLOTS];
+    struct msghdr             send_msg[NF_URING_SEND_SLOTS];
+    bool                      send_pending[NF_URING_SEND_SLOTS];
+    struct io_uring_cqe*      stash;      //receive completions reaped by other threads, taken by nfqueue_receive()
+    unsigned                  stash_head;
+    unsigned                  stash_tail;
+    unsigned                  stash_mask;
+    atomic_flag               lock;       //guards submission queue, completion queue, stash and send slots
+};
+
+
+//Helper
+static void nf_uring_lock(struct nf_uring* u)
+{
+    while (atomic_flag_test_and_set_explicit(&u->lock, memory_order_acquire))
+        sched_yield();
+}
+
+
+//Helper
+static void nf_uring_unlock(struct nf_uring* u)
+{
+    atomic_flag_clear_explicit(&u->lock, memory_order_release);
+}
+
+
+//Helper
+static struct io_uring_sqe* nf_uring_get_sqe(struct nf_uring* u)
+{
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+        return NULL;
+    unsigned index = tail & u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+
+//Helper
+static void nf_uring_commit_sqe(struct nf_uring* u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+
+//Helper
+//Return 1 on success, 0 on timeout or signal, -1 on failure
+//Submit queued SQEs and wait until min_complete new completions are posted, at most timeout_ms (zero means
+//indefinitely). Called with the lock held; the lock is released while waiting.
+static int nf_uring_enter(struct nf_uring* u, unsigned min_complete, int64_t timeout_ms)
+{
+    unsigned flags = 0;
+    if (u->sqpoll)
+    {
+        atomic_thread_fence(memory_order_seq_cst);  //order tail store before reading flags
+        if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        u->to_submit = 0;  //submitted by kernel thread
+    }
+    if (min_complete == 0 && u->to_submit == 0 && flags == 0)
+        return 1;
+
+    struct __kernel_timespec ts =
+    {
+        .tv_sec  = timeout_ms/1000,
+        .tv_nsec = (timeout_ms%1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg =
+    {
+        .ts = (uint64_t)(uintptr_t)&ts,
+    };
+    void* argp = NULL;
+    size_t argsz = 0;
+    if (min_complete > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms > 0)
+        {
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+
+    //SQEs committed meanwhile by other threads are submitted by their own call; the kernel takes them in order
+    unsigned to_submit = u->to_submit;
+    u->to_submit = 0;
+    if (min_complete > 0)
+        nf_uring_unlock(u);
+    int ret = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, argp, argsz);
+    int err = errno;
+    if (min_complete > 0)
+        nf_uring_lock(u);
+    if (ret < 0)
+    {
+        if (!u->sqpoll)
+            u->to_submit += to_submit;
+        errno = err;
+        if (errno == ETIME || errno == EINTR)
+            return 0;
+        LOG_SYSERR("io_uring_enter");
+        return -1;
+    }
+    if (!u->sqpoll && (unsigned)ret < to_submit)
+        u->to_submit += to_submit - (unsigned)ret;
+    return 1;
+}
+
+
+//Helper
+static bool nf_uring_cq_ready(struct nf_uring* u)
+{
+    return *u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+
+//Helper
+//Give buffer back to the kernel
+static void nf_uring_recycle(struct nf_uring* u, uint16_t bid)
+{
+    unsigned short tail = u->br->tail;
+    struct io_uring_buf* b = &u->br->bufs[tail & (u->br_entries - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * NF_URING_BUFFER_LEN);
+    b->len = NF_URING_BUFFER_LEN;
+    b->bid = bid;
+    __atomic_store_n(&u->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+
+//Helper
+static void nf_uring_free(struct nf_uring* u)
+{
+    if (u->fd >= 0)
+        close(u->fd);  //cancels requests and unregisters buffer ring
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->br)
+        munmap(u->br, u->br_size);
+    if (u->bufs)
+        munmap(u->bufs, u->bufs_size);
+    free(u->send_bufs);
+    free(u->stash);
+    free(u);
+}
+
+
+//Helper
+//Return false if io_uring is not supported; the socket is then usable as before
+static bool nfqueue_uring_setup(struct nf_queue* q, const struct nf_queue_options* opt)
+{
+    unsigned entries = opt->uring_buffers > 0? opt->uring_buffers : NF_URING_BUFFERS;
+    if (entries > 32768)
+        entries = 32768;
+    unsigned br_entries = 1;
+    while (br_entries < entries)
+        br_entries <<= 1;
+
+    struct nf_uring* u = calloc(1, sizeof(struct nf_uring));
+    ASSERT(u != NULL);
+    u->fd = -1;
+    u->sock = mnl_socket_get_fd(q->nl_socket);
+    atomic_flag_clear(&u->lock);
+
+    //Completion queue must hold a completion for every buffer, otherwise multishot recvmsg stops on overflow
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * br_entries;
+    if (opt->uring_sqpoll)
+    {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 100;  //ms
+        u->sqpoll = true;
+    }
+    if ((u->fd = syscall(__NR_io_uring_setup, 2 * NF_URING_SEND_SLOTS, &params)) < 0)
+    {
+        LOG_SYSERR("io_uring_setup");
+        goto fail;
+    }
+
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        u->sq_ring = NULL;
+        LOG_SYSERR("mmap");
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ring = u->sq_ring;
+    else
+    {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+        {
+            u->cq_ring = NULL;
+            LOG_SYSERR("mmap");
+            goto fail;
+        }
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        LOG_SYSERR("mmap");
+        goto fail;
+    }
+
+    char* sq = u->sq_ring;
+    char* cq = u->cq_ring;
+    u->sq_head = (unsigned*)(sq + params.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    u->sq_flags = (unsigned*)(sq + params.sq_off.flags);
+    u->sq_array = (unsigned*)(sq + params.sq_off.array);
+    u->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    u->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    u->cq_head = (unsigned*)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    u->stash = malloc(params.cq_entries * sizeof(struct io_uring_cqe));
+    ASSERT(u->stash != NULL);
+    u->stash_mask = params.cq_entries - 1;  //power of 2
+
+    //Provided buffer ring and its buffers
+    u->br_entries = br_entries;
+    u->br_size = br_entries * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs_size = br_entries * NF_URING_BUFFER_LEN;
+    u->bufs = mmap(NULL, u->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED || u->bufs == MAP_FAILED)
+    {
+        if (u->br == MAP_FAILED)
+            u->br = NULL;
+        if (u->bufs == MAP_FAILED)
+            u->bufs = NULL;
+        LOG_SYSERR("mmap");
+        goto fail;
+    }
+    struct io_uring_buf_reg reg =
+    {
+        .ring_addr = (uint64_t)(uintptr_t)u->br,
+        .ring_entries = br_entries,
+        .bgid = 0,
+    };
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOG_SYSERR("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        goto fail;
+    }
+    for (unsigned i = 0; i < br_entries; i++)
+        nf_uring_recycle(u, i);
+
+    //Datagrams are received without source address and control data, i.e. buffer holds io_uring_recvmsg_out
+    //followed by the payload
+    memset(&u->recv_msg, 0, sizeof(u->recv_msg));
+
+    u->send_bufs = malloc(NF_URING_SEND_SLOTS * NF_URING_SEND_LEN);
+    ASSERT(u->send_bufs != NULL);
+    for (int i = 0; i < NF_URING_SEND_SLOTS; i++)
+    {
+        u->send_iov[i].iov_base = u->send_bufs + i * NF_URING_SEND_LEN;
+        memset(&u->send_msg[i], 0, sizeof(struct msghdr));
+        u->send_msg[i].msg_iov = &u->send_iov[i];
+        u->send_msg[i].msg_iovlen = 1;
+    }
+
+    q->uring = u;
+    DEBUG("io_uring for queue %d: %u buffers%s", q->queue_num, br_entries, u->sqpoll? ", SQPOLL" : "");
+    return true;
+
+fail:
+    nf_uring_free(u);
+    return false;
+}
+
+
+//Helper
+//Move completions to the stash, handling send completions on the way. Called with the lock held.
+static void nf_uring_reap(struct nf_queue* q)
+{
+    struct nf_uring* u = q->uring;
+    while (nf_uring_cq_ready(u))
+    {
+        unsigned head = *u->cq_head;
+        struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+        if (cqe->user_data == NF_URING_RECV)
+        {
+            ASSERT(u->stash_tail - u->stash_head <= u->stash_mask);  //stash is as large as completion queue
+            u->stash[u->stash_tail++ & u->stash_mask] = *cqe;
+        }
+        else if (cqe->user_data < NF_URING_SEND_SLOTS)
+        {
+            u->send_pending[cqe->user_data] = false;
+            if (cqe->res < 0)
+            {
+                LOG_RATELIMIT(LOG_ERR, 1000, "io_uring sendmsg: %s", strerror(-cqe->res));
+                nfqueue_stats_add(&nfqueue_stats_shard(q)->verdict_errors, 1);
+            }
+        }
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+//Helper
+static bool nf_uring_sends_pending(struct nf_uring* u)
+{
+    for (int i = 0; i < NF_URING_SEND_SLOTS; i++)
+        if (u->send_pending[i])
+            return true;
+    return false;
+}
+
+
+//Helper
+//Return false on failure
+//Submit queued verdicts and wait until they have been sent. Called with the lock held.
+static bool nf_uring_wait_sends(struct nf_queue* q)
+{
+    struct nf_uring* u = q->uring;
+    unsigned stashed = u->stash_tail;
+    bool ok = true;
+    while (ok && nf_uring_sends_pending(u))
+    {
+        if (nf_uring_enter(u, 0, 0) < 0)
+            ok = false;
+        nf_uring_reap(q);
+        if (ok && nf_uring_sends_pending(u))
+            ok = nf_uring_enter(u, 1, 1) >= 0;
+    }
+
+    //Receiving thread may be waiting for completions that were stashed here
+    struct io_uring_sqe* sqe;
+    if (u->stash_tail != stashed && (sqe = nf_uring_get_sqe(u)) != NULL)
+    {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = NF_URING_WAKE;
+        nf_uring_commit_sqe(u);
+        if (nf_uring_enter(u, 0, 0) < 0)
+            ok = false;
+    }
+    return ok;
+}
+
+
+//Helper
+//Return false on failure
+//Wait until verdicts queued on io_uring have been sent, so that a verdict sent synchronously does not overtake them
+static bool nf_uring_sync(struct nf_queue* q)
+{
+    nf_uring_lock(q->uring);
+    bool ok = nf_uring_wait_sends(q);
+    nf_uring_unlock(q->uring);
+    return ok;
+}
+
+
+//Helper
+//Return false on failure
+//Queue verdict messages for sending; they are submitted by the next nfqueue_receive()
+//If all send slots are in flight or the message does not fit, wait for them and send synchronously
+static bool nfqueue_uring_send(struct nf_queue* q, const void* data, size_t len)
+{
+    struct nf_uring* u = q->uring;
+    nf_uring_lock(u);
+    int slot = 0;
+    while (slot < NF_URING_SEND_SLOTS && u->send_pending[slot])
+        slot++;
+    struct io_uring_sqe* sqe;
+    if (slot == NF_URING_SEND_SLOTS || len > (size_t)NF_URING_SEND_LEN || (sqe = nf_uring_get_sqe(u)) == NULL)
+    {
+        bool ok = nf_uring_wait_sends(q);
+        if (ok && mnl_socket_sendto(q->nl_socket, data, len) < 0)
+        {
+            LOG_SYSERR("mnl_socket_sendto");
+            ok = false;
+        }
+        nf_uring_unlock(u);
+        return ok;
+    }
+
+    memcpy(u->send_iov[slot].iov_base, data, len);
+    u->send_iov[slot].iov_len = len;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = u->sock;
+    sqe->addr = (uint64_t)(uintptr_t)&u->send_msg[slot];
+    sqe->len = 1;
+    sqe->user_data = slot;
+    nf_uring_commit_sqe(u);
+    u->send_pending[slot] = true;
+    bool ok = !u->sqpoll || nf_uring_enter(u, 0, 0) >= 0;  //wake up kernel thread if needed
+    nf_uring_unlock(u);
+    return ok;
+}
+
+
+//Helper
+//Return 1 on success, -1 on failure, 0 on timeout (if timeout_ms > 0) or data not ready
+static int nfqueue_receive_uring(struct nf_queue* q, struct nf_buffer* buf, int64_t timeout_ms)
+{
+    struct nf_uring* u = q->uring;
+    nf_uring_lock(u);
+    unsigned recycled = 0;  //buffers given back by this call
+    if (buf->uring)
     {
-        .tv_sec  = timeout_ms/1000,
-        .tv_nsec = (timeout_ms%1000) * 1000000
-    };
-    int retval = pselect(fd + 1, &rset, NULL, NULL, timeout_ms > 0? &ts : NULL, NULL);
-    if (retval == -1 && errno == EINTR)  //signal
-        return 0;  //no data
-    else
-        return retval;  // >0 if descriptor is readable
+        nf_uring_recycle(buf->uring, buf->uring_bid);
+        buf->uring = NULL;
+        u->held--;
+        recycled++;
+    }
+
+    int ret;
+    bool fallback = false;
+    bool waited = false;
+    for (;;)
+    {
+        if (!u->armed)
+        {
+            //Submission queue may still be full if the SQPOLL thread has not caught up; submit and retry once,
+            //otherwise the next call re-arms
+            struct io_uring_sqe* sqe = nf_uring_get_sqe(u);
+            if (sqe == NULL)
+            {
+                if (nf_uring_enter(u, 0, 0) < 0)
+                {
+                    ret = IO_ERROR;
+                    goto out;
+                }
+                if ((sqe = nf_uring_get_sqe(u)) == NULL)
+                {
+                    ret = IO_NOTREADY;
+                    goto out;
+                }
+            }
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = u->sock;
+            sqe->addr = (uint64_t)(uintptr_t)&u->recv_msg;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->user_data = NF_URING_RECV;
+            nf_uring_commit_sqe(u);
+            u->armed = true;
+        }
+
+        //Pending verdicts must not wait until completion queue is drained
+        if (u->to_submit > 0 && (nf_uring_cq_ready(u) || u->stash_head != u->stash_tail) && nf_uring_enter(u, 0, 0) < 0)
+        {
+            ret = IO_ERROR;
+            goto out;
+        }
+
+        nf_uring_reap(q);
+        while (u->stash_head != u->stash_tail)
+        {
+            struct io_uring_cqe cqe = u->stash[u->stash_head++ & u->stash_mask];
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                u->armed = false;
+            if (cqe.res < 0)
+            {
+                if (cqe.res == -ENOBUFS)
+                {
+                    //Either no provided buffer was left, or socket overrun. Buffers given back by earlier calls after
+                    //the failure are not known, so exhaustion may be reported as overrun, but not vice versa.
+                    if (u->held + recycled >= u->br_entries)
+                        LOG_RATELIMIT(LOG_WARNING, 1000, "All %u io_uring buffers of queue %d are held by nf_buffers", u->br_entries, q->queue_num);
+                    else
+                        nfqueue_overrun(q);
+                    ret = IO_NOTREADY;
+                    goto out;
+                }
+                if (!u->received && (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP))
+                {
+                    fallback = true;
+                    ret = IO_NOTREADY;
+                    goto out;
+                }
+                errno = -cqe.res;
+                LOG_SYSERR("io_uring recvmsg");
+                ret = IO_ERROR;
+                goto out;
+            }
+
+            u->received = true;
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            char* data = u->bufs + (size_t)bid * NF_URING_BUFFER_LEN;
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)data;
+            if (out->flags & MSG_TRUNC)
+                LOG(LOG_ERR, "Netlink message truncated (length=%u)", out->payloadlen);
+            if (out->payloadlen == 0)
+            {
+                nf_uring_recycle(u, bid);
+                recycled++;
+                continue;
+            }
+            buf->uring = u;
+            buf->uring_bid = bid;
+            buf->nlh = (struct nlmsghdr*)(data + sizeof(struct io_uring_recvmsg_out));
+            buf->len = out->payloadlen;
+            u->held++;
+            DEBUG("Received data from netfilter (length=%d)", buf->len);
+            ret = IO_READY;
+            goto out;
+        }
+
+        if (waited || !u->armed)
+        {
+            if (waited)
+            {
+                ret = IO_NOTREADY;
+                goto out;
+            }
+            continue;  //re-arm
+        }
+        waited = true;
+        if (nf_uring_enter(u, timeout_ms >= 0? 1 : 0, timeout_ms) < 0)
+        {
+            ret = IO_ERROR;
+            goto out;
+        }
+    }
+
+out:
+    nf_uring_unlock(u);
+    if (fallback)
+    {
+        LOG(LOG_WARNING, "Multishot recvmsg not supported, using recvfrom for queue %d", q->queue_num);
+        nf_uring_free(u);
+        q->uring = NULL;
+        q->backend = NF_BACKEND_RECVFROM;
+        if (buf->data == NULL)
+        {
+            buf->data = malloc(RECV_BUF_LEN);
+            ASSERT(buf->data != NULL);
+        }
+    }
+    return ret;
+}
+
+#endif //NFQUEUE_MNL_URING
+
+
+//Helper
+//Return false on failure
+//Verdicts that are sent synchronously must not overtake verdicts queued on io_uring (see note)
+static bool nfqueue_verdict_order(struct nf_queue* q)
+{
+#ifdef NFQUEUE_MNL_URING
+    if (q->uring && !nf_uring_sync(q))
+    {
+        nfqueue_stats_add(&nfqueue_stats_shard(q)->verdict_errors, 1);
+        return false;
+    }
+#endif
+    (void)q;
+    return true;
 }
 
 
 /*
-Workaround for mnl_socket_open2() missing from libmnl.h and libmnl.so
-Function has been added only in 2015 and Ubuntu 16.04 does not have it.
+Workaround for mnl_socket_open2() and mnl_socket_fdopen() missing from libmnl.h and libmnl.so
+Functions have been added only in 2015 and Ubuntu 16.04 does not have them.
 libmnl-dev 1.0.4 in Ubuntu 18.04 has it.
 Source: https://git.netfilter.org/libmnl/tree/src/socket.c
 See https://patchwork.ozlabs.org/patch/525782/
@@ -801,9 +3022,59 @@ static struct mnl_socket* mnl_socket_open2(int bus, int flags)
     return nl;
 }
 
+static struct mnl_socket* mnl_socket_fdopen(int fd)
+{
+    struct mnl_socket *nl;
+    nl = calloc(1, sizeof(struct mnl_socket));
+    if (nl == NULL)
+        return NULL;
+    socklen_t addr_len = sizeof(nl->addr);
+    if (getsockname(fd, (struct sockaddr*)&nl->addr, &addr_len) == -1)
+    {
+        free(nl);
+        return NULL;
+    }
+    nl->fd = fd;
+    return nl;
+}
+
 #endif  //HAVE_MNL_SOCKET_OPEN2
 
 
+//Helper
+//Set up the requested backend on an open socket, falling back to NF_BACKEND_RECVFROM
+static void nfqueue_backend_setup(struct nf_queue* q, const struct nf_queue_options* opt)
+{
+    q->backend = NF_BACKEND_RECVFROM;
+    if (opt->backend == NF_BACKEND_MMAP)
+    {
+        if (nfqueue_ring_setup(q, opt))
+            q->backend = NF_BACKEND_MMAP;
+        else
+            LOG(LOG_WARNING, "Memory-mapped netlink not supported, using recvfrom for queue %d", q->queue_num);
+    }
+    else if (opt->backend == NF_BACKEND_URING)
+    {
+#ifdef NFQUEUE_MNL_URING
+        if (nfqueue_uring_setup(q, opt))
+            q->backend = NF_BACKEND_URING;
+        else
+#endif
+            LOG(LOG_WARNING, "io_uring not supported, using recvfrom for queue %d", q->queue_num);
+    }
+}
+
+
+//Helper
+//Allocate zeroed statistics shards of a queue
+static void nfqueue_stats_alloc(struct nf_queue* q)
+{
+    q->stats = aligned_alloc(CACHELINE_SIZE, NF_STATS_SHARDS * sizeof(struct nf_stats_shard));
+    ASSERT(q->stats != NULL);
+    memset(q->stats, 0, NF_STATS_SHARDS * sizeof(struct nf_stats_shard));
+}
+
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Public interface
 
@@ -839,37 +3110,108 @@ every thread calling nfqueue_receive() and nfqueue_next() should use its own nf_
 from nf_queue we allow for multi-threaded access to the netfilter queue.
 Note that nfqueue_next() copies the payload from nf_buffer to packet object, thus nf_buffer can be reused in
 nfqueue_receive() while packet object is being processed by another thread.
+This is not the case in zero-copy mode (see below).
+Lock-free rings for handing packets to worker threads, and verdicts back, are in nfqueue-mnl-ring.h.
+*/
+
+/*
+Note about zero-copy mode
+
+When nf_buffer.zero_copy is set, nfqueue_next() does not copy payloads; packet->payload points into nf_buffer
+data instead. Such payload is valid only until the next nfqueue_receive() on the same buffer, and must not be
+freed. A packet that needs to outlive the buffer (e.g. is handed over to another thread) should be detached with
+nfqueue_packet_detach(), which copies its payload (and loads fields skipped by nfqueue_next(), which also refer
+to the buffer). nfqueue_packet_free() releases payload in either mode.
+When NFQUEUE_MNL_DEBUG is defined, nfqueue_receive() overwrites the old buffer contents before receiving, and
+use of a stale payload view by nfqueue_packet_detach() is detected.
 */
 
 
+//Defaults: copy whole packets (up to 64 KiB), default queue length, conntrack info enabled
+void nfqueue_default_options(struct nf_queue_options* opt)
+{
+    ASSERT(opt);
+    memset(opt, 0, sizeof(*opt));
+    opt->queue_len = 0;
+    opt->copy_mode = NFQNL_COPY_PACKET;
+    opt->copy_range = 0xFFFF;
+    opt->flags = NFQA_CFG_F_CONNTRACK;
+    opt->rcvbuf = 0;
+    opt->no_enobufs = false;
+    opt->ext_ack = true;
+    opt->backend = NF_BACKEND_RECVFROM;
+    opt->ring_frame_size = 0;
+    opt->ring_frames = 0;
+    opt->uring_buffers = 0;
+    opt->uring_sqpoll = false;
+}
+
+
+void nfqueue_close(struct nf_queue* q)
+{
+    ASSERT(q);
+    ASSERT(q->nl_socket);
+    DEBUG("Closing socket for queue %d", q->queue_num);
+    if (q->ring)
+        munmap(q->ring, q->ring_frame_size * q->ring_frames);
+#ifdef NFQUEUE_MNL_URING
+    if (q->uring)
+    {
+        nf_uring_sync(q);  //send pending verdicts
+        nf_uring_free(q->uring);
+        q->uring = NULL;
+    }
+#endif
+    mnl_socket_close(q->nl_socket);  //nl_socket is freed here
+    free(q->stats);
+    q->stats = NULL;
+}
+
+
 //Return false on failure
-//If queue_len is zero, use default value
-bool nfqueue_open(struct nf_queue* q, int queue_num, uint32_t queue_len)
+//If opt is NULL, use defaults
+bool nfqueue_open2(struct nf_queue* q, int queue_num, const struct nf_queue_options* opt)
 {
+    struct nf_queue_options defaults;
+    if (opt == NULL)
+    {
+        nfqueue_default_options(&defaults);
+        opt = &defaults;
+    }
+
     memset(q, 0, sizeof(*q));
     q->queue_num = queue_num;
+    nfqueue_stats_alloc(q);
 
     DEBUG("Initializing nfqueue %d", queue_num);
 
 	if ((q->nl_socket = mnl_socket_open2(NETLINK_NETFILTER, SOCK_NONBLOCK)) == NULL)
     {
 		LOG_SYSERR("mnl_socket_open");
+        free(q->stats);
+        q->stats = NULL;
         return false;
 	}
 
 	if (mnl_socket_bind(q->nl_socket, 0, MNL_SOCKET_AUTOPID) < 0)
     {
 		LOG_SYSERR("mnl_socket_bind");
-		return false;
+		goto error;
 	}
 
+    if (!nfqueue_set_socket_options(q->nl_socket, opt))
+        goto error;
+
+    nfqueue_backend_setup(q, opt);
+
 	if (nfqueue_bind(q->nl_socket, queue_num) < 0)
     {
 		LOG_SYSERR("nfqueue_bind");
-		return false;
+		goto error;
 	}
 
-	DEBUG("Configuring nfqueue %d (len=%u)", queue_num, queue_len);
+	DEBUG("Configuring nfqueue %d (len=%u, mode=%u, range=%u, flags=%x)",
+        queue_num, opt->queue_len, opt->copy_mode, opt->copy_range, opt->flags);
 
     /*
     Note: For NFQA_CFG_F_CONNTRACK to be honored, modules nf_conntrack_ipv4 and nf_conntrack_ipv6 need to be loaded.
@@ -877,75 +3219,416 @@ bool nfqueue_open(struct nf_queue* q, int queue_num, uint32_t queue_len)
     In older kernels (e.g. 4.4) module nf_conntrack_netlink also needs to be loaded.
     In kernel 4.15 modprobe-only method is not sufficient, rule containing -m conntrack must be used.
     Otherwise conntrack info is not passed by kernel (both NFQA_CT and NFQA_CT_INFO attributes are missing).
+    If conntrack support is not available at all, kernel rejects the flag (EOPNOTSUPP) and the open fails.
     */
-	if (nfqueue_set_params(q->nl_socket, queue_num, NFQNL_COPY_PACKET, 0xFFFF, queue_len, NFQA_CFG_F_CONNTRACK) < 0)
+	if (nfqueue_set_params(q->nl_socket, queue_num, opt->copy_mode, opt->copy_range, opt->queue_len, opt->flags) < 0)
     {
 		LOG_SYSERR("nfqueue_set_params");
-		return false;
+		goto error;
 	}
 
-    DEBUG("nfqueue %d initialized", queue_num);
+    DEBUG("nfqueue %d initialized", queue_num);
+    return true;
+
+error:
+    nfqueue_close(q);  //releasing the socket unbinds the queue
+    return false;
+}
+
+
+//Return false on failure
+//If queue_len is zero, use default value
+bool nfqueue_open(struct nf_queue* q, int queue_num, uint32_t queue_len)
+{
+    struct nf_queue_options opt;
+    nfqueue_default_options(&opt);
+    opt.queue_len = queue_len;
+    return nfqueue_open2(q, queue_num, &opt);
+}
+
+
+//Return file descriptor of the netlink socket, for integration with external event loops
+//The socket is non-blocking; when it becomes readable, call nfqueue_receive() with negative timeout until it
+//returns IO_NOTREADY.
+//With NF_BACKEND_URING, return io_uring descriptor, which becomes readable when data has been received.
+int nfqueue_fd(const struct nf_queue* q)
+{
+    ASSERT(q);
+    ASSERT(q->nl_socket);
+#ifdef NFQUEUE_MNL_URING
+    if (q->uring)
+        return q->uring->fd;
+#endif
+    return mnl_socket_get_fd(q->nl_socket);
+}
+
+
+//Return number of socket buffer overruns (ENOBUFS) seen by nfqueue_receive() on this queue
+//Every overrun means that one or more packets were dropped by kernel; with fail-open flag they are accepted instead
+uint64_t nfqueue_overruns(struct nf_queue* q)
+{
+    ASSERT(q);
+    return atomic_load_explicit(&q->overruns, memory_order_relaxed);
+}
+
+
+//Return false on failure
+//connmark is uint64_t to allow full 32-bit unsigned integer and also -1 (meaning: don't set connmark)
+bool nfqueue_verdict(struct nf_queue* q, uint32_t packet_id, int verdict, int64_t connmark)
+{
+    ASSERT(q);
+
+    DEBUG("Sending verdict for packet %u: verdict: %d, connmark: %ld", packet_id, verdict, connmark);
+
+    if (!nfqueue_verdict_order(q))
+        return false;
+    if (nfqueue_send_verdict_connmark(q->nl_socket, q->queue_num, packet_id, verdict, connmark) < 0)
+    {
+        LOG_SYSERR("nfqueue_send_verdict_connmark");
+        nfqueue_stats_add(&nfqueue_stats_shard(q)->verdict_errors, 1);
+        return false;
+    }
+
+    DEBUG("Verdict for packet %u sent successfully", packet_id);
+    return true;
+}
+
+
+//Return false on failure
+//Send verdict with modified packet contents, gathered from iovcnt buffers (at most NF_PAYLOAD_IOV_MAX - 2)
+//Buffers are sent without copying; see note about checksums
+bool nfqueue_verdict_payload(struct nf_queue* q, uint32_t packet_id, int verdict, int64_t connmark, const struct iovec* iov, int iovcnt)
+{
+    ASSERT(q);
+    ASSERT(iov || iovcnt == 0);
+
+    DEBUG("Sending verdict with payload for packet %u: verdict: %d, connmark: %ld", packet_id, verdict, connmark);
+
+    if (!nfqueue_verdict_order(q))
+        return false;
+    if (nfqueue_send_verdict_payload(q->nl_socket, q->queue_num, packet_id, verdict, connmark, iov, iovcnt) < 0)
+    {
+        LOG_SYSERR("nfqueue_send_verdict_payload");
+        nfqueue_stats_add(&nfqueue_stats_shard(q)->verdict_errors, 1);
+        return false;
+    }
+    return true;
+}
+
+
+//Return false on failure
+//Send verdict with packet->payload (payload_len bytes), e.g. modified in place in zero-copy mode
+bool nfqueue_verdict_mangle(struct nf_queue* q, const struct nf_packet* packet, int verdict, int64_t connmark)
+{
+    ASSERT(packet);
+    ASSERT(packet->payload);
+    if (packet->payload_len < packet->orig_len)
+    {
+        LOG(LOG_ERR, "Cannot mangle truncated packet %u (see copy_range)", packet->packet_id);  //kernel would trim it
+        return false;
+    }
+    struct iovec iov =
+    {
+        .iov_base = packet->payload,
+        .iov_len = packet->payload_len,
+    };
+    return nfqueue_verdict_payload(q, packet->packet_id, verdict, connmark, &iov, 1);
+}
+
+
+//Return false on failure
+//Verdict is applied to all packets with id up to and including max_packet_id, that are still in the queue.
+//Packets that already received a verdict are not affected.
+bool nfqueue_verdict_batch(struct nf_queue* q, uint32_t max_packet_id, int verdict)
+{
+    ASSERT(q);
+
+    DEBUG("Sending batch verdict for packets up to %u: verdict: %d", max_packet_id, verdict);
+
+    if (!nfqueue_verdict_order(q))
+        return false;
+    if (nfqueue_send_verdict_batch(q->nl_socket, q->queue_num, max_packet_id, verdict) < 0)
+    {
+        LOG_SYSERR("nfqueue_send_verdict_batch");
+        nfqueue_stats_add(&nfqueue_stats_shard(q)->verdict_errors, 1);
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+Note about verdict accumulator
+
+Packets that get a plain ACCEPT verdict (no connmark) are not sent one by one, but remembered as a run, which is
+sent as a single batch verdict by nfqueue_batch_flush(), or automatically when the run reaches the limit.
+Packets with any other verdict, or with connmark set, are sent immediately with nfqueue_verdict(). This does
+not break the run, because such packets are no longer queued when the batch verdict is sent.
+Because a batch verdict covers all queued packets with lower ids, every packet received from the queue must
+get its verdict through the accumulator, in the order returned by nfqueue_next(). In particular, the accumulator
+cannot be used when packets from the same queue are handed over to other threads.
+The run should be flushed after the nfqueue_next() loop, so that packets are not held back until the next batch.
+
+    struct nf_verdict_batch batch[1];
+    nfqueue_batch_init(batch, nfqueue, 0);
+
+    while (...)
+    {
+        if (nfqueue_receive(nfqueue, buf, TIMEOUT) == IO_READY)
+        {
+            struct nf_packet packet[1];
+            while (nfqueue_next(buf, packet) == IO_READY)
+            {
+                nfqueue_batch_verdict(batch, packet->packet_id, decide(packet), -1);
+                free(packet->payload);
+            }
+            nfqueue_batch_flush(batch);
+        }
+    }
+*/
+
+
+//If limit is zero, the run is sent only by nfqueue_batch_flush()
+void nfqueue_batch_init(struct nf_verdict_batch* b, struct nf_queue* q, uint32_t limit)
+{
+    ASSERT(b);
+    ASSERT(q);
+    memset(b, 0, sizeof(*b));
+    b->q = q;
+    b->limit = limit;
+}
+
+
+//Return false on failure
+//Send pending ACCEPT run, if any
+bool nfqueue_batch_flush(struct nf_verdict_batch* b)
+{
+    ASSERT(b);
+    if (b->count == 0)
+        return true;
+
+    bool success = nfqueue_verdict_batch(b->q, b->max_id, NF_ACCEPT);
+    b->count = 0;
+    return success;
+}
+
+
+//Return false on failure
+//connmark is uint64_t to allow full 32-bit unsigned integer and also -1 (meaning: don't set connmark)
+bool nfqueue_batch_verdict(struct nf_verdict_batch* b, uint32_t packet_id, int verdict, int64_t connmark)
+{
+    ASSERT(b);
+
+    if (verdict != NF_ACCEPT || connmark >= 0)
+        return nfqueue_verdict(b->q, packet_id, verdict, connmark);
+
+    if (b->count == 0 || (int32_t)(packet_id - b->max_id) > 0)  //packet ids wrap around
+        b->max_id = packet_id;
+    b->count++;
+
+    if (b->limit > 0 && b->count >= b->limit)
+        return nfqueue_batch_flush(b);
+    return true;
+}
+
+
+/*
+Note about verdict queue
+
+Verdict messages pushed into nf_verdict_queue are concatenated in one buffer, which is sent to the kernel by a
+single send call (netlink processes all messages contained in a datagram). Messages do not request ACKs.
+Pending messages are sent when the buffer is full, when max_count messages are pending, or when the oldest message
+is older than max_delay microseconds; the latter is checked only by nfqueue_vq_push(), so the queue should be
+flushed after the nfqueue_next() loop anyway.
+Verdicts may differ between packets, e.g. carry different connmarks.
+*/
+
+
+//Return false on failure
+//If max_bytes is zero, SEND_BUF_LEN is used; max_count and max_delay_us equal to zero mean no limit
+bool nfqueue_vq_init(struct nf_verdict_queue* vq, struct nf_queue* q, size_t max_bytes, uint32_t max_count, int64_t max_delay_us)
+{
+    ASSERT(vq);
+    ASSERT(q);
+    memset(vq, 0, sizeof(*vq));
+    vq->q = q;
+    vq->size = max_bytes > 0? max_bytes : (size_t)SEND_BUF_LEN;
+    vq->max_count = max_count;
+    vq->max_delay = max_delay_us;
+    if (vq->size < CMD_BUF_LEN)
+    {
+        LOG(LOG_ERR, "Verdict queue size too small: %zu", vq->size);
+        return false;
+    }
+    vq->data = aligned_alloc(CACHELINE_SIZE, (vq->size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1));
+    ASSERT(vq->data != NULL);
+    return true;
+}
+
+
+void nfqueue_vq_free(struct nf_verdict_queue* vq)
+{
+    ASSERT(vq);
+    free(vq->data);
+    vq->data = NULL;
+}
+
+
+//Return false on failure
+//Pending messages are discarded on failure
+bool nfqueue_vq_flush(struct nf_verdict_queue* vq)
+{
+    ASSERT(vq);
+    ASSERT(vq->data);
+    if (vq->len == 0)
+        return true;
+
+    DEBUG("Sending %u verdicts (length=%zu)", vq->count, vq->len);
+
+#ifdef NFQUEUE_MNL_URING
+    if (vq->q->uring)
+    {
+        bool ok = nfqueue_uring_send(vq->q, vq->data, vq->len);
+        vq->len = 0;
+        vq->count = 0;
+        if (!ok)
+            nfqueue_stats_add(&nfqueue_stats_shard(vq->q)->verdict_errors, 1);
+        return ok;
+    }
+#endif
+    ssize_t ret = mnl_socket_sendto(vq->q->nl_socket, vq->data, vq->len);
+    vq->len = 0;
+    vq->count = 0;
+    if (ret < 0)
+    {
+        LOG_SYSERR("mnl_socket_sendto");
+        nfqueue_stats_add(&nfqueue_stats_shard(vq->q)->verdict_errors, 1);
+        return false;
+    }
     return true;
 }
 
 
-void nfqueue_close(struct nf_queue* q)
+//helper
+//Return false on failure
+static bool nfqueue_vq_put(struct nf_verdict_queue* vq, int type, uint32_t packet_id, int verdict, int64_t connmark)
 {
-    ASSERT(q);
-    ASSERT(q->nl_socket);
-    DEBUG("Closing socket for queue %d", q->queue_num);
-	mnl_socket_close(q->nl_socket);  //nl_socket is freed here
+    struct nlmsghdr* nlh = nfqueue_put_verdict_type((char*)vq->data + vq->len, vq->size - vq->len,
+                                                    vq->q->queue_num, type, packet_id, verdict, connmark);
+    if (nlh == NULL)  //buffer full
+    {
+        if (!nfqueue_vq_flush(vq))
+            return false;
+        nlh = nfqueue_put_verdict_type(vq->data, vq->size, vq->q->queue_num, type, packet_id, verdict, connmark);
+        ASSERT(nlh != NULL);
+    }
+
+    if (vq->count == 0 && vq->max_delay > 0)
+        clock_gettime(CLOCK_MONOTONIC, &vq->first);
+    vq->len += MNL_ALIGN(nlh->nlmsg_len);
+    vq->count++;
+
+    if (vq->max_count > 0 && vq->count >= vq->max_count)
+        return nfqueue_vq_flush(vq);
+
+    if (vq->max_delay > 0 && vq->count > 1)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t age_us = (now.tv_sec - vq->first.tv_sec) * 1000000 + (now.tv_nsec - vq->first.tv_nsec) / 1000;
+        if (age_us >= vq->max_delay)
+            return nfqueue_vq_flush(vq);
+    }
+    return true;
 }
 
 
 //Return false on failure
 //connmark is uint64_t to allow full 32-bit unsigned integer and also -1 (meaning: don't set connmark)
-bool nfqueue_verdict(struct nf_queue* q, uint32_t packet_id, int verdict, int64_t connmark)
+bool nfqueue_vq_push(struct nf_verdict_queue* vq, uint32_t packet_id, int verdict, int64_t connmark)
 {
-    ASSERT(q);
-
-    DEBUG("Sending verdict for packet %u: verdict: %d, connmark: %ld", packet_id, verdict, connmark);
+    ASSERT(vq);
+    ASSERT(vq->data);
+    return nfqueue_vq_put(vq, NFQNL_MSG_VERDICT, packet_id, verdict, connmark);
+}
 
-    if (nfqueue_send_verdict_connmark(q->nl_socket, q->queue_num, packet_id, verdict, connmark) < 0)
-    {
-        LOG_SYSERR("nfqueue_send_verdict_connmark");
-        return false;
-    }
 
-    DEBUG("Verdict for packet %u sent successfully", packet_id);
-    return true;
+//Return false on failure
+//Queue a batch verdict (see nfqueue_verdict_batch) behind the verdicts already queued; messages of a datagram are
+//handled by the kernel in order, so the batch cannot overtake them
+bool nfqueue_vq_push_batch(struct nf_verdict_queue* vq, uint32_t max_packet_id, int verdict)
+{
+    ASSERT(vq);
+    ASSERT(vq->data);
+    return nfqueue_vq_put(vq, NFQNL_MSG_VERDICT_BATCH, max_packet_id, verdict, -1);
 }
 
 
 //Return 1 on success, -1 on failure, 0 on timeout (if timeout_ms > 0) or data not ready
+//If timeout_ms is negative, do not wait for data (for use with external event loops, see nfqueue_fd())
 int nfqueue_receive(struct nf_queue* q, struct nf_buffer* buf, int64_t timeout_ms)
 {
     ASSERT(q);
     ASSERT(q->nl_socket);
     ASSERT(buf);
 
+    //Invalidate payload views into the previous contents of the buffer
+    buf->generation++;
+    buf->stats = nfqueue_stats_shard(q);
+
+#ifdef NFQUEUE_MNL_URING
+    if (q->backend == NF_BACKEND_URING)  //receives into provided buffers, data is not used
+    {
+        int ret = nfqueue_receive_uring(q, buf, timeout_ms);
+        if (ret == IO_READY)
+            nfqueue_stats_add(&buf->stats->batches, 1);
+        if (ret == IO_READY && (buf->timestamps & NF_TS_CLOCK_MASK) == NF_TS_BATCH)
+            read_clocks(NF_TS_PRECISE, &buf->batch_mono, &buf->batch_wall);
+        return ret;
+    }
+#endif
+
     if (buf->data == NULL)
     {
         buf->data = malloc(RECV_BUF_LEN);
         ASSERT(buf->data != NULL);
     }
+#ifdef NFQUEUE_MNL_DEBUG
+    if (buf->zero_copy)
+        memset(buf->data, 0xA5, RECV_BUF_LEN);
+#endif
 
-    //Note: We execute recv_timeout() when timeout_ms is zero, because we had set SOCK_NONBLOCK when opening the socket.
-    //recv_timeout() with zero timeout blocks until data becomes available.
-    int retval = recv_timeout(mnl_socket_get_fd(q->nl_socket), timeout_ms);
-    if (retval == 0)  //timeout
+    if (q->backend == NF_BACKEND_MMAP)
     {
-        DEBUG("Netlink socket timeout");
-        return IO_NOTREADY;
+        int ret = nfqueue_receive_mmap(q, buf, timeout_ms);
+        if (ret == IO_READY)
+            nfqueue_stats_add(&buf->stats->batches, 1);
+        if (ret == IO_READY && (buf->timestamps & NF_TS_CLOCK_MASK) == NF_TS_BATCH)
+            read_clocks(NF_TS_PRECISE, &buf->batch_mono, &buf->batch_wall);
+        return ret;
     }
-    else if (retval < 1)  //error
+
+    //Note: We execute recv_timeout() when timeout_ms is zero, because we had set SOCK_NONBLOCK when opening the socket.
+    //recv_timeout() with zero timeout blocks until data becomes available.
+    //With negative timeout_ms caller knows that the socket is readable (or polls it), so we save the syscall.
+    if (timeout_ms >= 0)
     {
-        if (errno == EINTR)
+        int retval = recv_timeout(mnl_socket_get_fd(q->nl_socket), timeout_ms);
+        if (retval == 0)  //timeout
+        {
+            DEBUG("Netlink socket timeout");
             return IO_NOTREADY;
-        LOG_SYSERR("recv_timeout");
-        return IO_ERROR;
+        }
+        else if (retval < 1)  //error
+        {
+            if (errno == EINTR)
+                return IO_NOTREADY;
+            LOG_SYSERR("recv_timeout");
+            return IO_ERROR;
+        }
+        //else data is ready
     }
-    //else data is ready
 
     int len = mnl_socket_recvfrom(q->nl_socket, buf->data, RECV_BUF_LEN);
     if (len < 0)
@@ -955,6 +3638,11 @@ int nfqueue_receive(struct nf_queue* q, struct nf_buffer* buf, int64_t timeout_m
             DEBUG("No data from Netlink socket");
             return IO_NOTREADY;
         }
+        else if (errno == ENOBUFS)  //overrun, not fatal
+        {
+            nfqueue_overrun(q);
+            return IO_NOTREADY;
+        }
         else
         {
             LOG_SYSERR("mnl_socket_recvfrom");
@@ -969,16 +3657,36 @@ int nfqueue_receive(struct nf_queue* q, struct nf_buffer* buf, int64_t timeout_m
 
     buf->len = len;
     buf->nlh = (struct nlmsghdr*)buf->data;
+    nfqueue_stats_add(&buf->stats->batches, 1);
+    if ((buf->timestamps & NF_TS_CLOCK_MASK) == NF_TS_BATCH)
+        read_clocks(NF_TS_PRECISE, &buf->batch_mono, &buf->batch_wall);
     DEBUG("Received data from netfilter (length=%d)", len);
     return IO_READY;
 }
 
 
+//helper
+//Control message; errors are reported e.g. for config commands not supported by kernel
+static void nfqueue_control_msg(const struct nlmsghdr* nlh)
+{
+    if (nlh->nlmsg_type == NLMSG_ERROR)
+    {
+        struct nlmsgerr* err = mnl_nlmsg_get_payload(nlh);
+        if (mnl_nlmsg_get_payload_len(nlh) >= sizeof(struct nlmsgerr) && err->error != 0)
+        {
+            const char* msg = nlmsg_ext_ack_msg(nlh);
+            errno = -err->error;
+            LOG_SYSERR("Netlink error (message type %x)%s%s", err->msg.nlmsg_type, msg? ": " : "", msg? msg : "");
+        }
+    }
+}
+
+
 //Return 1 on success (result in packet), -1 on failure, 0 on no more data
 int nfqueue_next(struct nf_buffer* buf, struct nf_packet* packet)
 {
     ASSERT(buf);
-    ASSERT(buf->data);
+    ASSERT(buf->nlh);
     ASSERT(packet);
 
     while (mnl_nlmsg_ok(buf->nlh, buf->len))
@@ -991,13 +3699,475 @@ int nfqueue_next(struct nf_buffer* buf, struct nf_packet* packet)
 
         if (buf->nlh->nlmsg_type >= NLMSG_MIN_TYPE)
         {
-            if (!nfqueue_parse(buf->nlh, packet))
+            if (!nfqueue_parse(buf->nlh, packet, buf))
+            {
+                if (buf->stats)
+                    nfqueue_stats_add(&buf->stats->parse_errors, 1);
                 return IO_ERROR;
+            }
+            packet->buffer = buf;
+            packet->generation = buf->generation;
             buf->nlh = mnl_nlmsg_next(buf->nlh, &buf->len);
+            if (buf->stats)
+            {
+                nfqueue_stats_add(&buf->stats->packets, 1);
+                nfqueue_stats_add(&buf->stats->bytes, packet->orig_len);
+            }
             return IO_READY;
         }
+
+        nfqueue_control_msg(buf->nlh);
+        buf->nlh = mnl_nlmsg_next(buf->nlh, &buf->len);
+    }
+
+    return IO_NOTREADY;
+}
+
+
+//Return false on failure
+//Parse packet data that has been skipped by nfqueue_next() (fields: NF_SKIP_* flags)
+//Must be called before the buffer the packet was parsed from is reused, i.e. before the next nfqueue_receive().
+//Note that wall_time and mono_time are taken at the time of this call.
+bool nfqueue_packet_load(struct nf_packet* packet, uint32_t fields)
+{
+    ASSERT(packet);
+    if (fields & NF_SKIP_CONNTRACK)
+        fields |= NF_SKIP_REPLY;
+    fields &= packet->skipped;
+    if (fields == 0)
+        return true;
+    if (packet->buffer == NULL)
+    {
+        LOG(LOG_ERR, "Packet %u has been detached from its buffer, skipped data cannot be loaded", packet->packet_id);
+        return false;
+    }
+    DEBUG_ASSERT(packet->buffer->generation == packet->generation);
+
+    if ((fields & NF_SKIP_PAYLOAD) && packet->raw_payload)
+        if (!nfqueue_parse_payload(packet->raw_payload, packet, packet->buffer))
+            return false;
+    if (fields & NF_SKIP_TIMESTAMP)
+        nfqueue_parse_timestamp(packet->raw_timestamp, packet, packet->buffer);
+    if ((fields & (NF_SKIP_CONNTRACK | NF_SKIP_REPLY)) && packet->raw_ct)
+    {
+        bool main = fields & NF_SKIP_CONNTRACK;
+        bool reply = fields & NF_SKIP_REPLY;
+        if (!nfqueue_parse_conntrack(packet->raw_ct, packet, main, reply))
+            return false;
+    }
+
+    packet->skipped &= ~fields;
+    return true;
+}
+
+
+//Return false on failure
+//Make packet independent of nf_buffer, so that it remains valid after the buffer is reused: fields skipped by
+//nfqueue_next() are loaded, and payload of a zero-copy packet is copied
+bool nfqueue_packet_detach(struct nf_packet* packet)
+{
+    ASSERT(packet);
+    if (packet->skipped && packet->buffer && !nfqueue_packet_load(packet, packet->skipped))
+        return false;
+    packet->skipped = 0;
+    packet->raw_payload = NULL;
+    packet->raw_timestamp = NULL;
+    packet->raw_ct = NULL;
+    if (!packet->payload_view)
+    {
+        packet->buffer = NULL;
+        return true;
+    }
+    DEBUG_ASSERT(packet->buffer != NULL && packet->buffer->generation == packet->generation);
+
+    const struct nf_allocator* allocator = packet->buffer? packet->buffer->allocator : NULL;
+    void* payload = allocator? allocator->alloc(allocator->ctx, packet->payload_len) : malloc(packet->payload_len);
+    if (payload == NULL)
+    {
+        LOG_SYSERR("malloc");
+        return false;
+    }
+    memcpy(payload, packet->payload, packet->payload_len);
+    packet->payload = payload;
+    packet->allocator = allocator;
+    packet->payload_view = false;
+    packet->buffer = NULL;
+    return true;
+}
+
+
+//Release packet payload, unless it points into nf_buffer
+//May be called from any thread
+void nfqueue_packet_free(struct nf_packet* packet)
+{
+    ASSERT(packet);
+    if (packet->payload_view)
+        ;  //nothing to free
+    else if (packet->allocator)
+        packet->allocator->free(packet->allocator->ctx, packet->payload);
+    else
+        free(packet->payload);
+    packet->payload = NULL;
+}
+
+
+/*
+Note about packet descriptors
+
+nf_packet is large (conntrack tuples, two timespecs, pointers for deferred parsing), and nfqueue_next() clears and
+fills it for every packet. nfqueue_next_batch() instead fills an array of 64-byte nf_packet_desc for all packets of
+the buffer in one call: packet id, lengths, payload offset, conntrack id/mark/status, flags and one timestamp,
+read once per call. Payload is not copied; nfqueue_desc_payload() returns a view into the buffer, valid until the
+next nfqueue_receive() on it (as in zero-copy mode). nfqueue_desc_packet() parses the message again into the full
+nf_packet (tuples, kernel timestamp, payload copy unless zero_copy is set), for the packets that need it.
+
+    struct nf_desc_batch batch[1];
+    nfqueue_desc_batch_init(batch, 256);
+    ...
+    if (nfqueue_receive(q, buf, TIMEOUT) == IO_READY)
+        while (nfqueue_next_batch(buf, batch) == IO_READY)
+            for (uint32_t i = 0; i < batch->count; i++)
+                nfqueue_vq_push(vq, batch->descs[i].packet_id, decide(nfqueue_desc_payload(batch, &batch->descs[i])), -1);
+*/
+
+
+//Return false on failure
+bool nfqueue_desc_batch_init(struct nf_desc_batch* b, uint32_t capacity)
+{
+    ASSERT(b);
+    ASSERT(capacity > 0);
+    memset(b, 0, sizeof(*b));
+    b->descs = aligned_alloc(CACHELINE_SIZE, (size_t)capacity * sizeof(struct nf_packet_desc));
+    if (b->descs == NULL)
+    {
+        LOG_SYSERR("aligned_alloc");
+        return false;
+    }
+    b->capacity = capacity;
+    return true;
+}
+
+
+void nfqueue_desc_batch_free(struct nf_desc_batch* b)
+{
+    ASSERT(b);
+    free(b->descs);
+    b->descs = NULL;
+    b->count = b->capacity = 0;
+}
+
+
+//Return 1 if any descriptors were filled (b->count), 0 on end of data, -1 on failure
+//Fill up to b->capacity descriptors from the buffer; call again while it returns 1
+//A message that cannot be parsed ends the batch; the next call then returns -1
+int nfqueue_next_batch(struct nf_buffer* buf, struct nf_desc_batch* b)
+{
+    ASSERT(buf);
+    ASSERT(buf->nlh);
+    ASSERT(b);
+    ASSERT(b->descs);
+    b->count = 0;
+    b->base = (const char*)buf->nlh;
+    b->buf = buf;
+    b->generation = buf->generation;
+
+    uint64_t mono_ns = 0;
+    if (!(buf->skip & NF_SKIP_TIMESTAMP))
+    {
+        struct timespec mono = buf->batch_mono;
+        if ((buf->timestamps & NF_TS_CLOCK_MASK) != NF_TS_BATCH)
+            read_clocks(buf->timestamps, &mono, NULL);
+        mono_ns = (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+    }
+
+    uint64_t bytes = 0;
+    while (b->count < b->capacity && mnl_nlmsg_ok(buf->nlh, buf->len))
+    {
+        if (buf->nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+        {
+            LOG(LOG_ERR, "Netlink dump interrupted");
+            if (b->count == 0)
+                return IO_ERROR;
+            break;
+        }
+        if (buf->nlh->nlmsg_type >= NLMSG_MIN_TYPE)
+        {
+            struct nf_packet_desc* d = &b->descs[b->count];
+            if (!nfqueue_parse_desc(buf->nlh, b->base, d, buf))
+            {
+                if (buf->stats)
+                    nfqueue_stats_add(&buf->stats->parse_errors, 1);
+                if (b->count == 0)
+                    return IO_ERROR;
+                break;
+            }
+            d->mono_ns = mono_ns;
+            bytes += d->orig_len;
+            b->count++;
+        }
+        else
+            nfqueue_control_msg(buf->nlh);
+        buf->nlh = mnl_nlmsg_next(buf->nlh, &buf->len);
+    }
+
+    if (buf->stats && b->count > 0)
+    {
+        nfqueue_stats_add(&buf->stats->packets, b->count);
+        nfqueue_stats_add(&buf->stats->bytes, bytes);
+    }
+    return b->count > 0? IO_READY : IO_NOTREADY;
+}
+
+
+//Return payload view of a descriptor, NULL if it has no payload
+//Valid until the next nfqueue_receive() on the buffer; may be modified in place and sent with nfqueue_verdict_payload()
+void* nfqueue_desc_payload(const struct nf_desc_batch* b, const struct nf_packet_desc* d)
+{
+    ASSERT(b);
+    ASSERT(d);
+    DEBUG_ASSERT(b->buf->generation == b->generation);
+    if (!(d->flags & NF_DESC_PAYLOAD))
+        return NULL;
+    return (char*)b->base + d->payload_offset;
+}
+
+
+//Return false on failure
+//Fill full packet object for descriptor, as nfqueue_next() would (subject to zero_copy and skip of the buffer)
+//Must be called before the next nfqueue_receive() on the buffer
+bool nfqueue_desc_packet(const struct nf_desc_batch* b, const struct nf_packet_desc* d, struct nf_packet* packet)
+{
+    ASSERT(b);
+    ASSERT(d);
+    ASSERT(packet);
+    DEBUG_ASSERT(b->buf->generation == b->generation);
+    if (!nfqueue_parse((const struct nlmsghdr*)(b->base + d->msg_offset), packet, b->buf))
+        return false;
+    packet->buffer = b->buf;
+    packet->generation = b->generation;
+    return true;
+}
+
+
+//Initialize slab allocator; assign &slab->allocator to nf_buffer.allocator to use it for payload copies
+void nfqueue_slab_init(struct nf_slab* slab)
+{
+    ASSERT(slab);
+    memset(slab, 0, sizeof(*slab));
+    slab->allocator.alloc = nfqueue_slab_alloc;
+    slab->allocator.free = nfqueue_slab_free;
+    slab->allocator.ctx = slab;
+}
+
+
+//All blocks must have been freed before this call
+void nfqueue_slab_destroy(struct nf_slab* slab)
+{
+    ASSERT(slab);
+    DEBUG_ASSERT(slab->allocs == atomic_load(&slab->frees));
+    void* chunk = slab->chunks;
+    while (chunk)
+    {
+        void* next = *(void**)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    memset(slab->local, 0, sizeof(slab->local));
+    for (int c = 0; c < NF_SLAB_CLASSES; c++)
+        atomic_store(&slab->remote[c], NULL);
+    slab->chunks = NULL;
+}
+
+
+//Counters may be read from any thread, though values updated by the owner thread may be slightly stale
+void nfqueue_slab_stats(struct nf_slab* slab, struct nf_slab_stats* stats)
+{
+    ASSERT(slab);
+    ASSERT(stats);
+    stats->allocs = slab->allocs;
+    stats->frees = atomic_load_explicit(&slab->frees, memory_order_relaxed);
+    stats->chunk_mallocs = slab->chunk_mallocs;
+    stats->large_mallocs = slab->large_mallocs;
+}
+
+
+/*
+Note about buffer ring
+
+nfqueue_receive() reads one datagram per syscall. Under load the socket holds many datagrams, and
+nfqueue_receive_ring() reads as many of them as are ready (up to ring depth) with one recvmmsg() call, each into
+its own slot. Packets from all filled slots are then returned by nfqueue_ring_next(), in order.
+Slot size should be large enough for the largest datagram (RECV_BUF_LEN, unless copy range is reduced); larger
+datagrams are dropped (logged and counted as parse errors) while other slots are still returned; their packets
+stay in the kernel queue unless a later batch verdict covers them. Payloads in zero-copy mode are valid until the next nfqueue_receive_ring().
+*/
+
+
+//Return false on failure
+//If slot_size is zero, RECV_BUF_LEN is used
+bool nfqueue_ring_init(struct nf_buffer_ring* ring, int depth, size_t slot_size)
+{
+    ASSERT(ring);
+    ASSERT(depth > 0);
+    memset(ring, 0, sizeof(*ring));
+    ring->depth = depth;
+    ring->slot_size = slot_size > 0? slot_size : (size_t)RECV_BUF_LEN;
+    ring->slots = calloc(depth, sizeof(struct nf_buffer));
+    ring->msgs = calloc(depth, sizeof(struct mmsghdr));
+    ring->iov = calloc(depth, sizeof(struct iovec));
+    ring->addr = calloc(depth, sizeof(struct sockaddr_nl));
+    if (!ring->slots || !ring->msgs || !ring->iov || !ring->addr)
+    {
+        LOG_SYSERR("calloc");
+        return false;
+    }
+    for (int i = 0; i < depth; i++)
+    {
+        ring->slots[i].data = malloc(ring->slot_size);
+        if (ring->slots[i].data == NULL)
+        {
+            LOG_SYSERR("malloc");
+            return false;
+        }
+        ring->iov[i].iov_base = ring->slots[i].data;
+        ring->iov[i].iov_len = ring->slot_size;
+    }
+    return true;
+}
+
+
+void nfqueue_ring_free(struct nf_buffer_ring* ring)
+{
+    ASSERT(ring);
+    for (int i = 0; ring->slots && i < ring->depth; i++)
+        free(ring->slots[i].data);
+    free(ring->slots);
+    free(ring->msgs);
+    free(ring->iov);
+    free(ring->addr);
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+//Return 1 on success, -1 on failure, 0 on timeout (if timeout_ms > 0) or data not ready
+//Timeout semantics are the same as in nfqueue_receive()
+int nfqueue_receive_ring(struct nf_queue* q, struct nf_buffer_ring* ring, int64_t timeout_ms)
+{
+    ASSERT(q);
+    ASSERT(q->nl_socket);
+    ASSERT(ring);
+    ASSERT(ring->slots);
+    ASSERT(q->backend == NF_BACKEND_RECVFROM);  //memory-mapped ring is read with nfqueue_receive()
+
+    ring->count = 0;
+    ring->current = 0;
+    int fd = mnl_socket_get_fd(q->nl_socket);
+
+    if (timeout_ms >= 0)
+    {
+        int retval = recv_timeout(fd, timeout_ms);
+        if (retval == 0)  //timeout
+            return IO_NOTREADY;
+        else if (retval < 1)  //error
+        {
+            if (errno == EINTR)
+                return IO_NOTREADY;
+            LOG_SYSERR("recv_timeout");
+            return IO_ERROR;
+        }
+    }
+
+    struct nf_stats_shard* stats = nfqueue_stats_shard(q);
+    for (int i = 0; i < ring->depth; i++)
+    {
+        struct nf_buffer* buf = &ring->slots[i];
+        buf->generation++;
+        buf->stats = stats;
+        buf->zero_copy = ring->zero_copy;
+        buf->allocator = ring->allocator;
+        buf->skip = ring->skip;
+        buf->timestamps = ring->timestamps;
+#ifdef NFQUEUE_MNL_DEBUG
+        if (buf->zero_copy)
+            memset(buf->data, 0xA5, ring->slot_size);
+#endif
+        struct msghdr* msg = &ring->msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &ring->addr[i];
+        msg->msg_namelen = sizeof(struct sockaddr_nl);
+        msg->msg_iov = &ring->iov[i];
+        msg->msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(fd, ring->msgs, ring->depth, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)  //no data
+        {
+            DEBUG("No data from Netlink socket");
+            return IO_NOTREADY;
+        }
+        if (errno == ENOBUFS)  //overrun, not fatal
+        {
+            nfqueue_overrun(q);
+            return IO_NOTREADY;
+        }
+        LOG_SYSERR("recvmmsg");
+        return IO_ERROR;
+    }
+    else if (n == 0)
+        return IO_NOTREADY;
+
+    //Same checks as in mnl_socket_recvfrom(); a rejected datagram leaves its slot empty, others are still returned
+    for (int i = 0; i < n; i++)
+    {
+        struct msghdr* msg = &ring->msgs[i].msg_hdr;
+        struct nf_buffer* buf = &ring->slots[i];
+        buf->len = ring->msgs[i].msg_len;
+        buf->nlh = (struct nlmsghdr*)buf->data;
+        if (msg->msg_flags & MSG_TRUNC)
+        {
+            LOG(LOG_ERR, "Datagram larger than slot size %zu dropped", ring->slot_size);
+            buf->len = 0;
+            nfqueue_stats_add(&stats->parse_errors, 1);
+        }
+        else if (msg->msg_namelen != sizeof(struct sockaddr_nl))
+        {
+            LOG(LOG_ERR, "Datagram with invalid source address length %u", msg->msg_namelen);
+            buf->len = 0;
+            nfqueue_stats_add(&stats->parse_errors, 1);
+        }
+    }
+
+    if ((ring->timestamps & NF_TS_CLOCK_MASK) == NF_TS_BATCH)
+    {
+        struct timespec mono, wall;
+        read_clocks(NF_TS_PRECISE, &mono, &wall);
+        for (int i = 0; i < n; i++)
+        {
+            ring->slots[i].batch_mono = mono;
+            ring->slots[i].batch_wall = wall;
+        }
     }
 
+    ring->count = n;
+    nfqueue_stats_add(&stats->batches, n);
+    DEBUG("Received %d datagrams from netfilter", n);
+    return IO_READY;
+}
+
+
+//Return 1 on success (result in packet), -1 on failure, 0 on no more data
+int nfqueue_ring_next(struct nf_buffer_ring* ring, struct nf_packet* packet)
+{
+    ASSERT(ring);
+    while (ring->current < ring->count)
+    {
+        int ret = nfqueue_next(&ring->slots[ring->current], packet);
+        if (ret != IO_NOTREADY)
+            return ret;
+        ring->current++;
+    }
     return IO_NOTREADY;
 }
 
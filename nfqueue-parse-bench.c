@@ -0,0 +1,344 @@
+/*
+ *  nfqueue-parse-bench - offline parser benchmark replaying netlink captures
+ *  Copyright (c) 2019 Maciej Puzio
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program - see the file COPYING.
+ */
+
+#include "nfqueue-mnl-capture.h"
+
+#include <getopt.h>                 //getopt
+#include <linux/perf_event.h>       //perf_event_attr
+#include <sys/ioctl.h>              //ioctl
+#include <sys/syscall.h>            //SYS_perf_event_open
+
+
+/*
+Usage
+
+Record datagrams from a live queue (needs root and a queueing rule); packets are accepted:
+    nfqueue-parse-bench -w capture.nfq -q 0 -n 10000
+Replay a capture through nfqueue_next() (no privileges needed), or nfqueue_next_batch() with -b:
+    nfqueue-parse-bench -i 100 -z capture.nfq
+
+Replay reports time per packet and, if perf events are available (see /proc/sys/kernel/perf_event_paranoid),
+cycles, instructions, branch misses and cache misses per packet, counted in user space only.
+*/
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Perf counters
+
+
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_CACHE_MISSES,
+    PERF_COUNT,
+};
+
+static const uint64_t perf_configs[PERF_COUNT] =
+{
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+struct perf_group
+{
+    int                fds[PERF_COUNT];
+    uint64_t           values[PERF_COUNT];
+    bool               enabled;
+};
+
+
+//Return false if counters are not available; the group leader (cycles) is required, other counters are optional
+static bool perf_open(struct perf_group* p)
+{
+    memset(p, 0, sizeof(*p));
+    for (int i = 0; i < PERF_COUNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        p->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0? -1 : p->fds[0], 0);
+        if (p->fds[i] < 0 && i == 0)
+            return false;
+    }
+    p->enabled = true;
+    return true;
+}
+
+
+static void perf_start(struct perf_group* p)
+{
+    if (!p->enabled)
+        return;
+    ioctl(p->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(p->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+
+static void perf_stop(struct perf_group* p)
+{
+    if (!p->enabled)
+        return;
+    ioctl(p->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (int i = 0; i < PERF_COUNT; i++)
+        if (p->fds[i] < 0 || read(p->fds[i], &p->values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            p->values[i] = 0;
+}
+
+
+static void perf_close(struct perf_group* p)
+{
+    for (int i = 0; i < PERF_COUNT && p->enabled; i++)
+        if (p->fds[i] >= 0)
+            close(p->fds[i]);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Record and replay
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static bool record(const char* path, int queue_num, uint64_t max_datagrams)
+{
+    struct nf_queue_options opt;
+    nfqueue_default_options(&opt);
+    struct nf_queue q[1];
+    if (!nfqueue_open2(q, queue_num, &opt))
+        return false;
+    struct nf_capture_writer w[1];
+    if (!nfqueue_capture_create(w, path, &opt))
+    {
+        nfqueue_close(q);
+        return false;
+    }
+
+    struct nf_buffer buf[1];
+    memset(buf, 0, sizeof(*buf));
+    buf->zero_copy = true;
+    buf->skip = NF_SKIP_PAYLOAD | NF_SKIP_CONNTRACK;
+    struct nf_verdict_queue vq[1];
+    bool ok = nfqueue_vq_init(vq, q, 0, 0, 0);
+    uint64_t packets = 0;
+    while (ok && w->datagrams < max_datagrams)
+    {
+        int ret = nfqueue_receive(q, buf, 0);
+        if (ret == IO_ERROR)
+            ok = false;
+        if (ret != IO_READY)
+            continue;
+        ok = nfqueue_capture_write(w, buf);
+        struct nf_packet packet[1];
+        while (nfqueue_next(buf, packet) == IO_READY)
+        {
+            nfqueue_vq_push(vq, packet->packet_id, NF_ACCEPT, -1);
+            packets++;
+        }
+        nfqueue_vq_flush(vq);
+    }
+
+    printf("%lu datagrams, %lu packets, %lu bytes written to %s\n",
+        (unsigned long)w->datagrams, (unsigned long)packets, (unsigned long)w->bytes, path);
+    ok = nfqueue_capture_close(w) && ok;
+    nfqueue_vq_free(vq);
+    free(buf->data);
+    nfqueue_close(q);
+    return ok;
+}
+
+
+static bool replay(const char* path, int iterations, struct nf_buffer* buf, struct nf_desc_batch* batch, struct perf_group* perf)
+{
+    struct nf_capture c[1];
+    if (!nfqueue_capture_map(c, path))
+        return false;
+
+    //One pass to warm up caches and count packets
+    uint64_t packets = 0, errors = 0, payload = 0;
+    while (nfqueue_capture_next(c, buf) == IO_READY)
+    {
+        struct nf_packet packet[1];
+        int ret;
+        while ((ret = nfqueue_next(buf, packet)) == IO_READY)
+        {
+            packets++;
+            nfqueue_packet_free(packet);
+        }
+        if (ret == IO_ERROR)
+            errors++;
+    }
+    if (packets == 0)
+    {
+        LOG(LOG_ERR, "No packets in %s", path);
+        nfqueue_capture_unmap(c);
+        return false;
+    }
+
+    perf_start(perf);
+    int64_t start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        nfqueue_capture_rewind(c);
+        while (nfqueue_capture_next(c, buf) == IO_READY)
+        {
+            if (batch)
+            {
+                while (nfqueue_next_batch(buf, batch) == IO_READY)
+                    for (uint32_t j = 0; j < batch->count; j++)
+                        payload += batch->descs[j].payload_len;
+                continue;
+            }
+            struct nf_packet packet[1];
+            while (nfqueue_next(buf, packet) == IO_READY)
+            {
+                payload += packet->payload_len;  //keep the result used
+                nfqueue_packet_free(packet);
+            }
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+    perf_stop(perf);
+
+    double n = (double)packets * iterations;
+    printf("%s: kernel %s, %lu datagrams, %lu packets, %lu unparsable datagrams\n", path, c->header->kernel,
+        (unsigned long)c->datagrams, (unsigned long)packets, (unsigned long)errors);
+    printf("  %.1f ns/packet, %.2f Mpps (%lu payload bytes)\n", elapsed / n, n / elapsed * 1e3, (unsigned long)payload);
+    if (perf->enabled)
+    {
+        printf("  %.1f cycles, %.1f instructions (IPC %.2f), %.2f branch misses, %.2f cache misses per packet\n",
+            perf->values[PERF_CYCLES] / n, perf->values[PERF_INSTRUCTIONS] / n,
+            perf->values[PERF_CYCLES]? (double)perf->values[PERF_INSTRUCTIONS] / perf->values[PERF_CYCLES] : 0,
+            perf->values[PERF_BRANCH_MISSES] / n, perf->values[PERF_CACHE_MISSES] / n);
+    }
+    nfqueue_capture_unmap(c);
+    return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] capture-file...\n"
+        "       %s -w capture-file -q queue-num [-n datagrams]\n"
+        "Replay options:\n"
+        "  -i NUM    iterations over every capture (default 100)\n"
+        "  -z        zero-copy payloads (default: copy)\n"
+        "  -b        parse into packet descriptors with nfqueue_next_batch()\n"
+        "  -s FLAGS  NF_SKIP_* flags: p (payload), t (timestamp), c (conntrack), r (reply)\n"
+        "  -t CLOCK  timestamp policy: precise (default), batch, coarse or tsc\n",
+        prog, prog);
+    DIE();
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* output = NULL;
+    int queue_num = -1;
+    uint64_t max_datagrams = 10000;
+    int iterations = 100;
+    bool use_batch = false;
+    struct nf_buffer buf[1];
+    memset(buf, 0, sizeof(*buf));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:q:n:i:zbs:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w': output = optarg; break;
+            case 'q': queue_num = atoi(optarg); break;
+            case 'n': max_datagrams = strtoull(optarg, NULL, 0); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 'z': buf->zero_copy = true; break;
+            case 'b': use_batch = true; break;
+            case 's':
+                for (const char* f = optarg; *f; f++)
+                {
+                    switch (*f)
+                    {
+                        case 'p': buf->skip |= NF_SKIP_PAYLOAD; break;
+                        case 't': buf->skip |= NF_SKIP_TIMESTAMP; break;
+                        case 'c': buf->skip |= NF_SKIP_CONNTRACK; break;
+                        case 'r': buf->skip |= NF_SKIP_REPLY; break;
+                        default: usage(argv[0]);
+                    }
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "precise") == 0)
+                    buf->timestamps = NF_TS_PRECISE;
+                else if (strcmp(optarg, "batch") == 0)
+                    buf->timestamps = NF_TS_BATCH;
+                else if (strcmp(optarg, "coarse") == 0)
+                    buf->timestamps = NF_TS_COARSE;
+                else if (strcmp(optarg, "tsc") == 0)
+                    buf->timestamps = NF_TS_TSC;
+                else
+                    usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (output)
+    {
+        if (queue_num < 0 || optind != argc)
+            usage(argv[0]);
+        return record(output, queue_num, max_datagrams)? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (optind == argc || iterations < 1)
+        usage(argv[0]);
+
+    struct perf_group perf;
+    if (!perf_open(&perf))
+        LOG(LOG_WARNING, "Perf counters not available: %s", strerror(errno));
+    if ((buf->timestamps & NF_TS_CLOCK_MASK) == NF_TS_TSC)
+        nfqueue_tsc_calibrate();
+
+    struct nf_desc_batch batch[1];
+    if (use_batch && !nfqueue_desc_batch_init(batch, 1024))
+        return EXIT_FAILURE;
+
+    bool ok = true;
+    for (int i = optind; i < argc; i++)
+        ok = replay(argv[i], iterations, buf, use_batch? batch : NULL, &perf) && ok;
+    perf_close(&perf);
+    if (use_batch)
+        nfqueue_desc_batch_free(batch);
+    return ok? EXIT_SUCCESS : EXIT_FAILURE;
+}
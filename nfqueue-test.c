@@ -105,8 +105,8 @@ static void print_conn_status(uint32_t status)
 static void print_packet(struct nf_packet* p)
 {
     printf("Netlink packet --------------\n");
-    printf("  ID=%u Queue=%d PayLen=%lu Proto=%04x Family=%s\n",
-        p->packet_id, p->queue_num, p->payload_len, p->hw_protocol,
+    printf("  ID=%u Queue=%d PayLen=%lu OrigLen=%lu Proto=%04x Family=%s\n",
+        p->packet_id, p->queue_num, p->payload_len, p->orig_len, p->hw_protocol,
         p->has_conntrack? (p->orig.ip_version == IPV4? "IPv4": p->orig.ip_version == IPV6? "IPv6": "UNRECOGNIZED") : "N/A");
     printf("  Optional:%s%s%s\n", p->has_timestamp? " ts" : "", p->has_conntrack? " ct" : "", p->has_connmark? " cm" : "");
     if (p->has_timestamp)